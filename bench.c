@@ -0,0 +1,536 @@
+/*
+ * file:        bench.c
+ * description: microbenchmarks for the CS 5600 file system. Like the
+ *              unit tests, this calls fs_ops directly in-process,
+ *              against freshly formatted images of several sizes.
+ *
+ * usage: ./bench [-n iterations]
+ *
+ * Output is CSV on stdout, one line per (image size, scenario):
+ *   blocks,scenario,size,ops,ops_per_sec,p50_us,p90_us,p99_us,max_us
+ * where 'size' is the I/O size for the read/write scenarios, and the
+ * path depth or number of entries for the metadata ones.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define FUSE_USE_VERSION 26
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <fuse.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "fs5600.h"
+#include "disk.h"
+#include "cache.h"
+
+extern struct fuse_operations fs_ops;
+extern int fs_log_writes;
+
+#define IMAGE "bench.img"
+#define ROOT_INUM 2 // as in homework.c
+
+/* Mock fuse_get_context, as in the unit tests */
+static struct fuse_context ctx = {.uid = 500, .gid = 500};
+struct fuse_context *fuse_get_context(void)
+{
+    return &ctx;
+}
+
+/* image sizes (in blocks) to run every scenario against. The bitmap
+ * is a single block, which caps an image at 8 * FS_BLOCK_SIZE blocks.
+ */
+static int image_sizes[] = {400, 4096, 8 * FS_BLOCK_SIZE};
+#define N_IMAGE_SIZES (sizeof(image_sizes) / sizeof(image_sizes[0]))
+
+/* I/O sizes for the read/write scenarios */
+static int io_sizes[] = {512, 4096, 16384};
+#define N_IO_SIZES (sizeof(io_sizes) / sizeof(io_sizes[0]))
+
+/* largest file the file system supports (10 direct blocks) */
+#define MAX_FILE_SIZE (10 * FS_BLOCK_SIZE)
+
+static int iterations = 1000;
+static int disk_blocks;
+
+/* Latency samples for the current scenario, in nanoseconds
+ */
+static uint64_t *samples;
+static int n_samples;
+
+/* wall-clock time of a multi-threaded scenario; ops_per_sec is then
+ * the total rate rather than one thread's
+ */
+static uint64_t wall_ns;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void start_scenario(void)
+{
+    n_samples = 0;
+    wall_ns = 0;
+}
+
+/* Time one call. The expression is evaluated once; a failure aborts the
+ * run, since the numbers would be meaningless.
+ */
+#define TIMED(expr)                                                      \
+    do {                                                                 \
+        uint64_t _t0 = now_ns();                                         \
+        int _rv = (expr);                                                \
+        samples[n_samples++] = now_ns() - _t0;                           \
+        if (_rv < 0) {                                                   \
+            fprintf(stderr, "%s:%d: %s failed: %s\n", __FILE__, __LINE__, \
+                    #expr, strerror(-_rv));                              \
+            exit(1);                                                     \
+        }                                                                \
+    } while (0)
+
+static double pct(double p)
+{
+    int i = (int)(p * (n_samples - 1) + 0.5);
+    return samples[i] / 1000.0;
+}
+
+static void report(const char *scenario, int size)
+{
+    if (n_samples == 0)
+        return;
+
+    uint64_t total = 0;
+    for (int i = 0; i < n_samples; i++)
+        total += samples[i];
+    if (wall_ns != 0)
+        total = wall_ns;
+    qsort(samples, n_samples, sizeof(samples[0]), cmp_u64);
+
+    printf("%d,%s,%d,%d,%.0f,%.2f,%.2f,%.2f,%.2f\n", disk_blocks, scenario, size,
+           n_samples, n_samples / (total / 1e9), pct(0.50), pct(0.90), pct(0.99),
+           samples[n_samples - 1] / 1000.0);
+    fflush(stdout);
+}
+
+/* Write an empty file system: superblock, bitmap, and a root directory
+ * with no blocks (the first entry added allocates one).
+ */
+static void make_image(const char *name, int nblocks)
+{
+    char block[FS_BLOCK_SIZE];
+    FILE *fp = fopen(name, "w");
+    if (fp == NULL)
+    {
+        perror(name);
+        exit(1);
+    }
+
+    struct fs_super *sb = (void *)block;
+    memset(block, 0, sizeof(block));
+    sb->magic = FS_MAGIC;
+    sb->disk_size = nblocks;
+    sb->free_blocks = nblocks - 3;
+    sb->state = FS_STATE_CLEAN;
+    fwrite(block, sizeof(block), 1, fp);
+
+    memset(block, 0, sizeof(block));
+    block[0] = 0x07; /* super, bitmap, root */
+    fwrite(block, sizeof(block), 1, fp);
+
+    struct fs_inode *root = (void *)block;
+    memset(block, 0, sizeof(block));
+    root->mode = S_IFDIR | 0777;
+    root->ctime = root->mtime = time(NULL);
+    fwrite(block, sizeof(block), 1, fp);
+
+    memset(block, 0, sizeof(block));
+    for (int i = 3; i < nblocks; i++)
+        fwrite(block, sizeof(block), 1, fp);
+    fclose(fp);
+}
+
+static void mount_image(int nblocks)
+{
+    make_image(IMAGE, nblocks);
+    disk_init(IMAGE);
+    fs_ops.init(NULL);
+    disk_blocks = nblocks;
+}
+
+/* number of files we can afford in one directory on this image,
+ * leaving room for the other scenarios. A directory holds at most
+ * 10 blocks; names like "f999" take 12 bytes each, 341 per block.
+ */
+static int dir_capacity(void)
+{
+    int n = disk_blocks / 4;
+    return n > 1000 ? 1000 : n;
+}
+
+/****** SCENARIOS ******/
+
+/* getattr on a file at the bottom of a deep directory tree
+ */
+static void bench_getattr_deep(void)
+{
+    char path[256] = "";
+    struct stat sb;
+
+    for (int i = 0; i < 8; i++)
+    {
+        strcat(path, "/deepdir");
+        fs_ops.mkdir(path, 0755);
+    }
+    strcat(path, "/file");
+    fs_ops.create(path, 0644 | S_IFREG, NULL);
+
+    start_scenario();
+    for (int i = 0; i < iterations; i++)
+        TIMED(fs_ops.getattr(path, &sb));
+    report("getattr_deep", 9);
+}
+
+/* getattr on the same deep path from several threads at once, while
+ * the main thread keeps changing the file's mode. 'size' is the number
+ * of reader threads.
+ */
+#define MAX_THREADS 4
+
+static const char *par_path;
+static int par_done;
+
+static void *getattr_worker(void *arg)
+{
+    uint64_t *out = arg;
+    struct stat sb;
+    for (int i = 0; i < iterations; i++)
+    {
+        uint64_t t0 = now_ns();
+        fs_ops.getattr(par_path, &sb);
+        out[i] = now_ns() - t0;
+    }
+    __atomic_fetch_add(&par_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void bench_getattr_parallel(void)
+{
+    char path[256] = "";
+    pthread_t tids[MAX_THREADS];
+
+    for (int i = 0; i < 8; i++)
+    {
+        strcat(path, "/pardir");
+        fs_ops.mkdir(path, 0755);
+    }
+    strcat(path, "/file");
+    fs_ops.create(path, 0644 | S_IFREG, NULL);
+    par_path = path;
+
+    for (int n = 1; n <= MAX_THREADS; n *= 2)
+    {
+        start_scenario();
+        uint64_t t0 = now_ns();
+        for (int i = 0; i < n; i++)
+            pthread_create(&tids[i], NULL, getattr_worker, samples + i * iterations);
+        for (int i = 0; i < n; i++)
+            pthread_join(tids[i], NULL);
+        wall_ns = now_ns() - t0;
+        n_samples = n * iterations;
+        report("getattr_par", n);
+    }
+
+    /* the same, with a writer changing the file underneath */
+    par_done = 0;
+    start_scenario();
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < MAX_THREADS; i++)
+        pthread_create(&tids[i], NULL, getattr_worker, samples + i * iterations);
+    for (int i = 0; __atomic_load_n(&par_done, __ATOMIC_ACQUIRE) < MAX_THREADS; i++)
+        fs_ops.chmod(path, i % 2 ? 0600 : 0644);
+    for (int i = 0; i < MAX_THREADS; i++)
+        pthread_join(tids[i], NULL);
+    wall_ns = now_ns() - t0;
+    n_samples = MAX_THREADS * iterations;
+    report("getattr_par_chmod", MAX_THREADS);
+}
+
+static int null_filler(void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+    return 0;
+}
+
+/* readdir on a directory with as many entries as the image allows
+ */
+static void bench_readdir_full(void)
+{
+    char path[64];
+    int n = dir_capacity();
+
+    fs_ops.mkdir("/fulldir", 0755);
+    for (int i = 0; i < n; i++)
+    {
+        sprintf(path, "/fulldir/f%d", i);
+        fs_ops.create(path, 0644 | S_IFREG, NULL);
+    }
+
+    start_scenario();
+    for (int i = 0; i < iterations / 10 + 1; i++)
+        TIMED(fs_ops.readdir("/fulldir", NULL, null_filler, 0, NULL));
+    report("readdir_full", n);
+
+    for (int i = 0; i < n; i++)
+    {
+        sprintf(path, "/fulldir/f%d", i);
+        fs_ops.unlink(path);
+    }
+    fs_ops.rmdir("/fulldir");
+}
+
+/* directory scans: lookups of a name in the last block of a large
+ * directory, and of one that isn't there, which read every block.
+ * 22-byte names make 32-byte entries, 128 to a block, so the per-block
+ * scan cost is p50 / ceil(size / 128). The name found is dropped from
+ * the dentry cache before each lookup, or only the first would scan;
+ * names that aren't there are never cached.
+ */
+static void bench_dirscan(void)
+{
+    char path[64];
+    struct stat sb;
+    int n = dir_capacity();
+
+    fs_ops.mkdir("/scandir", 0755);
+    for (int i = 0; i < n; i++)
+    {
+        sprintf(path, "/scandir/dirscan-entry-%08d", i);
+        fs_ops.create(path, 0644 | S_IFREG, NULL);
+    }
+
+    fs_ops.getattr("/scandir", &sb);
+    int dir = dcache_lookup(ROOT_INUM, "scandir", 7);
+    const char *name = path + strlen("/scandir/");
+    start_scenario();
+    for (int i = 0; i < iterations; i++)
+    {
+        dcache_drop(dir, name, strlen(name));
+        TIMED(fs_ops.getattr(path, &sb));
+    }
+    report("dirscan_hit", n);
+
+    start_scenario();
+    for (int i = 0; i < iterations; i++)
+        TIMED(fs_ops.getattr("/scandir/dirscan-entry-missing0", &sb) == -ENOENT ? 0 : -EIO);
+    report("dirscan_miss", n);
+
+    for (int i = 0; i < n; i++)
+    {
+        sprintf(path, "/scandir/dirscan-entry-%08d", i);
+        fs_ops.unlink(path);
+    }
+    fs_ops.rmdir("/scandir");
+}
+
+/* sequential and random reads and writes of a max-size file, and
+ * random writes again in log mode
+ */
+static void bench_read_write(void)
+{
+    char *buf = malloc(MAX_FILE_SIZE);
+    memset(buf, 'x', MAX_FILE_SIZE);
+
+    fs_ops.create("/rwfile", 0644 | S_IFREG, NULL);
+    fs_ops.write("/rwfile", buf, MAX_FILE_SIZE, 0, NULL);
+    srandom(5600);
+
+    for (int j = 0; j < (int)N_IO_SIZES; j++)
+    {
+        int size = io_sizes[j];
+        int nchunks = MAX_FILE_SIZE / size;
+
+        start_scenario();
+        for (int i = 0; i < iterations; i++)
+            TIMED(fs_ops.write("/rwfile", buf, size, (off_t)(i % nchunks) * size, NULL));
+        report("seq_write", size);
+
+        start_scenario();
+        for (int i = 0; i < iterations; i++)
+            TIMED(fs_ops.read("/rwfile", buf, size, (off_t)(i % nchunks) * size, NULL));
+        report("seq_read", size);
+
+        start_scenario();
+        for (int i = 0; i < iterations; i++)
+            TIMED(fs_ops.write("/rwfile", buf, size, (off_t)(random() % nchunks) * size, NULL));
+        report("rand_write", size);
+
+        fs_log_writes = 1;
+        start_scenario();
+        for (int i = 0; i < iterations; i++)
+            TIMED(fs_ops.write("/rwfile", buf, size, (off_t)(random() % nchunks) * size, NULL));
+        report("rand_write_log", size);
+        fs_log_writes = 0;
+
+        start_scenario();
+        for (int i = 0; i < iterations; i++)
+            TIMED(fs_ops.read("/rwfile", buf, size, (off_t)(random() % nchunks) * size, NULL));
+        report("rand_read", size);
+    }
+
+    fs_ops.unlink("/rwfile");
+    free(buf);
+}
+
+/* create and unlink many small files in one directory
+ */
+static void bench_create_unlink(void)
+{
+    char path[64];
+    int n = dir_capacity();
+
+    fs_ops.mkdir("/storm", 0755);
+
+    start_scenario();
+    for (int i = 0; i < n; i++)
+    {
+        sprintf(path, "/storm/f%d", i);
+        TIMED(fs_ops.create(path, 0644 | S_IFREG, NULL));
+    }
+    report("create", n);
+
+    start_scenario();
+    for (int i = 0; i < n; i++)
+    {
+        sprintf(path, "/storm/f%d", i);
+        TIMED(fs_ops.unlink(path));
+    }
+    report("unlink", n);
+
+    fs_ops.rmdir("/storm");
+}
+
+/* build and tear down a directory tree: fanout 4, depth 3, with a
+ * small file in every directory
+ */
+static void build_tree(const char *dir, int depth, int mkfiles)
+{
+    char path[256];
+
+    sprintf(path, "%s/file", dir);
+    if (mkfiles)
+    {
+        TIMED(fs_ops.create(path, 0644 | S_IFREG, NULL));
+        TIMED(fs_ops.write(path, path, strlen(path), 0, NULL));
+    }
+    for (int i = 0; depth > 0 && i < 4; i++)
+    {
+        sprintf(path, "%s/d%d", dir, i);
+        if (mkfiles)
+            TIMED(fs_ops.mkdir(path, 0755));
+        build_tree(path, depth - 1, mkfiles);
+        if (!mkfiles)
+            TIMED(fs_ops.rmdir(path));
+    }
+    if (!mkfiles)
+    {
+        sprintf(path, "%s/file", dir);
+        TIMED(fs_ops.unlink(path));
+    }
+}
+
+static void bench_tree(void)
+{
+    /* 85 directories (2 blocks each) + 85 inline files */
+    start_scenario();
+    fs_ops.mkdir("/tree", 0755);
+    build_tree("/tree", 3, 1);
+    report("tree_build", 85);
+
+    start_scenario();
+    build_tree("/tree", 3, 0);
+    fs_ops.rmdir("/tree");
+    report("tree_remove", 85);
+}
+
+/* mount and statfs, after a clean unmount and after none (when the
+ * bitmap has to be read and indexed)
+ */
+static int remount(int clean)
+{
+    struct statvfs st;
+    if (clean)
+        fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    return fs_ops.statfs("/", &st);
+}
+
+static void bench_mount(void)
+{
+    int n = iterations < 1000 ? iterations : 1000;
+
+    start_scenario();
+    for (int i = 0; i < n; i++)
+        TIMED(remount(1));
+    report("mount_clean", 0);
+
+    /* any allocation leaves the image not clean */
+    fs_ops.create("/mountfile", 0644 | S_IFREG, NULL);
+    start_scenario();
+    for (int i = 0; i < n; i++)
+        TIMED(remount(0));
+    report("mount_unclean", 0);
+    fs_ops.destroy(NULL);
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    while ((c = getopt(argc, argv, "n:")) != -1)
+    {
+        if (c == 'n')
+            iterations = atoi(optarg);
+        else
+        {
+            fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    /* enough room for the largest scenario */
+    samples = malloc(sizeof(*samples) * (iterations * MAX_THREADS + 2000));
+
+    printf("blocks,scenario,size,ops,ops_per_sec,p50_us,p90_us,p99_us,max_us\n");
+    for (int i = 0; i < (int)N_IMAGE_SIZES; i++)
+    {
+        fprintf(stderr, "[bench] %d-block image\n", image_sizes[i]);
+        mount_image(image_sizes[i]);
+
+        bench_getattr_deep();
+        bench_getattr_parallel();
+        bench_readdir_full();
+        bench_dirscan();
+        bench_read_write();
+        bench_create_unlink();
+        bench_tree();
+        bench_mount();
+    }
+
+    unlink(IMAGE);
+    free(samples);
+    return 0;
+}
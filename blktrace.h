@@ -0,0 +1,34 @@
+/*
+ * file:        blktrace.h
+ * description: on-disk format of block I/O traces, as written by
+ *              hw3fuse -blktrace and replayed by ./replay
+ *
+ * A trace is a header followed by one record per block_read,
+ * block_write or zero-copy transfer, in the order they were issued.
+ */
+
+#ifndef __BLKTRACE_H__
+#define __BLKTRACE_H__
+
+#include <stdint.h>
+
+#define BLKTRACE_MAGIC 0x424c4b31       /* "BLK1" */
+
+enum { BLKTRACE_READ = 0, BLKTRACE_WRITE = 1 };
+
+struct blktrace_hdr {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t disk_size;         /* blocks, from the superblock if known */
+    uint32_t pad;
+};
+
+struct blktrace_rec {
+    uint64_t ts;                /* ns since the trace was started */
+    uint32_t lba;
+    uint16_t nblks;
+    uint8_t  rw;                /* BLKTRACE_READ or BLKTRACE_WRITE */
+    uint8_t  pad;
+};
+
+#endif
@@ -0,0 +1,525 @@
+/*
+ * file:        cache.c
+ * description: in-memory metadata caches for the CS 5600 file system.
+ *
+ * The block cache holds inode and directory blocks. It is write
+ * through, so the image is always current and the zero-copy paths in
+ * read_buf/write_buf can keep going straight to the image fd; the
+ * only rule is that blocks written behind the cache's back, or freed,
+ * get dropped (bcache_drop). The dentry cache maps (directory, name)
+ * to an inode, and its entries are dropped when the name is removed
+ * or renamed.
+ *
+ * Both are hash tables, with entries and block buffers from slab
+ * caches (see slab.h). Changes are made under one mutex, but lookups
+ * take no lock, so getattr and path lookup don't wait for writers:
+ *  - hash chains are RCU-style. Entries are published with a release
+ *    store and unlinked without disturbing their own 'next' pointer,
+ *    and an unlinked entry is only freed once every reader that might
+ *    still hold it has finished (see rcu_synchronize).
+ *  - a cached block's contents are guarded by a seqlock: a reader
+ *    copies the block and retries if a writer was in it meanwhile.
+ *  - eviction is CLOCK rather than LRU, so a hit only sets a flag
+ *    instead of relinking the entry.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "fs5600.h"
+#include "slab.h"
+#include "cache.h"
+#include "disk.h"
+
+#define BCACHE_BUCKETS 1024
+#define BCACHE_MAX 2048 // 8 MB of blocks
+#define DCACHE_BUCKETS 1024
+#define DCACHE_MAX 4096
+
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+/* CLOCK list: new entries go on the head, the victim is taken from the
+ * tail, and an entry referenced since it was last looked at gets
+ * another trip round instead. First in each entry, so a list node is
+ * its entry.
+ */
+struct clock
+{
+    struct clock *prev, *next;
+    int referenced;
+};
+
+struct bcache_ent
+{
+    struct clock clock;
+    struct bcache_ent *hnext;
+    int lba;
+    unsigned seq; // odd while the data is being changed
+    char *data;
+};
+
+struct dentry
+{
+    struct clock clock;
+    struct dentry *hnext;
+    int dir, inum;
+    int len;
+    char name[FS_NAME_MAX];
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static struct slab_cache *bcache_slab, *block_slab, *dentry_slab;
+
+static struct bcache_ent *bcache_hash[BCACHE_BUCKETS];
+static struct clock bcache_clock = {&bcache_clock, &bcache_clock, 0};
+static int bcache_count;
+static uint64_t bcache_gen; // bumped whenever a block leaves the cache
+
+static struct dentry *dcache_hash[DCACHE_BUCKETS];
+static struct clock dcache_clock = {&dcache_clock, &dcache_clock, 0};
+static int dcache_count;
+static uint64_t dcache_gen; // bumped by every drop
+
+static void cache_setup(void)
+{
+    bcache_slab = slab_create("bcache", sizeof(struct bcache_ent), 0);
+    block_slab = slab_create("block", FS_BLOCK_SIZE, SLAB_HUGEPAGE);
+    dentry_slab = slab_create("dentry", sizeof(struct dentry), 0);
+}
+
+/****** READ-SIDE CRITICAL SECTIONS ******/
+
+/* Each reading thread has a slot holding the epoch it started reading
+ * in, or 0 when it isn't reading. To retire an entry, a writer bumps
+ * the epoch and waits until no slot holds an older one. Threads past
+ * RCU_MAX_THREADS fall back to taking the mutex.
+ */
+#define RCU_MAX_THREADS 256
+
+struct rcu_slot
+{
+    uint64_t epoch;
+    int used;
+} __attribute__((aligned(64)));
+
+static struct rcu_slot rcu_slots[RCU_MAX_THREADS];
+static int rcu_nslots; // high-water mark
+static uint64_t rcu_epoch = 1;
+static pthread_mutex_t rcu_reg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t rcu_key;
+static pthread_once_t rcu_once = PTHREAD_ONCE_INIT;
+static __thread struct rcu_slot *rcu_self;
+static __thread int rcu_registered;
+
+static void rcu_release(void *arg)
+{
+    struct rcu_slot *slot = arg;
+    STORE(&slot->epoch, 0);
+    STORE(&slot->used, 0);
+}
+
+static void rcu_key_create(void)
+{
+    pthread_key_create(&rcu_key, rcu_release);
+}
+
+static void rcu_register(void)
+{
+    rcu_registered = 1;
+    pthread_once(&rcu_once, rcu_key_create);
+
+    pthread_mutex_lock(&rcu_reg_lock);
+    for (int i = 0; i < RCU_MAX_THREADS; i++)
+    {
+        if (!rcu_slots[i].used)
+        {
+            rcu_slots[i].used = 1;
+            rcu_self = &rcu_slots[i];
+            if (i >= rcu_nslots)
+                STORE(&rcu_nslots, i + 1);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rcu_reg_lock);
+
+    if (rcu_self != NULL)
+        pthread_setspecific(rcu_key, rcu_self);
+}
+
+static void rcu_read_lock(void)
+{
+    if (!rcu_registered)
+        rcu_register();
+    if (rcu_self == NULL)
+    {
+        pthread_mutex_lock(&cache_lock);
+        return;
+    }
+    __atomic_store_n(&rcu_self->epoch, LOAD(&rcu_epoch), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // publish before reading entries
+}
+
+static void rcu_read_unlock(void)
+{
+    if (rcu_self == NULL)
+    {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+    STORE(&rcu_self->epoch, 0);
+}
+
+/* wait until every reader that started before now has finished.
+ * Called with cache_lock held.
+ */
+static void rcu_synchronize(void)
+{
+    uint64_t now = __atomic_add_fetch(&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+    int n = LOAD(&rcu_nslots);
+    for (int i = 0; i < n; i++)
+    {
+        uint64_t e;
+        while ((e = LOAD(&rcu_slots[i].epoch)) != 0 && e < now)
+            sched_yield();
+    }
+}
+
+/* Unlinked entries and buffers, waiting to go back to their slabs */
+#define RETIRE_MAX 64
+
+static struct
+{
+    struct slab_cache *slab;
+    void *obj;
+} retired[RETIRE_MAX];
+static int n_retired;
+
+static void retire_flush(void)
+{
+    if (n_retired == 0)
+        return;
+    rcu_synchronize();
+    for (int i = 0; i < n_retired; i++)
+        slab_free(retired[i].slab, retired[i].obj);
+    n_retired = 0;
+}
+
+/* free 'obj' once no reader can see it. Called with cache_lock held. */
+static void retire(struct slab_cache *slab, void *obj)
+{
+    if (n_retired == RETIRE_MAX)
+        retire_flush();
+    retired[n_retired].slab = slab;
+    retired[n_retired].obj = obj;
+    n_retired++;
+}
+
+/****** CLOCK ******/
+
+static void clock_unlink(struct clock *n)
+{
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+}
+
+static void clock_push(struct clock *head, struct clock *n)
+{
+    n->referenced = 0;
+    n->next = head->next;
+    n->prev = head;
+    head->next->prev = n;
+    head->next = n;
+}
+
+/* the entry to evict: the oldest that hasn't been used lately */
+static struct clock *clock_victim(struct clock *head)
+{
+    for (;;)
+    {
+        struct clock *n = head->prev;
+        if (!__atomic_exchange_n(&n->referenced, 0, __ATOMIC_RELAXED))
+            return n;
+        clock_unlink(n);
+        clock_push(head, n);
+    }
+}
+
+/* note a hit, without dirtying the cache line if it's already set */
+static void clock_ref(struct clock *n)
+{
+    if (!__atomic_load_n(&n->referenced, __ATOMIC_RELAXED))
+        __atomic_store_n(&n->referenced, 1, __ATOMIC_RELAXED);
+}
+
+/****** BLOCK CACHE ******/
+
+static unsigned bcache_bucket(int lba)
+{
+    return ((unsigned)lba * 2654435761u) % BCACHE_BUCKETS;
+}
+
+/* safe with cache_lock held or inside rcu_read_lock */
+static struct bcache_ent *bcache_find(int lba)
+{
+    struct bcache_ent *e = LOAD(&bcache_hash[bcache_bucket(lba)]);
+    while (e != NULL && e->lba != lba)
+        e = LOAD(&e->hnext);
+    return e;
+}
+
+/* unlink 'e', dropped or evicted. A read that missed before 'e' was
+ * last written may hold older contents from disk, and once 'e' is gone
+ * only the generation stops it caching them (see bcache_read). */
+static void bcache_remove(struct bcache_ent *e)
+{
+    STORE(&bcache_gen, bcache_gen + 1);
+    struct bcache_ent **pp = &bcache_hash[bcache_bucket(e->lba)];
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    STORE(pp, e->hnext);
+    clock_unlink(&e->clock);
+    retire(block_slab, e->data);
+    retire(bcache_slab, e);
+    bcache_count--;
+}
+
+/* cache a copy of 'buf' as block 'lba'. Called with cache_lock held;
+ * failing to allocate just means the block isn't cached.
+ */
+static void bcache_insert(int lba, const void *buf)
+{
+    struct bcache_ent *e = bcache_find(lba);
+    if (e != NULL)
+    {
+        // seqlock write side: readers retry while seq is odd or changed
+        STORE(&e->seq, e->seq + 1);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(e->data, buf, FS_BLOCK_SIZE);
+        STORE(&e->seq, e->seq + 1);
+        clock_ref(&e->clock);
+        return;
+    }
+
+    if (bcache_count >= BCACHE_MAX)
+        bcache_remove((struct bcache_ent *)clock_victim(&bcache_clock));
+    if ((e = slab_alloc(bcache_slab)) == NULL)
+        return;
+    if ((e->data = slab_alloc(block_slab)) == NULL)
+    {
+        slab_free(bcache_slab, e);
+        return;
+    }
+    e->lba = lba;
+    e->seq = 0;
+    memcpy(e->data, buf, FS_BLOCK_SIZE);
+    unsigned b = bcache_bucket(lba);
+    e->hnext = bcache_hash[b];
+    clock_push(&bcache_clock, &e->clock);
+    STORE(&bcache_hash[b], e); // publish
+    bcache_count++;
+}
+
+/* copy out a consistent version of e's block */
+static void bcache_copy(struct bcache_ent *e, void *buf)
+{
+    for (;;)
+    {
+        unsigned seq = LOAD(&e->seq);
+        if (seq & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        memcpy(buf, e->data, FS_BLOCK_SIZE);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq)
+            return;
+    }
+}
+
+int bcache_read(void *buf, int lba, enum stats_cache kind)
+{
+    pthread_once(&cache_once, cache_setup);
+
+    rcu_read_lock();
+    struct bcache_ent *e = bcache_find(lba);
+    if (e != NULL)
+    {
+        bcache_copy(e, buf);
+        clock_ref(&e->clock);
+        rcu_read_unlock();
+        stats_cache_access(kind, 1);
+        return 0;
+    }
+    uint64_t gen = LOAD(&bcache_gen);
+    rcu_read_unlock();
+    stats_cache_access(kind, 0);
+
+    if (disk_read(buf, lba, 1) < 0)
+        return -EIO;
+
+    // Don't cache what we read if any block left the cache meanwhile;
+    // a write in the meantime has cached its own copy, which wins
+    // unless it has been evicted or dropped since.
+    pthread_mutex_lock(&cache_lock);
+    if (bcache_gen == gen && bcache_find(lba) == NULL)
+        bcache_insert(lba, buf);
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+int bcache_write(const void *buf, int lba)
+{
+    pthread_once(&cache_once, cache_setup);
+
+    pthread_mutex_lock(&cache_lock);
+    bcache_insert(lba, buf);
+    pthread_mutex_unlock(&cache_lock);
+
+    if (disk_write((void *)buf, lba, 1) < 0)
+    {
+        bcache_drop(lba, 1); // don't keep what the disk doesn't have
+        return -EIO;
+    }
+    return 0;
+}
+
+void bcache_drop(int lba, int nblks)
+{
+    pthread_mutex_lock(&cache_lock);
+    STORE(&bcache_gen, bcache_gen + 1);
+    for (int i = 0; i < nblks && bcache_count > 0; i++)
+    {
+        struct bcache_ent *e = bcache_find(lba + i);
+        if (e != NULL)
+            bcache_remove(e);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/****** DENTRY CACHE ******/
+
+static unsigned dcache_bucket(int dir, const char *name, int len)
+{
+    uint32_t h = 2166136261u ^ (uint32_t)dir;
+    for (int i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h % DCACHE_BUCKETS;
+}
+
+/* the link pointing at the entry for (dir, name), or at the NULL that
+ * ends its chain. Safe with cache_lock held or inside rcu_read_lock.
+ */
+static struct dentry **dcache_find(int dir, const char *name, int len)
+{
+    struct dentry **pp = &dcache_hash[dcache_bucket(dir, name, len)];
+    struct dentry *d;
+    while ((d = LOAD(pp)) != NULL &&
+           (d->dir != dir || d->len != len || memcmp(d->name, name, len) != 0))
+        pp = &d->hnext;
+    return pp;
+}
+
+static void dcache_remove(struct dentry **pp)
+{
+    struct dentry *d = *pp;
+    STORE(pp, d->hnext);
+    clock_unlink(&d->clock);
+    retire(dentry_slab, d);
+    dcache_count--;
+}
+
+int dcache_lookup(int dir, const char *name, int len)
+{
+    int inum = -1;
+
+    rcu_read_lock();
+    struct dentry *d = LOAD(dcache_find(dir, name, len));
+    if (d != NULL)
+    {
+        inum = LOAD(&d->inum);
+        clock_ref(&d->clock);
+    }
+    rcu_read_unlock();
+
+    stats_cache_access(STATS_CACHE_DENTRY, inum >= 0);
+    return inum;
+}
+
+uint64_t dcache_generation(void)
+{
+    return LOAD(&dcache_gen);
+}
+
+void dcache_add(int dir, const char *name, int len, int inum, uint64_t gen)
+{
+    if (len > FS_NAME_MAX)
+        return;
+    pthread_once(&cache_once, cache_setup);
+
+    pthread_mutex_lock(&cache_lock);
+    if (dcache_gen != gen) // a name went since the caller's lookup
+    {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+    struct dentry **pp = dcache_find(dir, name, len);
+    if (*pp != NULL)
+        STORE(&(*pp)->inum, inum);
+    else
+    {
+        if (dcache_count >= DCACHE_MAX)
+        {
+            struct dentry *old = (struct dentry *)clock_victim(&dcache_clock);
+            dcache_remove(dcache_find(old->dir, old->name, old->len));
+            pp = dcache_find(dir, name, len); // the chain may have changed
+        }
+        struct dentry *d = slab_alloc(dentry_slab);
+        if (d != NULL)
+        {
+            d->dir = dir;
+            d->inum = inum;
+            d->len = len;
+            memcpy(d->name, name, len);
+            d->hnext = NULL;
+            clock_push(&dcache_clock, &d->clock);
+            STORE(pp, d); // publish
+            dcache_count++;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void dcache_drop(int dir, const char *name, int len)
+{
+    pthread_mutex_lock(&cache_lock);
+    STORE(&dcache_gen, dcache_gen + 1);
+    struct dentry **pp = dcache_find(dir, name, len);
+    if (*pp != NULL)
+        dcache_remove(pp);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_reset(void)
+{
+    pthread_once(&cache_once, cache_setup);
+
+    pthread_mutex_lock(&cache_lock);
+    while (bcache_clock.next != &bcache_clock)
+        bcache_remove((struct bcache_ent *)bcache_clock.next);
+    STORE(&bcache_gen, bcache_gen + 1); // even if it was empty
+    while (dcache_clock.next != &dcache_clock)
+    {
+        struct dentry *d = (struct dentry *)dcache_clock.next;
+        dcache_remove(dcache_find(d->dir, d->name, d->len));
+    }
+    STORE(&dcache_gen, dcache_gen + 1);
+    retire_flush();
+    pthread_mutex_unlock(&cache_lock);
+}
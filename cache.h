@@ -0,0 +1,44 @@
+/*
+ * file:        cache.h
+ * description: in-memory metadata caches for the CS 5600 file system:
+ *              a write-through block cache for inodes and directory
+ *              blocks, and a dentry cache of (directory, name) -> inode
+ */
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "stats.h"
+
+/* Read one block through the cache; 'kind' is only for the hit
+ * counters. Returns 0, or -EIO.
+ */
+int bcache_read(void *buf, int lba, enum stats_cache kind);
+
+/* Write one block to disk, updating (or adding) the cached copy
+ * first. Returns 0, or -EIO.
+ */
+int bcache_write(const void *buf, int lba);
+
+/* Forget 'nblks' blocks from 'lba' on. Must be called when blocks are
+ * freed, or written without going through bcache_write.
+ */
+void bcache_drop(int lba, int nblks);
+
+/* child inode of 'name' (len bytes) in directory 'dir', or -1 if it
+ * isn't cached. Only positive entries are kept.
+ */
+int dcache_lookup(int dir, const char *name, int len);
+
+/* Cache what a lookup found in the directory. 'gen' is
+ * dcache_generation() from before the directory was read: if any name
+ * has been dropped since, the entry isn't added, as it may be stale.
+ */
+uint64_t dcache_generation(void);
+void dcache_add(int dir, const char *name, int len, int inum, uint64_t gen);
+void dcache_drop(int dir, const char *name, int len);
+
+/* empty both caches, e.g. when a new image is mounted */
+void cache_reset(void);
+
+#endif
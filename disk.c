@@ -0,0 +1,147 @@
+/*
+ * file:        disk.c
+ * description: block I/O layer of the CS 5600 file system. Adds
+ *              statistics, tracepoints and block trace capture to the
+ *              provided block_read/block_write, and makes them safe
+ *              to call from several FUSE worker threads at once.
+ */
+
+#define _XOPEN_SOURCE 500
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "fs5600.h"
+#include "stats.h"
+#include "trace.h"
+#include "blktrace.h"
+#include "disk.h"
+
+extern int block_read(char *buf, int lba, int nblks);
+extern int block_write(char *buf, int lba, int nblks);
+extern void block_init(char *file);
+
+/* block_read/block_write seek and then transfer on one shared file
+ * offset, so concurrent callers are serialized by disk_lock. Our own
+ * descriptor is only used with pwrite or by FUSE at explicit offsets.
+ */
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+static int disk_fd = -1;
+static int disk_nblks;          /* size of the image, in blocks */
+
+void disk_init(char *file)
+{
+    struct stat sb;
+
+    block_init(file);
+    if (disk_fd >= 0)
+        close(disk_fd);
+    if ((disk_fd = open(file, O_RDWR)) < 0 || fstat(disk_fd, &sb) < 0) {
+        printf("cannot open image file '%s': %s\n", file, strerror(errno));
+        exit(1);
+    }
+    disk_nblks = sb.st_size / FS_BLOCK_SIZE;
+}
+
+/* Block I/O trace capture. When enabled with block_trace_open(), every
+ * transfer is appended to the trace file.
+ */
+static FILE *blktrace_fp;
+static uint64_t blktrace_t0;
+static pthread_mutex_t blktrace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void block_trace(int rw, int lba, int nblks)
+{
+    if (blktrace_fp == NULL)
+        return;
+
+    struct blktrace_rec r = {.ts = stats_now() - blktrace_t0, .lba = lba,
+                             .nblks = nblks, .rw = rw};
+    pthread_mutex_lock(&blktrace_lock);
+    fwrite(&r, sizeof(r), 1, blktrace_fp);
+    pthread_mutex_unlock(&blktrace_lock);
+}
+
+static void block_trace_close(void)
+{
+    pthread_mutex_lock(&blktrace_lock);
+    if (blktrace_fp != NULL)
+        fclose(blktrace_fp);
+    blktrace_fp = NULL;
+    pthread_mutex_unlock(&blktrace_lock);
+}
+
+/* start capturing to 'file'. The trace is flushed at exit.
+ */
+void block_trace_open(char *file)
+{
+    struct blktrace_hdr hdr = {.magic = BLKTRACE_MAGIC, .block_size = FS_BLOCK_SIZE};
+    struct fs_super sb;
+
+    if ((blktrace_fp = fopen(file, "w")) == NULL) {
+        printf("cannot open trace file '%s': %s\n", file, strerror(errno));
+        exit(1);
+    }
+    if (pread(disk_fd, &sb, sizeof(sb), 0) == sizeof(sb) && sb.magic == FS_MAGIC)
+        hdr.disk_size = sb.disk_size;
+    fwrite(&hdr, sizeof(hdr), 1, blktrace_fp);
+    blktrace_t0 = stats_now();
+    atexit(block_trace_close);
+}
+
+/* read blocks from disk image. Returns -EIO if error, 0 otherwise
+ */
+int disk_read(void *buf, int lba, int nblks)
+{
+    int rv = -EIO;
+
+    block_trace(BLKTRACE_READ, lba, nblks);
+    uint64_t t0 = stats_now();
+    if (lba >= 0 && nblks >= 0 && lba + nblks <= disk_nblks) {
+        pthread_mutex_lock(&disk_lock);
+        rv = block_read(buf, lba, nblks);
+        pthread_mutex_unlock(&disk_lock);
+    }
+    stats_record(STATS_BLOCK_READ, stats_now() - t0, nblks * FS_BLOCK_SIZE, rv);
+    TRACE(TR_BLOCK_READ, -1, lba, 0, nblks * FS_BLOCK_SIZE, rv, t0);
+    return rv;
+}
+
+/* write blocks to disk image. Returns -EIO if error, 0 otherwise
+ */
+int disk_write(void *buf, int lba, int nblks)
+{
+    int rv = -EIO;
+
+    block_trace(BLKTRACE_WRITE, lba, nblks);
+    uint64_t t0 = stats_now();
+    if (lba >= 0 && nblks >= 0 && lba + nblks <= disk_nblks) {
+        pthread_mutex_lock(&disk_lock);
+        rv = block_write(buf, lba, nblks);
+        pthread_mutex_unlock(&disk_lock);
+    }
+    stats_record(STATS_BLOCK_WRITE, stats_now() - t0, nblks * FS_BLOCK_SIZE, rv);
+    TRACE(TR_BLOCK_WRITE, -1, lba, 0, nblks * FS_BLOCK_SIZE, rv, t0);
+    return rv;
+}
+
+int super_write(void *buf)
+{
+    block_trace(BLKTRACE_WRITE, 0, 1);
+    if (pwrite(disk_fd, buf, FS_BLOCK_SIZE, 0) != FS_BLOCK_SIZE)
+        return -EIO;
+    return 0;
+}
+
+int block_fd(void)
+{
+    return disk_fd;
+}
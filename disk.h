@@ -0,0 +1,38 @@
+/*
+ * file:        disk.h
+ * description: block I/O layer of the CS 5600 file system, on top of
+ *              the provided block_read/block_write in misc.c
+ */
+
+#ifndef __DISK_H__
+#define __DISK_H__
+
+/* Open the image. Calls block_init() in misc.c (which checks the name
+ * and exits on error), and keeps a second descriptor of our own for
+ * the superblock and the zero-copy paths.
+ */
+void disk_init(char *file);
+
+/* Read or write 'nblks' blocks at 'lba', with statistics, tracepoints
+ * and block trace capture. Returns 0 or -EIO; blocks past the end of
+ * the image are -EIO rather than growing it.
+ */
+int disk_read(void *buf, int lba, int nblks);
+int disk_write(void *buf, int lba, int nblks);
+
+/* write the superblock. block_write() refuses block 0, on purpose.
+ */
+int super_write(void *buf);
+
+/* descriptor of the image, for callers that hand (fd, offset) pairs to
+ * FUSE instead of copying data through memory.
+ */
+int block_fd(void);
+
+/* Block trace capture (see blktrace.h and replay.c). block_trace() is
+ * also called by the zero-copy paths, which bypass disk_read/disk_write.
+ */
+void block_trace_open(char *file);
+void block_trace(int rw, int lba, int nblks);
+
+#endif
@@ -1,16 +1,50 @@
 from ctypes import *
 
 MAGIC = 0x30303635
+STATE_CLEAN = 0x1
 
+# variable-length directory entry: this header, then name_len bytes
+# of name, padded to a multiple of 4. See fs5600.h.
 class dirent(Structure):
-    _fields_ = [("valid", c_uint, 1),
-                ("inode", c_uint, 31),
-                ("name", c_char * 28)]
+    _fields_ = [("inode", c_uint),
+                ("rec_len", c_ushort),
+                ("name_len", c_ubyte),
+                ("pad", c_ubyte)]
+
+DIRENT_HDR = 8
+NAME_MAX = 255
+
+def dirent_size(name_len):
+    return (DIRENT_HDR + name_len + 3) & ~3
+
+# yield (offset, dirent, name) for each entry in a directory block,
+# including unused ones (inode 0)
+def dirents(blk):
+    off = 0
+    while off < 4096:
+        de = dirent.from_buffer_copy(blk[off:off+DIRENT_HDR])
+        if de.rec_len < DIRENT_HDR or off + de.rec_len > 4096:
+            raise ValueError('bad directory entry at offset %d' % off)
+        name = bytes(blk[off+DIRENT_HDR:off+DIRENT_HDR+de.name_len])
+        yield off, de, name.decode('ascii')
+        off += de.rec_len
         
+SNAP_MAX = 8
+
+class snap(Structure):
+    _fields_ = [("root", c_uint),
+                ("ctime", c_uint),
+                ("name", c_char * 24)]
+
 class super(Structure):
     _fields_ = [("magic", c_uint),
                 ("disk_sz", c_uint),
-                ("_pad", c_char * 4088)]
+                ("frag_table", c_uint),
+                ("free_blocks", c_uint),
+                ("state", c_uint),
+                ("ref_table", c_uint),
+                ("snaps", snap * SNAP_MAX),
+                ("_pad", c_char * 3816)]
 
 class inode(Structure):
     _fields_ = [("uid", c_ushort),
@@ -19,7 +53,14 @@ class inode(Structure):
                 ("ctime", c_uint),
                 ("mtime", c_uint),
                 ("size", c_int),
-                ("ptrs", c_uint * 1019)]
+                ("flags", c_uint),
+                ("tail_frag", c_uint),
+                ("unwritten", c_uint),
+                ("ptrs", c_uint * 1016)]
+
+INODE_INLINE = 0x1
+INODE_TAIL = 0x2
+FRAG_SIZE = 512
 
 class bitmap(Structure):
     _fields_ = [("vals", c_uint * 1024)]
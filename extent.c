@@ -0,0 +1,275 @@
+/*
+ * file:        extent.c
+ * description: in-memory index of the free extents in the block bitmap
+ *              of the CS 5600 file system.
+ *
+ * Each run of free blocks is one node, kept in two AVL trees at once:
+ * one ordered by start block, used to merge a freed range with its
+ * neighbours, and one by length (then start), used to find the
+ * smallest extent that fits an allocation. Both are O(log n), where
+ * a bitmap scan is O(disk size), and the total number of free blocks
+ * is kept as a counter so statfs doesn't have to count bits.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "slab.h"
+#include "extent.h"
+
+#define BY_START 0
+#define BY_LEN 1
+
+struct fext
+{
+    struct fext *child[2][2]; // [tree][left, right]
+    int height[2];
+    int start, len;
+};
+
+static struct fext *root[2];
+static int free_total;
+static struct slab_cache *fext_slab;
+
+static int fext_cmp(int t, const struct fext *a, const struct fext *b)
+{
+    if (t == BY_LEN && a->len != b->len)
+        return a->len < b->len ? -1 : 1;
+    return a->start < b->start ? -1 : a->start > b->start;
+}
+
+/****** AVL TREES ******/
+
+static int height(int t, const struct fext *n)
+{
+    return n ? n->height[t] : 0;
+}
+
+static void fix_height(int t, struct fext *n)
+{
+    int l = height(t, n->child[t][0]), r = height(t, n->child[t][1]);
+    n->height[t] = 1 + (l > r ? l : r);
+}
+
+/* rotate 'n' towards 'dir' (1 = right), returning the new subtree root */
+static struct fext *rotate(int t, struct fext *n, int dir)
+{
+    struct fext *c = n->child[t][!dir];
+    n->child[t][!dir] = c->child[t][dir];
+    c->child[t][dir] = n;
+    fix_height(t, n);
+    fix_height(t, c);
+    return c;
+}
+
+static struct fext *balance(int t, struct fext *n)
+{
+    fix_height(t, n);
+    for (int d = 0; d < 2; d++)
+    {
+        struct fext *c = n->child[t][d];
+        if (height(t, c) - height(t, n->child[t][!d]) > 1)
+        {
+            if (height(t, c->child[t][!d]) > height(t, c->child[t][d]))
+                n->child[t][d] = rotate(t, c, d);
+            return rotate(t, n, !d);
+        }
+    }
+    return n;
+}
+
+static struct fext *tree_insert(int t, struct fext *n, struct fext *e)
+{
+    if (n == NULL)
+    {
+        e->child[t][0] = e->child[t][1] = NULL;
+        e->height[t] = 1;
+        return e;
+    }
+    int d = fext_cmp(t, e, n) > 0;
+    n->child[t][d] = tree_insert(t, n->child[t][d], e);
+    return balance(t, n);
+}
+
+static struct fext *tree_remove_min(int t, struct fext *n, struct fext **min)
+{
+    if (n->child[t][0] == NULL)
+    {
+        *min = n;
+        return n->child[t][1];
+    }
+    n->child[t][0] = tree_remove_min(t, n->child[t][0], min);
+    return balance(t, n);
+}
+
+/* 'e' must be in the tree, with the key it was inserted with */
+static struct fext *tree_remove(int t, struct fext *n, struct fext *e)
+{
+    int c = fext_cmp(t, e, n);
+    if (c != 0)
+    {
+        n->child[t][c > 0] = tree_remove(t, n->child[t][c > 0], e);
+        return balance(t, n);
+    }
+    if (n->child[t][1] == NULL)
+        return n->child[t][0];
+
+    struct fext *m;
+    struct fext *r = tree_remove_min(t, n->child[t][1], &m);
+    m->child[t][0] = n->child[t][0];
+    m->child[t][1] = r;
+    return balance(t, m);
+}
+
+static void tree_free(struct fext *n)
+{
+    if (n == NULL)
+        return;
+    tree_free(n->child[BY_START][0]);
+    tree_free(n->child[BY_START][1]);
+    slab_free(fext_slab, n);
+}
+
+/****** EXTENTS ******/
+
+static void ext_insert(struct fext *e)
+{
+    root[BY_START] = tree_insert(BY_START, root[BY_START], e);
+    root[BY_LEN] = tree_insert(BY_LEN, root[BY_LEN], e);
+}
+
+static void ext_remove(struct fext *e)
+{
+    root[BY_START] = tree_remove(BY_START, root[BY_START], e);
+    root[BY_LEN] = tree_remove(BY_LEN, root[BY_LEN], e);
+}
+
+/* if we are out of memory the index just doesn't learn about the
+ * blocks, which is safe: they won't be handed out.
+ */
+static void ext_add(int start, int len)
+{
+    struct fext *e = slab_alloc(fext_slab);
+    if (e == NULL)
+        return;
+    e->start = start;
+    e->len = len;
+    ext_insert(e);
+    free_total += len;
+}
+
+void fext_build(const unsigned char *map, int first, int nblocks)
+{
+    if (fext_slab == NULL)
+        fext_slab = slab_create("fext", sizeof(struct fext), 0);
+    tree_free(root[BY_START]);
+    root[BY_START] = root[BY_LEN] = NULL;
+    free_total = 0;
+
+    for (int i = first; i < nblocks;)
+    {
+        if (map[i / 8] & (1 << (i % 8)))
+        {
+            i++;
+            continue;
+        }
+        int n = 1;
+        while (i + n < nblocks && !(map[(i + n) / 8] & (1 << ((i + n) % 8))))
+            n++;
+        ext_add(i, n);
+        i += n;
+    }
+}
+
+int fext_alloc(int want, int *got)
+{
+    struct fext *n = root[BY_LEN], *best = NULL;
+
+    while (n != NULL)
+    {
+        if (n->len >= want)
+        {
+            best = n;
+            n = n->child[BY_LEN][0];
+        }
+        else
+            n = n->child[BY_LEN][1];
+    }
+    if (best == NULL)
+    {
+        for (n = root[BY_LEN]; n != NULL; n = n->child[BY_LEN][1])
+            best = n;
+        if (best == NULL)
+            return -ENOSPC;
+    }
+
+    int start = best->start;
+    *got = best->len < want ? best->len : want;
+    ext_remove(best);
+    if (best->len > *got)
+    {
+        best->start += *got;
+        best->len -= *got;
+        ext_insert(best);
+    }
+    else
+        slab_free(fext_slab, best);
+    free_total -= *got;
+    return start;
+}
+
+void fext_free(int start, int len)
+{
+    struct fext *prev = NULL, *next = NULL, *e = NULL;
+
+    free_total += len;
+    for (struct fext *n = root[BY_START]; n != NULL;)
+    {
+        if (n->start < start)
+        {
+            prev = n;
+            n = n->child[BY_START][1];
+        }
+        else
+        {
+            next = n;
+            n = n->child[BY_START][0];
+        }
+    }
+
+    /* merge with the extents either side, if they touch */
+    if (prev != NULL && prev->start + prev->len == start)
+    {
+        ext_remove(prev);
+        start = prev->start;
+        len += prev->len;
+        e = prev;
+    }
+    if (next != NULL && start + len == next->start)
+    {
+        ext_remove(next);
+        len += next->len;
+        if (e != NULL)
+            slab_free(fext_slab, next);
+        else
+            e = next;
+    }
+
+    if (e == NULL)
+    {
+        e = slab_alloc(fext_slab);
+        if (e == NULL)
+        {
+            free_total -= len;
+            return;
+        }
+    }
+    e->start = start;
+    e->len = len;
+    ext_insert(e);
+}
+
+int fext_free_count(void)
+{
+    return free_total;
+}
@@ -0,0 +1,30 @@
+/*
+ * file:        extent.h
+ * description: in-memory index of the free extents in the block bitmap
+ *              of the CS 5600 file system
+ */
+
+#ifndef __EXTENT_H__
+#define __EXTENT_H__
+
+/* The index mirrors the bitmap; it is rebuilt at mount and has to be
+ * told about every allocation and free. It takes no lock of its own,
+ * so callers serialize (homework.c uses bitmap_lock).
+ */
+
+/* rebuild the index from blocks [first, nblocks) of 'map' */
+void fext_build(const unsigned char *map, int first, int nblocks);
+
+/* Take up to 'want' contiguous blocks: the start of the smallest free
+ * extent that holds all of them, or if none does, of the largest one.
+ * Returns the first block, with the number taken in *got, or -ENOSPC.
+ */
+int fext_alloc(int want, int *got);
+
+/* blocks [start, start+n) are free again */
+void fext_free(int start, int n);
+
+/* total free blocks in the index */
+int fext_free_count(void);
+
+#endif
@@ -12,16 +12,70 @@
 #define FS_BLOCK_SIZE 4096
 #define FS_MAGIC 0x30303635
 
+/* largest FUSE read/write/readahead we ask the kernel for. FUSE may
+ * clamp this further when the connection is set up.
+ */
+#define FS_MAX_XFER (1024 * 1024)
+
 /* how many buckets of size M do you need to hold N items? 
  */
 #define DIV_ROUND_UP(N, M) ((N) + (M) - 1) / (M)
 
-/* Entry in a directory
+/* Private ioctls. FUSE 2 has no lseek operation, so SEEK_DATA and
+ * SEEK_HOLE are available as ioctls on an open file instead: pass a
+ * file offset, get back the offset of the next data or hole at or
+ * after it, or -ENXIO if it is at or past end of file.
+ */
+#define FS_IOC_SEEK_DATA _IOWR('5', 1, int64_t)
+#define FS_IOC_SEEK_HOLE _IOWR('5', 2, int64_t)
+
+/* FS_IOC_CLONE makes the open file a copy of the file at 'src' (a path
+ * from the root of the file system) that shares its data blocks until
+ * either is written, like FICLONE. FICLONE itself passes the source as
+ * a file descriptor, which means nothing to a FUSE file system. The
+ * kernel doesn't invalidate its caches after an ioctl, so a mount that
+ * lets it cache for long refuses with EOPNOTSUPP (see hw3fuse.c).
+ */
+#define FS_CLONE_PATH_MAX 1024
+
+struct fs_clone_arg {
+    char src[FS_CLONE_PATH_MAX]; /* NUL-terminated */
+};
+
+#define FS_IOC_CLONE _IOW('5', 3, struct fs_clone_arg)
+
+/* Entry in a directory. Entries are variable length: each directory
+ * block holds a chain of them, linked by rec_len, and the last one's
+ * rec_len runs to the end of the block. Unused space is an entry
+ * with inode 0 (only the first in a block), or slack at the end of
+ * the entry before it.
  */
 struct fs_dirent {
-    uint32_t valid : 1;
-    uint32_t inode : 31;
-    char name[28];              /* with trailing NUL */
+    uint32_t inode;             /* 0 if unused */
+    uint16_t rec_len;           /* bytes from here to the next entry */
+    uint8_t  name_len;
+    uint8_t  pad;
+    char     name[];            /* name_len bytes, no trailing NUL */
+};
+
+#define FS_NAME_MAX     255
+#define FS_DIRENT_HDR   8
+#define FS_DIRENT_SIZE(name_len) ((FS_DIRENT_HDR + (name_len) + 3) & ~3)
+
+/* Snapshots - read-only copies of the whole tree, each rooted at its
+ * own copy of the root inode and sharing every block that hasn't
+ * changed since with the live tree. A block in use more than once has
+ * a count of its extra references in the reference table, a run of
+ * blocks of uint16_t counts indexed by block number; freeing a block
+ * with a count just decrements it.
+ */
+#define FS_SNAP_MAX  8
+#define FS_SNAP_NAME 24
+
+struct fs_snap {
+    uint32_t root;              /* copy of the root inode, 0 if unused */
+    uint32_t ctime;
+    char     name[FS_SNAP_NAME]; /* NUL-terminated */
 };
 
 /* Superblock - holds file system parameters. 
@@ -29,11 +83,47 @@ struct fs_dirent {
 struct fs_super {
     uint32_t magic;
     uint32_t disk_size;         /* in blocks */
+    uint32_t frag_table;        /* block holding the fragment table, or 0 */
+    uint32_t free_blocks;       /* only up to date if FS_STATE_CLEAN */
+    uint32_t state;             /* FS_STATE_* */
+    uint32_t ref_table;         /* first block of the reference table, or 0 */
+    struct fs_snap snaps[FS_SNAP_MAX];
     
     /* pad out to an entire block */
-    char pad[FS_BLOCK_SIZE - 2 * sizeof(uint32_t)]; 
+    char pad[FS_BLOCK_SIZE - 6 * sizeof(uint32_t) -
+             FS_SNAP_MAX * sizeof(struct fs_snap)]; 
+};
+
+/* Superblock state. The file system clears FS_STATE_CLEAN before it
+ * first changes the bitmap, and sets it again, with free_blocks
+ * brought up to date, when it is unmounted. Inodes are allocated from
+ * the same blocks as data, so free_blocks is also the free inode count.
+ */
+#define FS_STATE_CLEAN  0x1
+
+/* Tail packing - the last partial block of a file may be stored in a
+ * run of fragments inside a block shared with other files' tails. The
+ * fragment table records, for each shared block, which fragments are
+ * in use; the block is freed when its last fragment is released.
+ */
+#define FS_FRAG_SIZE 512
+#define FS_FRAGS_PER_BLOCK (FS_BLOCK_SIZE / FS_FRAG_SIZE)
+
+struct fs_fragent {
+    uint32_t blk;               /* shared block, 0 if entry unused */
+    uint32_t map;               /* bit N set if fragment N in use */
 };
 
+#define FS_FRAGTAB_SIZE (FS_BLOCK_SIZE / sizeof(struct fs_fragent))
+
+/* Inode flags
+ */
+#define FS_INODE_INLINE 0x1     /* file data lives in the inode itself */
+#define FS_INODE_TAIL   0x2     /* last block is a run of fragments */
+
+#define FS_INODE_NPTRS (FS_BLOCK_SIZE/4 - 8)
+#define FS_INLINE_MAX  (FS_INODE_NPTRS * 4)
+
 struct fs_inode {
     uint16_t uid;
     uint16_t gid;
@@ -41,7 +131,13 @@ struct fs_inode {
     uint32_t ctime;
     uint32_t mtime;
     int32_t  size;
-    uint32_t ptrs[FS_BLOCK_SIZE/4 - 5]; /* inode = 4096 bytes */
+    uint32_t flags;             /* FS_INODE_* */
+    uint32_t tail_frag;         /* first fragment of tail, if FS_INODE_TAIL */
+    uint32_t unwritten;         /* bit i: ptrs[i] is preallocated, reads as 0 */
+    union {
+        uint32_t ptrs[FS_INODE_NPTRS]; /* inode = 4096 bytes */
+        char     data[FS_INLINE_MAX];  /* if FS_INODE_INLINE */
+    };
 };
 
 #endif
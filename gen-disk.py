@@ -69,16 +69,31 @@ class dir(object):
             i.ptrs[j] = self.blocks[j]
         return bytearray(i)
 
-    # dirent is 32 bytes, 128 per block
+    # variable-length dirents, packed in order; unused ('-') entries
+    # are left out. The last entry in each block takes up the rest of it.
     def block(self,offset):
+        blocks = [[]]
+        used = 0
+        for val,name,num in self.entries:
+            if not val:
+                continue
+            size = fs.dirent_size(len(name))
+            if used + size > 4096:
+                blocks.append([])
+                used = 0
+            blocks[-1].append((name, num, used))
+            used += size
+
         data = bytearray(4096)
-        de = fs.dirent()
-        j = 0
-        for i in range(offset*128, min(len(self.entries), (offset+1)*128)):
-            val,name,num = self.entries[i]
-            de.valid, de.inode, de.name = val, num, name.encode('ascii')
-            data[j:j+32] = bytearray(de)
-            j += 32
+        ents = blocks[offset] if offset < len(blocks) else []
+        if not ents:
+            ents = [('', 0, 0)]
+        for k, (name, num, off) in enumerate(ents):
+            end = ents[k+1][2] if k + 1 < len(ents) else 4096
+            de = fs.dirent()
+            de.inode, de.rec_len, de.name_len = num, end - off, len(name)
+            data[off:off+fs.DIRENT_HDR] = bytearray(de)
+            data[off+fs.DIRENT_HDR:off+fs.DIRENT_HDR+len(name)] = name.encode('ascii')
         return data
         
         
@@ -129,6 +144,8 @@ for f in files + dirs:
 
 sb = fs.super()
 sb.magic, sb.disk_sz = magic, nblocks
+sb.free_blocks = sum(1 for i in range(3, nblocks) if not blockmap.get(i))
+sb.state = fs.STATE_CLEAN
 zeros = bytearray(4096)
 
 fp = open(sys.argv[2], 'wb')
@@ -16,31 +16,65 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/falloc.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "fs5600.h"
+#include "stats.h"
+#include "trace.h"
+#include "blktrace.h"
+#include "cache.h"
+#include "extent.h"
+#include "disk.h"
 
 #define stat(a, b) error do not use stat()
 #define open(a, b) error do not use open()
 #define read(a, b, c) error do not use read()
 #define write(a, b, c) error do not use write()
 
-#define MAX_PATH_LEN 10
-#define MAX_NAME_LEN 27
+#define MAX_NAME_LEN FS_NAME_MAX
 #define BLOCK_SIZE 4096
 #define ROOT_INUM 2
 #define NDIRECT 10
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(struct fs_dirent))
-// #define MAX_DIR_ENTRIES 128
 #define INODE_TABLE_START 2
 
-/* disk access. All access is in terms of 4KB blocks; read and
- * write functions return 0 (success) or -EIO.
- */
-extern int block_read(void *buf, int lba, int nblks);
-extern int block_write(void *buf, int lba, int nblks);
-
 unsigned char g_bitmap[4096];
 struct fs_super superblock;
 struct fs_inode g_root_node;
+struct fs_fragent g_fragtab[FS_FRAGTAB_SIZE];
+
+/* largest file tail (in fragments) that we pack into a shared block
+ */
+#define TAIL_MAX_FRAGS 6
+
+/* The statistics file. It isn't stored anywhere: getattr and read
+ * render the current counters (see stats.c) on the fly.
+ */
+#define STATS_PATH "/.fsstats"
+
+static int is_stats_file(const char *path)
+{
+    return strcmp(path, STATS_PATH) == 0;
+}
+
+/* Render the statistics into a malloc'ed buffer. Returns NULL if out
+ * of memory; the length of the text is returned in *len.
+ */
+static char *stats_render(size_t *len)
+{
+    int n = stats_format(NULL, 0);
+    char *text = malloc(n + 1);
+    if (text == NULL)
+        return NULL;
+
+    int m = stats_format(text, n + 1);
+    *len = m < n ? m : n; // counters may have moved in between
+    return text;
+}
 
 /* bitmap functions
  */
@@ -57,268 +91,1955 @@ int bit_test(unsigned char *map, int i)
     return (map[i / 8] & (1 << (i % 8))) != 0;
 }
 
+/* Bitmap allocations and frees are serialized by bitmap_lock.
+ */
+static pthread_mutex_t bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* On a cleanly unmounted image the superblock's free count is good,
+ * so the bitmap and the free extent index aren't loaded until the
+ * first allocation or free.
+ */
+static int bitmap_loaded;
+
+/* blocks reserved for files being written (see resv_alloc_block) and
+ * for the log (see log_append), under bitmap_lock */
+static int resv_blocks;
+
+static int free_block(int block_num);
+static int resv_reclaim(void);
+static int log_reclaim(void);
+static void lazytime_drop(int inum);
+
+/* Called with bitmap_lock held. */
+static int bitmap_load(void)
+{
+    if (bitmap_loaded)
+        return 0;
+    if (disk_read(g_bitmap, 1, 1) < 0)
+        return -EIO;
+
+    // mark blocks 0, 1, 2  as used
+    bit_set(g_bitmap, 0);
+    bit_set(g_bitmap, 1);
+    bit_set(g_bitmap, 2);
+    fext_build(g_bitmap, 3, superblock.disk_size);
+    bitmap_loaded = 1;
+    return 0;
+}
+
 /**
- * Find a free block in the bitmap. Mark it as used and write
- * the bitmap block back to disk.
+ * Get the bitmap ready to be changed: load it, and the first time,
+ * mark the superblock not clean, as its free count is about to go
+ * stale (fs_destroy brings it up to date). Called with bitmap_lock
+ * held.
  *
- * Returns: the block number on success, negative error on failure
+ * Returns 0, or -EIO
  */
-static int find_free_block(void)
+static int bitmap_modify(void)
 {
-    /* We know the total disk size from superblock.disk_size */
-    /* We know the first 3 blocks are used (superblock, bitmap, root inode) */
-    for (int i = 3; i < (int)superblock.disk_size; i++)
+    if (bitmap_load() < 0)
+        return -EIO;
+    if (superblock.state & FS_STATE_CLEAN)
     {
-        if (!bit_test(g_bitmap, i))
-        {
-            // Found a free block
-            bit_set(g_bitmap, i);
-
-            // Write updated bitmap to disk
-            if (block_write(g_bitmap, 1, 1) < 0)
-            {
-                return -EIO;
-            }
-            return i;
-        }
+        superblock.state &= ~FS_STATE_CLEAN;
+        if (super_write(&superblock) < 0)
+            return -EIO;
     }
-    return -ENOSPC; // no free blocks
+    return 0;
 }
 
 /**
- * Free (release) a block number in the bitmap. Write updated
- * bitmap back to disk.
+ * Find a run of up to 'want' consecutive free blocks: the smallest
+ * free extent that holds all of them (best fit), otherwise the longest
+ * one there is. Marks them used and writes the bitmap back, or with
+ * 'reserve' set, only takes them out of the free extent index and
+ * counts them in resv_blocks (see resv_claim). If there is no free
+ * block at all, blocks reserved for files being written are taken
+ * back and it tries again.
+ *
+ * Returns the first block of the run, with its length in *got, or
+ * negative error
  */
-static int free_block(int block_num)
+static int alloc_run(int want, int *got, int reserve)
 {
-    if (block_num < 0 || block_num >= (int)superblock.disk_size)
+    pthread_mutex_lock(&bitmap_lock);
+    if (bitmap_modify() < 0)
     {
-        return -EINVAL; // invalid block
+        pthread_mutex_unlock(&bitmap_lock);
+        return -EIO;
     }
-    if (bit_test(g_bitmap, block_num))
+    int start = fext_alloc(want, got);
+    if (start < 0)
     {
-        bit_clear(g_bitmap, block_num);
-        if (block_write(g_bitmap, 1, 1) < 0)
-        {
-            return -EIO;
-        }
+        pthread_mutex_unlock(&bitmap_lock);
+        if (resv_reclaim() > 0)
+            return alloc_run(want, got, reserve);
+        return -ENOSPC;
     }
-    return 0;
-}
 
-static int read_inode(int inum, struct fs_inode *inode)
-{
-    if (inum < 0 || inum >= (int)superblock.disk_size)
+    int rv = 0;
+    if (reserve)
+        resv_blocks += *got;
+    else
     {
-        return -EINVAL;
+        for (int j = 0; j < *got; j++)
+            bit_set(g_bitmap, start + j);
+        rv = disk_write(g_bitmap, 1, 1);
     }
-    if (block_read(inode, inum, 1) < 0)
+    pthread_mutex_unlock(&bitmap_lock);
+    if (rv < 0)
+        return -EIO;
+
+    return start;
+}
+
+static int find_free_run(int want, int *got)
+{
+    return alloc_run(want, got, 0);
+}
+
+/**
+ * Find a free block, using the smallest free extent so that longer
+ * runs are kept for writes that need them. Mark it as used and write
+ * the bitmap block back to disk. If the disk is full apart from
+ * blocks reserved for files being written, those are taken back.
+ *
+ * Returns: the block number on success, negative error on failure
+ */
+static int find_free_block(void)
+{
+    int got;
+    return find_free_run(1, &got);
+}
+
+/* Shared blocks. A snapshot (see snap_create) starts out sharing
+ * everything with the live tree; an inode or directory block is only
+ * copied when one side is about to change it, and the copy takes a
+ * reference to everything it points to. A clone (see file_clone)
+ * shares a file's data blocks the same way. The reference table
+ * counts, for each block, the references it has beyond the first, and
+ * free_block on a block with a count just drops one. The table is
+ * allocated by the first snapshot or clone and written through.
+ */
+#define REFS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(uint16_t))
+
+static uint16_t *g_refs; // NULL if the image has no reference table
+
+static int ref_table_blocks(void)
+{
+    return DIV_ROUND_UP(superblock.disk_size, REFS_PER_BLOCK);
+}
+
+/* read the reference table, if the image has one, at mount */
+static int ref_load(void)
+{
+    free(g_refs);
+    g_refs = NULL;
+    if (superblock.ref_table == 0)
+        return 0;
+
+    int n = ref_table_blocks();
+    uint16_t *refs = malloc(n * BLOCK_SIZE);
+    if (refs == NULL)
+        return -ENOMEM;
+    if (disk_read(refs, superblock.ref_table, n) < 0)
     {
+        free(refs);
         return -EIO;
     }
+    g_refs = refs;
     return 0;
 }
 
 /**
- * Utility: write an inode back to disk by its block number (inum).
+ * Allocate the reference table, all zeros, and record it in the
+ * superblock, unless the image already has one.
+ *
+ * Returns 0, or negative error
  */
-static int write_inode(int inum, const struct fs_inode *inode)
+static int ref_table_init(void)
 {
-    if (inum < 0 || inum >= (int)superblock.disk_size)
+    if (g_refs != NULL)
+        return 0;
+
+    int n = ref_table_blocks(), got;
+    uint16_t *refs = calloc(n, BLOCK_SIZE);
+    if (refs == NULL)
+        return -ENOMEM;
+    int start = find_free_run(n, &got);
+    if (start < 0)
     {
-        return -EINVAL;
+        free(refs);
+        return start;
+    }
+    if (got < n || disk_write(refs, start, n) < 0)
+    {
+        for (int i = 0; i < got; i++)
+            free_block(start + i);
+        free(refs);
+        return got < n ? -ENOSPC : -EIO;
     }
-    if (block_write((void *)inode, inum, 1) < 0)
+
+    superblock.ref_table = start;
+    if (super_write(&superblock) < 0)
     {
+        free(refs);
         return -EIO;
     }
+    g_refs = refs;
     return 0;
 }
 
+/* Set by hw3fuse when it lets the kernel keep pages across opens and
+ * attributes for long periods. The kernel isn't told when a clone or
+ * a snapshot changes what a path holds, so while this is set neither
+ * can be made: FS_IOC_CLONE and mkdir in /.snapshots get -EOPNOTSUPP,
+ * which cp --reflink=auto takes as a cue to copy instead.
+ */
+int fs_kernel_cache;
+
 /**
- * Look for a name in a directory inode. If found, returns the child inode #.
- * If not found, returns -ENOENT. If there's an I/O error, returns negative error code.
+ * Has the image ever had a clone or a snapshot, i.e. does it have a
+ * reference table? Read from the superblock, so that hw3fuse can ask
+ * before mounting, once disk_init has been called.
  */
-static int dir_find_entry(const struct fs_inode *dir_inode, const char *name)
+int fs_shares_blocks(void)
 {
-    // Must be a directory
-    if (!S_ISDIR(dir_inode->mode))
-        return -ENOTDIR;
+    struct fs_super sb;
+    if (disk_read(&sb, 0, 1) < 0)
+        return 1; // play safe; the mount will fail anyway
+    return sb.ref_table != 0;
+}
 
-    for (int i = 0; i < NDIRECT; i++)
-    {
-        if (dir_inode->ptrs[i] == 0)
-            continue;
+/* is block 'b' in use more than once? */
+static int block_shared(int b)
+{
+    return g_refs != NULL && g_refs[b] != 0;
+}
 
-        struct fs_dirent dirents[MAX_DIR_ENTRIES];
-        if (block_read(dirents, dir_inode->ptrs[i], 1) < 0)
-            return -EIO;
+/* write back the table block holding b's count. Called with
+ * bitmap_lock held. */
+static int ref_flush(int b)
+{
+    int i = b / REFS_PER_BLOCK;
+    if (disk_write(g_refs + i * REFS_PER_BLOCK, superblock.ref_table + i, 1) < 0)
+        return -EIO;
+    return 0;
+}
 
-        for (int j = 0; j < MAX_DIR_ENTRIES; j++)
-        {
-            if (!dirents[j].valid)
-                continue;
-            if (strcmp(dirents[j].name, name) == 0)
-            {
-                return dirents[j].inode; // child inum
-            }
-        }
-    }
-    return -ENOENT;
+/* Block generations, in memory only: a block's count goes up whenever
+ * it is freed or gains a second owner. The log (see log_seg) notes the
+ * generation of each block it writes, so it can tell whether the file
+ * still owns the block without reading the file's inode. Under
+ * bitmap_lock.
+ */
+static uint32_t *g_blkgen;
+
+/* size the table for a new mount */
+static void blkgen_reset(void)
+{
+    pthread_mutex_lock(&bitmap_lock);
+    free(g_blkgen);
+    g_blkgen = calloc(superblock.disk_size, sizeof(*g_blkgen));
+    pthread_mutex_unlock(&bitmap_lock);
+}
+
+/* called with bitmap_lock held */
+static void blkgen_bump(int b)
+{
+    if (g_blkgen != NULL)
+        g_blkgen[b]++;
+}
+
+static uint32_t blkgen_get(int b)
+{
+    pthread_mutex_lock(&bitmap_lock);
+    uint32_t gen = g_blkgen != NULL ? g_blkgen[b] : 0;
+    pthread_mutex_unlock(&bitmap_lock);
+    return gen;
 }
 
 /**
- * Add a new entry (name -> child_inum) to a directory inode.
- * Returns 0 on success, negative on error (e.g. ENOSPC if dir is full).
+ * Take another reference to block 'b'. The reference table must have
+ * been allocated.
+ *
+ * Returns 0, -EMLINK if the count can't go any higher, or -EIO
  */
-static int dir_add_entry(struct fs_inode *parent_inode, const char *name, int child_inum)
+static int ref_get(int b)
 {
-    if (!S_ISDIR(parent_inode->mode))
+    int rv = -EMLINK;
+    pthread_mutex_lock(&bitmap_lock);
+    if (g_refs[b] < UINT16_MAX)
     {
-        return -ENOTDIR;
+        g_refs[b]++;
+        blkgen_bump(b);
+        rv = ref_flush(b);
     }
+    pthread_mutex_unlock(&bitmap_lock);
+    return rv;
+}
+
+/* drop a reference to 'b' if it has more than one. Returns 1 if it
+ * did, 0 if 'b' is down to its last and should really be freed, or
+ * -EIO, with the reference kept, if the count couldn't be written. */
+static int ref_put(int b)
+{
+    if (g_refs == NULL)
+        return 0;
 
-    // First, check if entry already exists
-    int check = dir_find_entry(parent_inode, name);
-    if (check >= 0)
+    int rv = 0;
+    pthread_mutex_lock(&bitmap_lock);
+    if (g_refs[b] != 0)
     {
-        // fprintf(stderr, "dir_add_entry: Entry '%s' already exists with inum %d\n", name, check);
-        return -EEXIST;
+        g_refs[b]--;
+        rv = 1;
+        if (ref_flush(b) < 0)
+        {
+            g_refs[b]++; // as it still is on disk, most likely
+            rv = -EIO;
+        }
     }
-    else if (check != -ENOENT)
+    pthread_mutex_unlock(&bitmap_lock);
+    return rv;
+}
+
+/**
+ * Free (release) a block number in the bitmap. Write updated
+ * bitmap back to disk. A shared block just loses a reference.
+ *
+ * Returns 0, or negative error
+ */
+static int free_block(int block_num)
+{
+    if (block_num < 0 || block_num >= (int)superblock.disk_size)
     {
-        return check; // Other error
+        return -EINVAL; // invalid block
     }
-
-    // First block allocation if needed
-    if (parent_inode->ptrs[0] == 0)
+    int shared = ref_put(block_num);
+    if (shared != 0)
+        return shared < 0 ? shared : 0;
+    bcache_drop(block_num, 1);
+    lazytime_drop(block_num);
+    int rv = 0;
+    pthread_mutex_lock(&bitmap_lock);
+    blkgen_bump(block_num);
+    if (bitmap_modify() < 0)
+        rv = -EIO;
+    else if (bit_test(g_bitmap, block_num))
     {
-        int block = find_free_block();
-        if (block < 0)
+        bit_clear(g_bitmap, block_num);
+        fext_free(block_num, 1);
+        if (disk_write(g_bitmap, 1, 1) < 0)
         {
-            // fprintf(stderr, "dir_add_entry: Failed to allocate first directory block\n");
-            return block;
+            rv = -EIO;
         }
+    }
+    pthread_mutex_unlock(&bitmap_lock);
+    return rv;
+}
+
+/* Block reservations. The first time a file being written needs a
+ * block, it reserves a run of free blocks big enough for the rest of
+ * the file, and later blocks come out of that window instead of from
+ * a fresh bitmap scan. Files written in parallel then each stay
+ * contiguous rather than interleaving. Reserved blocks are only taken
+ * out of the free extent index; each is marked in the bitmap when it
+ * is handed out, so a crash can't leak the rest of a window. Whatever
+ * is left goes back on release, when the file is removed, when another
+ * file needs its slot, or when the disk is otherwise full.
+ *
+ * Windows live in a small table indexed by inode number, so that they
+ * work the same with or without a fuse_file_info.
+ */
+#define RESV_SLOTS 64
 
-        // Initialize empty directory block
-        struct fs_dirent empty_block[MAX_DIR_ENTRIES];
-        memset(empty_block, 0, sizeof(empty_block));
+struct resv_window
+{
+    pthread_mutex_t lock;
+    int inum;  // owner, or 0
+    int next;  // next block to hand out
+    int left;  // blocks still reserved from 'next' on
+};
+static struct resv_window resv_tab[RESV_SLOTS];
+
+/* hand out reserved block 'b': mark it used in the bitmap */
+static int resv_claim(int b)
+{
+    pthread_mutex_lock(&bitmap_lock);
+    bit_set(g_bitmap, b);
+    resv_blocks--;
+    int rv = disk_write(g_bitmap, 1, 1);
+    pthread_mutex_unlock(&bitmap_lock);
+    return rv < 0 ? -EIO : 0;
+}
 
-        if (block_write(empty_block, block, 1) < 0)
-        {
-            free_block(block);
-            return -EIO;
-        }
+/* give back 'n' reserved blocks from 'first' on */
+static void resv_unreserve(int first, int n)
+{
+    pthread_mutex_lock(&bitmap_lock);
+    fext_free(first, n);
+    resv_blocks -= n;
+    pthread_mutex_unlock(&bitmap_lock);
+}
 
-        parent_inode->ptrs[0] = block;
-        parent_inode->size = BLOCK_SIZE;
-    }
+/* give back what is left of a window. Called with w->lock held. */
+static void resv_put(struct resv_window *w)
+{
+    if (w->left > 0)
+        resv_unreserve(w->next, w->left);
+    w->inum = w->next = w->left = 0;
+}
 
-    // Look for space in existing directory blocks
-    for (int i = 0; i < NDIRECT; i++)
+/* the disk is full: empty every window not in use right now, and the
+ * rest of the log's segment (see log_append). Returns the number of
+ * blocks given back.
+ */
+static int resv_reclaim(void)
+{
+    int n = 0;
+    for (int i = 0; i < RESV_SLOTS; i++)
     {
-        if (parent_inode->ptrs[i] == 0)
-            continue; // Skip empty blocks
+        struct resv_window *w = &resv_tab[i];
+        if (pthread_mutex_trylock(&w->lock) != 0)
+            continue;
+        n += w->left;
+        resv_put(w);
+        pthread_mutex_unlock(&w->lock);
+    }
+    return n + log_reclaim();
+}
 
-        struct fs_dirent dirents[MAX_DIR_ENTRIES];
-        if (block_read(dirents, parent_inode->ptrs[i], 1) < 0)
-            return -EIO;
+/* drop a file's window, if it has one */
+static void resv_release(int inum)
+{
+    struct resv_window *w = &resv_tab[inum % RESV_SLOTS];
+    pthread_mutex_lock(&w->lock);
+    if (w->inum == inum)
+        resv_put(w);
+    pthread_mutex_unlock(&w->lock);
+}
 
-        // Find an empty slot
-        for (int j = 0; j < MAX_DIR_ENTRIES; j++)
-        {
-            if (!dirents[j].valid)
-            {
-                // Found a free slot!
-                dirents[j].valid = 1;
-                dirents[j].inode = child_inum;
-                strncpy(dirents[j].name, name, sizeof(dirents[j].name) - 1);
-                dirents[j].name[sizeof(dirents[j].name) - 1] = '\0';
+/* Open handles. FUSE calls release once per handle, so a file's
+ * reservation is only given back, and its tail packed, when the last
+ * handle on it is closed. Handles open for writing are counted as
+ * well, for read_buf (see read_buf_stable). Calls without a
+ * fuse_file_info (the unit tests) aren't counted. Indexed by inode
+ * number, in memory only.
+ */
+static uint16_t *open_count, *open_writers;
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
 
-                // Write the block back
-                if (block_write(dirents, parent_inode->ptrs[i], 1) < 0)
-                    return -EIO;
+/* size the tables for a new mount, with nothing open */
+static void open_reset(void)
+{
+    pthread_mutex_lock(&open_lock);
+    free(open_count);
+    free(open_writers);
+    open_count = calloc(superblock.disk_size, sizeof(*open_count));
+    open_writers = calloc(superblock.disk_size, sizeof(*open_writers));
+    pthread_mutex_unlock(&open_lock);
+}
 
-                return 0; // Success
-            }
-        }
+/* count a handle, opened with open(2) flags 'flags' */
+static void open_get(int inum, int flags)
+{
+    pthread_mutex_lock(&open_lock);
+    if (open_count != NULL && open_count[inum] < UINT16_MAX)
+    {
+        open_count[inum]++;
+        if ((flags & O_ACCMODE) != O_RDONLY)
+            open_writers[inum]++;
     }
+    pthread_mutex_unlock(&open_lock);
+}
 
-    // If we get here, we need to allocate a new directory block
-    for (int i = 0; i < NDIRECT; i++)
+/* drop a handle. Returns the number still open. */
+static int open_put(int inum, int flags)
+{
+    int n = 0;
+    pthread_mutex_lock(&open_lock);
+    if (open_count != NULL && open_count[inum] > 0)
     {
-        if (parent_inode->ptrs[i] == 0)
-        {
-            // Found an empty pointer slot, allocate a new block
-            int new_block = find_free_block();
-            if (new_block < 0)
-                return new_block; // Propagate error
+        n = --open_count[inum];
+        if ((flags & O_ACCMODE) != O_RDONLY && open_writers[inum] > 0)
+            open_writers[inum]--;
+    }
+    pthread_mutex_unlock(&open_lock);
+    return n;
+}
 
-            // Initialize the new directory block
-            struct fs_dirent new_dirents[MAX_DIR_ENTRIES];
-            memset(new_dirents, 0, sizeof(new_dirents));
+/* is the file open for writing? */
+static int open_writing(int inum)
+{
+    pthread_mutex_lock(&open_lock);
+    int n = open_writers != NULL ? open_writers[inum] : 0;
+    pthread_mutex_unlock(&open_lock);
+    return n > 0;
+}
 
-            // Add our entry as the first entry
-            new_dirents[0].valid = 1;
-            new_dirents[0].inode = child_inum;
-            strncpy(new_dirents[0].name, name, sizeof(new_dirents[0].name) - 1);
-            new_dirents[0].name[sizeof(new_dirents[0].name) - 1] = '\0';
+/* forget the handles on a file being freed. FUSE still releases them
+ * later, but by path, which no longer finds this inode; without this
+ * a file that reused the inode number would inherit the count. */
+static void open_forget(int inum)
+{
+    pthread_mutex_lock(&open_lock);
+    if (open_count != NULL)
+        open_count[inum] = open_writers[inum] = 0;
+    pthread_mutex_unlock(&open_lock);
+}
 
-            // Write the new block
-            if (block_write(new_dirents, new_block, 1) < 0)
-            {
-                free_block(new_block);
-                return -EIO;
-            }
+/**
+ * Allocate block 'idx' of file 'inum' from the file's window,
+ * reserving a new window first if it is empty.
+ *
+ * Returns the block number, or negative error
+ */
+static int resv_alloc_block(int inum, int idx)
+{
+    struct resv_window *w = &resv_tab[inum % RESV_SLOTS];
+    int block;
 
-            // Update parent inode
-            parent_inode->ptrs[i] = new_block;
+    pthread_mutex_lock(&w->lock);
+    if (w->inum != inum)
+    {
+        resv_put(w);
+        w->inum = inum;
+    }
+    if (w->left == 0)
+    {
+        int got;
+        int start = alloc_run(NDIRECT - idx, &got, 1);
+        if (start < 0)
+        {
+            w->inum = 0;
+            pthread_mutex_unlock(&w->lock);
+            return start;
+        }
+        w->next = start;
+        w->left = got;
+    }
 
-            // Update size if necessary
-            if (parent_inode->size < (i + 1) * BLOCK_SIZE)
-                parent_inode->size = (i + 1) * BLOCK_SIZE;
+    block = w->next++;
+    w->left--;
+    pthread_mutex_unlock(&w->lock);
+    if (resv_claim(block) < 0)
+        return -EIO;
+    return block;
+}
 
-            return 0; // Success
-        }
+/* forget all windows, for a new mount */
+static void resv_reset(void)
+{
+    for (int i = 0; i < RESV_SLOTS; i++)
+    {
+        pthread_mutex_init(&resv_tab[i].lock, NULL);
+        resv_tab[i].inum = resv_tab[i].next = resv_tab[i].left = 0;
     }
+    resv_blocks = 0;
+}
 
-    return -ENOSPC; // No free pointers in parent inode
+/**
+ * Write the fragment table back to disk, allocating its block (and
+ * recording it in the superblock) the first time it is needed.
+ */
+static int fragtab_flush(void)
+{
+    if (superblock.frag_table == 0)
+    {
+        int block = find_free_block();
+        if (block < 0)
+            return block;
+        superblock.frag_table = block;
+        if (super_write(&superblock) < 0)
+            return -EIO;
+    }
+    if (disk_write(g_fragtab, superblock.frag_table, 1) < 0)
+        return -EIO;
+    return 0;
 }
 
+/* g_fragtab, and the contents of the shared blocks it lists, are
+ * guarded by frag_lock. It is taken before bitmap_lock.
+ */
+static pthread_mutex_t frag_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
- * Remove the entry with 'name' from 'dir_inode'. On success, sets 'dirents[j].valid=0' and writes block.
- * If not found, returns -ENOENT.
+ * Allocate a run of 'nfrags' contiguous fragments, first-fit within
+ * the existing shared blocks, else in a newly allocated block. The
+ * fragment number within the block is returned in *frag.
+ *
+ * Returns: the shared block number on success, negative error on failure
+ *          (-ENOSPC if the disk or the fragment table is full)
+ * Caller holds frag_lock.
  */
-static int dir_remove_entry(struct fs_inode *dir_inode, const char *name)
+static int frag_alloc_locked(int nfrags, int *frag)
 {
-    if (!S_ISDIR(dir_inode->mode))
-        return -ENOTDIR;
+    uint32_t want = (1u << nfrags) - 1;
+    int free_slot = -1;
 
-    for (int i = 0; i < NDIRECT; i++)
+    for (int i = 0; i < (int)FS_FRAGTAB_SIZE; i++)
     {
-        if (dir_inode->ptrs[i] == 0)
+        if (g_fragtab[i].blk == 0)
+        {
+            if (free_slot < 0)
+                free_slot = i;
             continue;
-
-        struct fs_dirent dirents[MAX_DIR_ENTRIES];
-        if (block_read(dirents, dir_inode->ptrs[i], 1) < 0)
-            return -EIO;
-
-        for (int j = 0; j < MAX_DIR_ENTRIES; j++)
+        }
+        for (int f = 0; f + nfrags <= FS_FRAGS_PER_BLOCK; f++)
         {
-            if (dirents[j].valid && strcmp(dirents[j].name, name) == 0)
+            if ((g_fragtab[i].map & (want << f)) == 0)
             {
-                // Found the entry -> remove it
-                dirents[j].valid = 0;
-                if (block_write(dirents, dir_inode->ptrs[i], 1) < 0)
-                    return -EIO;
-                return 0;
+                g_fragtab[i].map |= want << f;
+                *frag = f;
+                int rv = fragtab_flush();
+                return rv < 0 ? rv : (int)g_fragtab[i].blk;
             }
         }
     }
-    return -ENOENT;
-}
 
-/**
+    if (free_slot < 0)
+        return -ENOSPC;
+
+    int block = find_free_block();
+    if (block < 0)
+        return block;
+    g_fragtab[free_slot].blk = block;
+    g_fragtab[free_slot].map = want;
+    *frag = 0;
+    int rv = fragtab_flush();
+    return rv < 0 ? rv : block;
+}
+
+/* frag_alloc_locked, for callers that don't hold frag_lock */
+static int frag_alloc(int nfrags, int *frag)
+{
+    pthread_mutex_lock(&frag_lock);
+    int rv = frag_alloc_locked(nfrags, frag);
+    pthread_mutex_unlock(&frag_lock);
+    return rv;
+}
+
+/**
+ * Release fragments previously handed out by frag_alloc. The shared
+ * block itself is freed once none of its fragments are in use.
+ */
+static int frag_free(int blk, int frag, int nfrags)
+{
+    uint32_t mask = ((1u << nfrags) - 1) << frag;
+    int rv = -EINVAL;
+
+    pthread_mutex_lock(&frag_lock);
+    for (int i = 0; i < (int)FS_FRAGTAB_SIZE; i++)
+    {
+        if (g_fragtab[i].blk != (uint32_t)blk)
+            continue;
+        g_fragtab[i].map &= ~mask;
+        if (g_fragtab[i].map == 0)
+        {
+            free_block(blk);
+            g_fragtab[i].blk = 0;
+        }
+        rv = fragtab_flush();
+        break;
+    }
+    pthread_mutex_unlock(&frag_lock);
+    return rv;
+}
+
+/**
+ * Store 'len' bytes of file tail in the fragments at 'frag' of shared
+ * block 'blk', zero-filling the rest of the 'nfrags' fragments. The
+ * block is read and rewritten under frag_lock, so that two files
+ * packing into the same block at once don't undo each other.
+ */
+static int frag_write(int blk, int frag, int nfrags, const void *data, int len)
+{
+    char shared[BLOCK_SIZE];
+    int rv = 0;
+
+    pthread_mutex_lock(&frag_lock);
+    if (disk_read(shared, blk, 1) < 0)
+        rv = -EIO;
+    else
+    {
+        memset(shared + frag * FS_FRAG_SIZE, 0, nfrags * FS_FRAG_SIZE);
+        memcpy(shared + frag * FS_FRAG_SIZE, data, len);
+        if (disk_write(shared, blk, 1) < 0)
+            rv = -EIO;
+    }
+    pthread_mutex_unlock(&frag_lock);
+    return rv;
+}
+
+/* Inode locks. A file's inode is read, changed and written back
+ * under its lock by every operation that changes the file, so that
+ * the log cleaner, which moves blocks of files other than the one
+ * being written, can't have its changes undone by a stale copy (see
+ * log_clean). A directory's entries and inode are changed under its
+ * lock in the same way, so that two creates can't each write back a
+ * copy of the directory without the other's entry. Locks are hashed by
+ * inode number. An operation holds one at a time, apart from clone and
+ * rename, which take two with inode_lock2; the cleaner and lazytime_set
+ * only ever try-lock.
+ */
+#define INODE_LOCKS 64
+static pthread_mutex_t inode_locks[INODE_LOCKS] = {
+    [0 ... INODE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER};
+
+static pthread_mutex_t *inode_lock_of(int inum)
+{
+    return &inode_locks[inum % INODE_LOCKS];
+}
+
+static void inode_lock(int inum)
+{
+    pthread_mutex_lock(inode_lock_of(inum));
+}
+
+static void inode_unlock(int inum)
+{
+    pthread_mutex_unlock(inode_lock_of(inum));
+}
+
+/* lock two inodes, in a fixed order, and just once if they hash alike */
+static void inode_lock2(int a, int b)
+{
+    pthread_mutex_t *la = inode_lock_of(a), *lb = inode_lock_of(b);
+    if (la > lb)
+    {
+        pthread_mutex_t *t = la;
+        la = lb;
+        lb = t;
+    }
+    pthread_mutex_lock(la);
+    if (lb != la)
+        pthread_mutex_lock(lb);
+}
+
+static void inode_unlock2(int a, int b)
+{
+    pthread_mutex_t *la = inode_lock_of(a), *lb = inode_lock_of(b);
+    pthread_mutex_unlock(la);
+    if (lb != la)
+        pthread_mutex_unlock(lb);
+}
+
+/* Lazy timestamps. A data write that changes nothing in the inode
+ * but mtime and ctime doesn't write the inode: the new times are kept
+ * here, read_inode reports them, and they reach the disk the next
+ * time anything else writes the inode, on fsync or release, when the
+ * entry is wanted for another inode, once they have been pending for
+ * LAZYTIME_MAX_AGE seconds, or at unmount. Everything else in the
+ * inode is still written through.
+ */
+#define LAZYTIME_SLOTS 64
+#define LAZYTIME_MAX_AGE 30
+
+struct lazytime
+{
+    int inum; // 0 if unused
+    uint32_t mtime, ctime;
+    time_t since; // when they were first left pending
+};
+static struct lazytime lazytime_tab[LAZYTIME_SLOTS];
+static pthread_mutex_t lazytime_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* write an entry's times to its inode and free the entry. Called with
+ * lazytime_lock and the inode's lock held, so that the write can't
+ * undo a change made under the inode lock.
+ */
+static int lazytime_write(struct lazytime *lt)
+{
+    struct fs_inode inode;
+    int inum = lt->inum;
+
+    __atomic_store_n(&lt->inum, 0, __ATOMIC_RELEASE);
+    if (bcache_read(&inode, inum, STATS_CACHE_INODE) < 0)
+        return -EIO;
+    inode.mtime = lt->mtime;
+    inode.ctime = lt->ctime;
+    if (bcache_write(&inode, inum) < 0)
+        return -EIO;
+    return 0;
+}
+
+/* fill in any pending times. Takes no lock unless there are some. */
+static void lazytime_get(int inum, struct fs_inode *inode)
+{
+    struct lazytime *lt = &lazytime_tab[inum % LAZYTIME_SLOTS];
+
+    if (__atomic_load_n(&lt->inum, __ATOMIC_ACQUIRE) != inum)
+        return;
+    pthread_mutex_lock(&lazytime_lock);
+    if (lt->inum == inum)
+    {
+        inode->mtime = lt->mtime;
+        inode->ctime = lt->ctime;
+    }
+    pthread_mutex_unlock(&lazytime_lock);
+}
+
+/* forget pending times: the inode is being written with them, or is
+ * going away */
+static void lazytime_drop(int inum)
+{
+    struct lazytime *lt = &lazytime_tab[inum % LAZYTIME_SLOTS];
+
+    if (__atomic_load_n(&lt->inum, __ATOMIC_ACQUIRE) != inum)
+        return;
+    pthread_mutex_lock(&lazytime_lock);
+    if (lt->inum == inum)
+        __atomic_store_n(&lt->inum, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lazytime_lock);
+}
+
+/**
+ * Record new times for an inode whose on-disk copy is otherwise
+ * current. Called with the inode's lock held. An older entry in the
+ * way is written out first, if its inode's lock is free; if not, the
+ * times are written through instead.
+ *
+ * Returns 0, or -EIO
+ */
+static int lazytime_set(int inum, const struct fs_inode *inode)
+{
+    struct lazytime *lt = &lazytime_tab[inum % LAZYTIME_SLOTS];
+    int rv = 0;
+
+    pthread_mutex_lock(&lazytime_lock);
+    if (lt->inum != 0 && lt->inum != inum)
+    {
+        pthread_mutex_t *owner = inode_lock_of(lt->inum);
+        if (owner == inode_lock_of(inum)) // ours, so held already
+            rv = lazytime_write(lt);
+        else if (pthread_mutex_trylock(owner) == 0)
+        {
+            rv = lazytime_write(lt);
+            pthread_mutex_unlock(owner);
+        }
+        else
+        {
+            pthread_mutex_unlock(&lazytime_lock);
+            return bcache_write(inode, inum) < 0 ? -EIO : 0;
+        }
+    }
+    if (lt->inum != inum)
+        lt->since = time(NULL);
+    lt->mtime = inode->mtime;
+    lt->ctime = inode->ctime;
+    __atomic_store_n(&lt->inum, inum, __ATOMIC_RELEASE);
+    if (time(NULL) - lt->since >= LAZYTIME_MAX_AGE && lazytime_write(lt) < 0)
+        rv = -EIO;
+    pthread_mutex_unlock(&lazytime_lock);
+    return rv;
+}
+
+/* write out an inode's pending times, if it has any. Called with the
+ * inode's lock held.
+ */
+static int lazytime_flush(int inum)
+{
+    struct lazytime *lt = &lazytime_tab[inum % LAZYTIME_SLOTS];
+    int rv = 0;
+
+    pthread_mutex_lock(&lazytime_lock);
+    if (lt->inum == inum)
+        rv = lazytime_write(lt);
+    pthread_mutex_unlock(&lazytime_lock);
+    return rv;
+}
+
+/* write out everything pending, at unmount or for a snapshot */
+static void lazytime_flush_all(void)
+{
+    for (int i = 0; i < LAZYTIME_SLOTS; i++)
+    {
+        int inum = __atomic_load_n(&lazytime_tab[i].inum, __ATOMIC_ACQUIRE);
+        if (inum == 0)
+            continue;
+        inode_lock(inum);
+        lazytime_flush(inum);
+        inode_unlock(inum);
+    }
+}
+
+static int read_inode(int inum, struct fs_inode *inode)
+{
+    if (inum < 0 || inum >= (int)superblock.disk_size)
+    {
+        return -EINVAL;
+    }
+    if (bcache_read(inode, inum, STATS_CACHE_INODE) < 0)
+    {
+        return -EIO;
+    }
+    lazytime_get(inum, inode);
+    return 0;
+}
+
+/**
+ * Utility: write an inode back to disk by its block number (inum).
+ */
+static int write_inode(int inum, const struct fs_inode *inode)
+{
+    if (inum < 0 || inum >= (int)superblock.disk_size)
+    {
+        return -EINVAL;
+    }
+    lazytime_drop(inum);
+    if (bcache_write(inode, inum) < 0)
+    {
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Tail geometry: which block holds the tail, and how many fragments
+ * it takes up when packed.
+ */
+static int tail_index(const struct fs_inode *inode)
+{
+    return (inode->size - 1) / BLOCK_SIZE;
+}
+static int tail_nfrags(const struct fs_inode *inode)
+{
+    return DIV_ROUND_UP(inode->size % BLOCK_SIZE, FS_FRAG_SIZE);
+}
+
+/**
+ * Number of blocks allocated to an inode, not counting the inode
+ * itself. Holes don't count, and a packed tail counts as the fraction
+ * of a block its fragments take up.
+ */
+static int inode_blocks(const struct fs_inode *inode)
+{
+    if (inode->flags & FS_INODE_INLINE)
+        return 0;
+
+    int n = 0;
+    for (int i = 0; i < NDIRECT; i++)
+        if (inode->ptrs[i] != 0)
+            n++;
+    if (inode->flags & FS_INODE_TAIL)
+        n--;
+    return n;
+}
+
+/* Does block i of a file read as zeros? True for holes, and for blocks
+ * preallocated by fallocate that haven't been written yet.
+ */
+static int block_is_hole(const struct fs_inode *inode, int i)
+{
+    return inode->ptrs[i] == 0 || (inode->unwritten & (1u << i));
+}
+
+/**
+ * Release every data block referenced by a file or directory inode
+ * and clear its pointers. Inline files have no data blocks.
+ */
+static void free_inode_blocks(struct fs_inode *inode)
+{
+    if (inode->flags & FS_INODE_INLINE)
+        return;
+
+    for (int i = 0; i < NDIRECT; i++)
+    {
+        if (inode->ptrs[i] != 0)
+        {
+            if ((inode->flags & FS_INODE_TAIL) && i == tail_index(inode))
+                frag_free(inode->ptrs[i], inode->tail_frag, tail_nfrags(inode));
+            else
+                free_block(inode->ptrs[i]);
+            inode->ptrs[i] = 0;
+        }
+    }
+    inode->flags &= ~FS_INODE_TAIL;
+    inode->unwritten = 0;
+}
+
+/**
+ * Write 'data' as block i of a file. A block shared with a snapshot
+ * isn't written in place: the file gets a new block of its own, and
+ * the caller writes the inode back.
+ *
+ * Returns 0, or negative error
+ */
+static int file_block_write(struct fs_inode *inode, int i, void *data)
+{
+    int old = inode->ptrs[i];
+    if (!block_shared(old))
+        return disk_write(data, old, 1) < 0 ? -EIO : 0;
+
+    int block = find_free_block();
+    if (block < 0)
+        return block;
+    if (disk_write(data, block, 1) < 0)
+    {
+        free_block(block);
+        return -EIO;
+    }
+    int rv = free_block(old); // only drops our reference
+    if (rv < 0)
+    {
+        free_block(block);
+        return rv;
+    }
+    inode->ptrs[i] = block;
+    return 0;
+}
+
+/**
+ * Pack the last partial block of a file into fragments of a shared
+ * block, if it is small enough, and free the block it came from.
+ * Writes the inode back if anything changed.
+ *
+ * Returns 0 on success (including "nothing to do"), negative on error
+ */
+static int tail_pack(int inum, struct fs_inode *inode)
+{
+    int tail = inode->size % BLOCK_SIZE;
+    if ((inode->flags & (FS_INODE_INLINE | FS_INODE_TAIL)) || tail == 0)
+        return 0;
+
+    int nfrags = tail_nfrags(inode);
+    int idx = tail_index(inode);
+    if (nfrags > TAIL_MAX_FRAGS || idx >= NDIRECT || block_is_hole(inode, idx))
+        return 0;
+
+    char block_data[BLOCK_SIZE];
+    if (disk_read(block_data, inode->ptrs[idx], 1) < 0)
+        return -EIO;
+
+    int frag;
+    int blk = frag_alloc(nfrags, &frag);
+    if (blk == -ENOSPC)
+        return 0; // no room for a fragment; just keep the whole block
+    if (blk < 0)
+        return blk;
+
+    if (frag_write(blk, frag, nfrags, block_data, tail) < 0)
+    {
+        frag_free(blk, frag, nfrags);
+        return -EIO;
+    }
+
+    int old_block = inode->ptrs[idx];
+    inode->ptrs[idx] = blk;
+    inode->tail_frag = frag;
+    inode->flags |= FS_INODE_TAIL;
+    if (write_inode(inum, inode) < 0)
+        return -EIO;
+
+    free_block(old_block);
+    return 0;
+}
+
+/**
+ * Copy a packed tail into a newly allocated block of its own, leaving
+ * the fragments alone.
+ *
+ * Returns the new block, or negative error
+ */
+static int tail_copy_out(const struct fs_inode *inode)
+{
+    int idx = tail_index(inode);
+    char shared[BLOCK_SIZE];
+    char block_data[BLOCK_SIZE];
+    if (disk_read(shared, inode->ptrs[idx], 1) < 0)
+        return -EIO;
+
+    int block = find_free_block();
+    if (block < 0)
+        return block;
+
+    memset(block_data, 0, sizeof(block_data));
+    memcpy(block_data, shared + inode->tail_frag * FS_FRAG_SIZE, inode->size % BLOCK_SIZE);
+    if (disk_write(block_data, block, 1) < 0)
+    {
+        free_block(block);
+        return -EIO;
+    }
+    return block;
+}
+
+/**
+ * Move a packed tail back out into a block of its own, so the file's
+ * last block can be modified in place. Does not write the inode.
+ */
+static int tail_unpack(struct fs_inode *inode)
+{
+    if (!(inode->flags & FS_INODE_TAIL))
+        return 0;
+
+    int idx = tail_index(inode);
+    int block = tail_copy_out(inode);
+    if (block < 0)
+        return block;
+
+    frag_free(inode->ptrs[idx], inode->tail_frag, tail_nfrags(inode));
+    inode->ptrs[idx] = block;
+    inode->flags &= ~FS_INODE_TAIL;
+    return 0;
+}
+
+/**
+ * Move the contents of an inline file out into a data block so the
+ * file can grow past FS_INLINE_MAX. The inode is left block-mapped;
+ * the caller is responsible for writing it back.
+ *
+ * Returns 0 on success, negative error on failure
+ */
+static int inode_uninline(struct fs_inode *inode)
+{
+    char block_data[BLOCK_SIZE];
+    int block = 0;
+
+    if (inode->size > 0)
+    {
+        block = find_free_block();
+        if (block < 0)
+            return block;
+
+        memset(block_data, 0, sizeof(block_data));
+        memcpy(block_data, inode->data, inode->size);
+        if (disk_write(block_data, block, 1) < 0)
+        {
+            free_block(block);
+            return -EIO;
+        }
+    }
+
+    inode->flags &= ~FS_INODE_INLINE;
+    inode->unwritten = 0;
+    memset(inode->ptrs, 0, sizeof(inode->ptrs));
+    inode->ptrs[0] = block;
+    return 0;
+}
+
+/* Log-structured data writes, on when fs_log_writes is set (hw3fuse
+ * -logwrite). An overwrite of a file block doesn't go back to where
+ * the block was: the new contents are appended at the head of a log,
+ * the block pointer moves there, and the old block is freed once the
+ * inode is written. The log takes a segment - a run of up to
+ * LOG_SEG_BLOCKS free blocks - at a time, so a stream of small random
+ * overwrites reaches the image as sequential writes. Like a file's
+ * window, a segment is only reserved, and its blocks are marked in the
+ * bitmap as they are written.
+ *
+ * Old blocks go straight back to the bitmap, so cleaning is only
+ * needed to keep long free runs for new segments. Each segment keeps a
+ * summary of which file block it put in each of its slots, and the
+ * block's generation then (see g_blkgen). A cleaner thread moves what
+ * is still live out of the emptiest old segments into the head,
+ * leaving their runs free. The writers wake it when a new segment
+ * comes up short, or when fewer than LOG_CLEAN_LOW entries are left in
+ * the segment table; it then works until LOG_CLEAN_HIGH are free, or
+ * there is nothing more it can do.
+ */
+#define LOG_SEG_BLOCKS 16
+#define LOG_SEGS 32
+#define LOG_CLEAN_LOW 8
+#define LOG_CLEAN_HIGH 16
+
+int fs_log_writes;
+
+struct log_seg
+{
+    int start, len; // len 0 if the entry is unused
+    int used;       // slots written so far
+    unsigned seq;   // order segments were taken in
+    struct
+    {
+        int inum, idx; // inum 0 once moved
+        uint32_t gen;  // the block's generation when written
+    } slot[LOG_SEG_BLOCKS];
+};
+static struct log_seg log_segs[LOG_SEGS];
+static struct log_seg *log_head;
+static unsigned log_seq;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_clean_cond = PTHREAD_COND_INITIALIZER;
+static int log_clean_wanted;
+
+/* give back the unused end of the head segment. Called with log_lock
+ * held; returns the number of blocks freed.
+ */
+static int log_head_put(void)
+{
+    if (log_head == NULL || log_head->used == log_head->len)
+        return 0;
+
+    int n = log_head->len - log_head->used;
+    resv_unreserve(log_head->start + log_head->used, n);
+    log_head->len = log_head->used;
+    return n;
+}
+
+static int log_reclaim(void)
+{
+    if (pthread_mutex_trylock(&log_lock) != 0)
+        return 0;
+    int n = log_head_put();
+    pthread_mutex_unlock(&log_lock);
+    return n;
+}
+
+/**
+ * Is slot 'i' of a segment still the block its file points to? It is
+ * if the block hasn't been freed or shared since it was written there.
+ * An inode shared with a snapshot isn't ours to change, so its blocks
+ * count as dead: they stay where they are. The answer only holds while
+ * the owner's inode lock is held.
+ */
+static int log_slot_live(struct log_seg *seg, int i)
+{
+    int inum = seg->slot[i].inum;
+    return inum != 0 && blkgen_get(seg->start + i) == seg->slot[i].gen && !block_shared(inum);
+}
+
+/* write a block at the head, which must have room */
+static int log_put(int inum, int idx, const void *data)
+{
+    int blk = log_head->start + log_head->used;
+    if (disk_write((void *)data, blk, 1) < 0)
+        return -EIO;
+    log_head->slot[log_head->used].inum = inum;
+    log_head->slot[log_head->used].idx = idx;
+    log_head->slot[log_head->used].gen = blkgen_get(blk);
+    log_head->used++;
+    if (resv_claim(blk) < 0)
+        return -EIO;
+    return blk;
+}
+
+static int log_free_segs(void)
+{
+    int n = 0;
+    for (int s = 0; s < LOG_SEGS; s++)
+        if (log_segs[s].len == 0)
+            n++;
+    return n;
+}
+
+/* start the cleaner, if it isn't running. Called with log_lock held. */
+static void log_clean_wake(void)
+{
+    log_clean_wanted = 1;
+    pthread_cond_signal(&log_clean_cond);
+}
+
+/* take a new head segment. Called with log_lock held. Returns 0, or
+ * negative error */
+static int log_new_seg(void)
+{
+    int got;
+    int start = alloc_run(LOG_SEG_BLOCKS, &got, 1);
+    if (start < 0)
+        return start;
+
+    /* reuse a free entry, else forget the oldest segment; its
+     * blocks just stay where they are */
+    struct log_seg *seg = &log_segs[0];
+    for (int s = 0; s < LOG_SEGS; s++)
+    {
+        if (log_segs[s].len == 0)
+        {
+            seg = &log_segs[s];
+            break;
+        }
+        if (log_segs[s].seq < seg->seq)
+            seg = &log_segs[s];
+    }
+    seg->start = start;
+    seg->len = got;
+    seg->used = 0;
+    seg->seq = log_seq++;
+    log_head = seg;
+
+    if (got < LOG_SEG_BLOCKS || log_free_segs() < LOG_CLEAN_LOW)
+        log_clean_wake();
+    return 0;
+}
+
+/**
+ * Move slot 'i' of 'victim', which log_slot_live says is live, to the
+ * head. Called with log_lock and the owner's inode lock held.
+ *
+ * Returns 0, or negative error
+ */
+static int log_move(struct log_seg *victim, int i)
+{
+    char data[BLOCK_SIZE];
+    struct fs_inode inode;
+    int inum = victim->slot[i].inum, idx = victim->slot[i].idx;
+    int old = victim->start + i;
+
+    if (read_inode(inum, &inode) < 0)
+        return -EIO;
+    if (inode.ptrs[idx] != (uint32_t)old) // the summary is wrong; leave it be
+        return 0;
+    if (log_head->used == log_head->len)
+    {
+        int rv = log_new_seg();
+        if (rv < 0)
+            return rv;
+    }
+    if (disk_read(data, old, 1) < 0)
+        return -EIO;
+    int blk = log_put(inum, idx, data);
+    if (blk < 0)
+        return blk;
+    inode.ptrs[idx] = blk;
+    if (write_inode(inum, &inode) < 0)
+    {
+        free_block(blk);
+        return -EIO;
+    }
+    free_block(old);
+    return 0;
+}
+
+/**
+ * Move the live blocks of the emptiest old segment to the head, so
+ * that its run of blocks is free again. Called with log_lock held.
+ *
+ * A file's blocks are only moved if its inode lock can be had right
+ * away: its writer may be waiting for log_lock. A slot that is moved
+ * is marked empty, and the segment is only forgotten once every slot
+ * is, so one that can't be emptied now is tried again later.
+ *
+ * Returns 1 if a segment was emptied, else 0
+ */
+static int log_clean(void)
+{
+    struct log_seg *victim = NULL;
+    int victim_live = 0;
+
+    for (int s = 0; s < LOG_SEGS; s++)
+    {
+        struct log_seg *seg = &log_segs[s];
+        if (seg->len == 0 || seg == log_head)
+            continue;
+        int live = 0;
+        for (int i = 0; i < seg->used; i++)
+            if (log_slot_live(seg, i))
+                live++;
+        if (live == 0)
+            seg->len = 0; // nothing left to move; forget it
+        else if (live < seg->len && (victim == NULL || live < victim_live))
+        {
+            victim = seg;
+            victim_live = live;
+        }
+    }
+    if (victim == NULL)
+        return 0;
+
+    int moved = 0;
+    for (int i = 0; i < victim->used; i++)
+    {
+        int inum = victim->slot[i].inum;
+        if (inum != 0)
+        {
+            pthread_mutex_t *lock = inode_lock_of(inum);
+            if (pthread_mutex_trylock(lock) != 0)
+                continue;
+            int rv = log_slot_live(victim, i) ? log_move(victim, i) : 0;
+            pthread_mutex_unlock(lock);
+            if (rv < 0)
+                break;
+            victim->slot[i].inum = 0;
+        }
+        moved++;
+    }
+    if (moved < victim->used)
+        return 0;
+    victim->len = 0;
+    return 1;
+}
+
+/* the cleaner thread: clean whenever woken, a segment at a time, so
+ * that writers get log_lock in between */
+static void *log_cleaner(void *arg)
+{
+    pthread_mutex_lock(&log_lock);
+    for (;;)
+    {
+        while (!log_clean_wanted)
+            pthread_cond_wait(&log_clean_cond, &log_lock);
+        log_clean_wanted = 0;
+        while (log_clean() && log_free_segs() < LOG_CLEAN_HIGH)
+        {
+            pthread_mutex_unlock(&log_lock);
+            pthread_mutex_lock(&log_lock);
+        }
+    }
+    return NULL;
+}
+
+static void log_cleaner_start(void)
+{
+    pthread_t t;
+    if (pthread_create(&t, NULL, log_cleaner, NULL) == 0)
+        pthread_detach(t);
+}
+
+/**
+ * Append block 'idx' of file 'inum' to the log, taking a new segment
+ * when the head is full. The caller points the inode at the new block
+ * and then frees the old one.
+ *
+ * Returns the new block number, or negative error
+ */
+static int log_append(int inum, int idx, const void *data)
+{
+    static pthread_once_t cleaner_once = PTHREAD_ONCE_INIT;
+    pthread_once(&cleaner_once, log_cleaner_start);
+
+    pthread_mutex_lock(&log_lock);
+    if (log_head == NULL || log_head->used == log_head->len)
+    {
+        int rv = log_new_seg();
+        if (rv < 0)
+        {
+            pthread_mutex_unlock(&log_lock);
+            return rv;
+        }
+    }
+
+    int blk = log_put(inum, idx, data);
+    pthread_mutex_unlock(&log_lock);
+    return blk;
+}
+
+/* forget the log, for a new mount or at unmount. The cleaner only
+ * works under log_lock, so once this has it the cleaner is idle, and
+ * finds nothing to do afterwards. */
+static void log_reset(void)
+{
+    pthread_mutex_lock(&log_lock);
+    memset(log_segs, 0, sizeof(log_segs));
+    log_head = NULL;
+    log_clean_wanted = 0;
+    pthread_mutex_unlock(&log_lock);
+}
+
+/* at unmount: give back the head's unused blocks and stop cleaning */
+static void log_stop(void)
+{
+    pthread_mutex_lock(&log_lock);
+    log_head_put();
+    pthread_mutex_unlock(&log_lock);
+    log_reset();
+}
+
+/* Directory blocks hold a chain of variable-length entries (see
+ * fs5600.h); 'off' is a byte offset within the block.
+ */
+#define DIRENT_AT(blk, off) ((struct fs_dirent *)((char *)(blk) + (off)))
+
+/**
+ * Read directory block 'i' of 'dir_inode' and make sure its entries
+ * chain properly to the end of the block, so callers can follow
+ * rec_len without checking it.
+ * Returns 0, or -EIO on a read error or a corrupt block.
+ */
+static int dir_read_block(const struct fs_inode *dir_inode, int i, char *blk)
+{
+    if (bcache_read(blk, dir_inode->ptrs[i], STATS_CACHE_DIRBLOCK) < 0)
+        return -EIO;
+
+    for (int off = 0; off < BLOCK_SIZE;)
+    {
+        struct fs_dirent *de = DIRENT_AT(blk, off);
+        if (de->rec_len < FS_DIRENT_HDR || de->rec_len % 4 != 0 ||
+            off + de->rec_len > BLOCK_SIZE ||
+            (de->inode != 0 && FS_DIRENT_SIZE(de->name_len) > de->rec_len))
+            return -EIO;
+        off += de->rec_len;
+    }
+    return 0;
+}
+
+/* Directory scan kernel. Entries vary in length and are only 4-byte
+ * aligned, so a block can't be compared against the name all at once.
+ * Instead each entry is filtered with one 64-bit compare covering its
+ * name_len and the first four bytes of its name, then on the last four
+ * bytes (names in a directory tend to share prefixes, like file1,
+ * file2...), and only the rare candidate gets a full compare, 16 bytes
+ * at a time with SSE2 where we have it and memcmp otherwise.
+ */
+struct dir_key
+{
+    uint64_t word, mask;          // bytes 4..11 of a match, and which count
+    uint32_t tail;                // last 4 bytes of the name, if len > 4
+    int len;
+    char name[MAX_NAME_LEN + 16]; // zero padded for 16-byte loads
+};
+
+static void dir_key_init(struct dir_key *k, const char *name, int len)
+{
+    // bytes 4..11 of an entry: rec_len (2), name_len, pad, name[0..3]
+    unsigned char word[8] = {0}, mask[8] = {0};
+    word[2] = len;
+    mask[2] = 0xff;
+    for (int i = 0; i < 4 && i < len; i++)
+    {
+        word[4 + i] = name[i];
+        mask[4 + i] = 0xff;
+    }
+    memcpy(&k->word, word, 8);
+    memcpy(&k->mask, mask, 8);
+    if (len > 4)
+        memcpy(&k->tail, name + len - 4, 4);
+
+    k->len = len;
+    memset(k->name, 0, sizeof(k->name));
+    memcpy(k->name, name, len);
+}
+
+static int dirent_name_eq(const char *blk, int off, const struct dir_key *k)
+{
+    const char *name = blk + off + FS_DIRENT_HDR;
+#ifdef __SSE2__
+    if (off + FS_DIRENT_HDR + ((k->len + 15) & ~15) <= BLOCK_SIZE)
+    {
+        for (int i = 0; i < k->len; i += 16)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)(name + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(k->name + i));
+            unsigned eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+            unsigned want = k->len - i >= 16 ? 0xffff : (1u << (k->len - i)) - 1;
+            if ((eq & want) != want)
+                return 0;
+        }
+        return 1;
+    }
+#endif
+    return memcmp(name, k->name, k->len) == 0;
+}
+
+/**
+ * Find the entry for 'k' in a directory block that has been through
+ * dir_read_block. Returns its offset, or -1 if it isn't there.
+ */
+static int dirblock_find(const char *blk, const struct dir_key *k)
+{
+    for (int off = 0; off < BLOCK_SIZE; off += DIRENT_AT(blk, off)->rec_len)
+    {
+        const struct fs_dirent *de = DIRENT_AT(blk, off);
+        if (off + 12 <= BLOCK_SIZE)
+        {
+            uint64_t word;
+            memcpy(&word, blk + off + 4, 8);
+            if ((word & k->mask) != k->word)
+                continue;
+        }
+        else if (de->name_len != k->len)
+            continue;
+        if (de->inode == 0)
+            continue;
+
+        if (k->len > 4)
+        {
+            uint32_t tail;
+            memcpy(&tail, de->name + k->len - 4, 4);
+            if (tail != k->tail)
+                continue;
+        }
+        if (dirent_name_eq(blk, off, k))
+            return off;
+    }
+    return -1;
+}
+
+/**
+ * Find 'name' (len bytes, not NUL-terminated) in a directory. On
+ * success returns the offset of its entry in 'blk', which holds the
+ * directory's block number *idx.
+ * Returns -ENOENT if not found, or another negative error.
+ */
+static int dir_lookup(const struct fs_inode *dir_inode, const char *name, int len,
+                      char *blk, int *idx)
+{
+    if (len > MAX_NAME_LEN)
+        return -ENAMETOOLONG;
+
+    struct dir_key key;
+    dir_key_init(&key, name, len);
+    for (int i = 0; i < NDIRECT; i++)
+    {
+        if (dir_inode->ptrs[i] == 0)
+            continue;
+        if (dir_read_block(dir_inode, i, blk) < 0)
+            return -EIO;
+
+        int off = dirblock_find(blk, &key);
+        if (off >= 0)
+        {
+            *idx = i;
+            return off;
+        }
+    }
+    return -ENOENT;
+}
+
+/**
+ * Look for a name in a directory inode. If found, returns the child inode #.
+ * If not found, returns -ENOENT. If there's an I/O error, returns negative error code.
+ */
+static int dir_find_entry(const struct fs_inode *dir_inode, const char *name, int len)
+{
+    // Must be a directory
+    if (!S_ISDIR(dir_inode->mode))
+        return -ENOTDIR;
+
+    char blk[BLOCK_SIZE];
+    int idx;
+    int off = dir_lookup(dir_inode, name, len, blk, &idx);
+    if (off < 0)
+        return off;
+    return DIRENT_AT(blk, off)->inode; // child inum
+}
+
+/**
+ * Put an entry (name -> inum) in the space occupied by 'de', which
+ * must be unused or have at least FS_DIRENT_SIZE(len) bytes to spare
+ * after its own name; in the second case it is split.
+ */
+static void dirent_fill(struct fs_dirent *de, const char *name, int len, int inum)
+{
+    if (de->inode != 0)
+    {
+        int used = FS_DIRENT_SIZE(de->name_len);
+        struct fs_dirent *next = (void *)((char *)de + used);
+        next->rec_len = de->rec_len - used;
+        de->rec_len = used;
+        de = next;
+    }
+    de->inode = inum;
+    de->name_len = len;
+    de->pad = 0;
+    memcpy(de->name, name, len);
+}
+
+/* can entry 'de' take a new entry of 'need' bytes? */
+static int dirent_fits(const struct fs_dirent *de, int need)
+{
+    int used = de->inode ? FS_DIRENT_SIZE(de->name_len) : 0;
+    return de->rec_len - used >= need;
+}
+
+/* Slot maps: for recently changed directories, the size of the
+ * largest entry each directory block can still take, so an insert
+ * goes straight to a block with room. A map is built by the first
+ * insert into a directory after mount, kept current by the dir_*
+ * helpers, and dropped when the directory's inode block is freed.
+ * Kept in memory only. Entries are hashed like the inode locks, so a
+ * directory's lock, which its callers hold, covers its entry.
+ */
+#define DIRSLOT_CACHE INODE_LOCKS
+struct dir_slots
+{
+    int inum; // 0 = unused
+    uint16_t room[NDIRECT];
+};
+static struct dir_slots dirslot_tab[DIRSLOT_CACHE];
+
+static struct dir_slots *dirslot_lookup(int inum)
+{
+    struct dir_slots *ds = &dirslot_tab[inum % DIRSLOT_CACHE];
+    return ds->inum == inum ? ds : NULL;
+}
+
+static void dirslot_forget(int inum)
+{
+    struct dir_slots *ds = dirslot_lookup(inum);
+    if (ds != NULL)
+        ds->inum = 0;
+}
+
+/* largest entry that fits anywhere in directory block 'blk' */
+static int dirblock_room(const char *blk)
+{
+    int room = 0;
+    for (int off = 0; off < BLOCK_SIZE; off += DIRENT_AT(blk, off)->rec_len)
+    {
+        const struct fs_dirent *de = DIRENT_AT(blk, off);
+        int spare = de->rec_len - (de->inode ? FS_DIRENT_SIZE(de->name_len) : 0);
+        if (spare > room)
+            room = spare;
+    }
+    return room;
+}
+
+/* a directory block was just changed: refresh its slot map entry */
+static void dirslot_update(int dir_inum, int i, const char *blk)
+{
+    struct dir_slots *ds = dirslot_lookup(dir_inum);
+    if (ds != NULL)
+        ds->room[i] = dirblock_room(blk);
+}
+
+/**
+ * Give directory 'dir_inum' a copy of its own of block i, if the
+ * block is shared with a snapshot. Every entry in the copy is a new
+ * reference to its inode. Writes the directory's inode.
+ *
+ * Returns 0, or negative error
+ */
+static int dir_block_unshare(int dir_inum, struct fs_inode *dir_inode, int i)
+{
+    if (!block_shared(dir_inode->ptrs[i]))
+        return 0;
+
+    char blk[BLOCK_SIZE];
+    if (dir_read_block(dir_inode, i, blk) < 0)
+        return -EIO;
+    int copy = find_free_block();
+    if (copy < 0)
+        return copy;
+    for (int off = 0; off < BLOCK_SIZE; off += DIRENT_AT(blk, off)->rec_len)
+    {
+        int rv = DIRENT_AT(blk, off)->inode ? ref_get(DIRENT_AT(blk, off)->inode) : 0;
+        if (rv < 0)
+        {
+            for (int o = 0; o < off; o += DIRENT_AT(blk, o)->rec_len)
+                if (DIRENT_AT(blk, o)->inode)
+                    ref_put(DIRENT_AT(blk, o)->inode);
+            free_block(copy);
+            return rv;
+        }
+    }
+    if (bcache_write(blk, copy) < 0)
+    {
+        free_block(copy);
+        return -EIO;
+    }
+
+    int old = dir_inode->ptrs[i];
+    dir_inode->ptrs[i] = copy;
+    if (write_inode(dir_inum, dir_inode) < 0)
+        return -EIO;
+    return free_block(old);
+}
+
+/* write back directory block i of 'dir_inode' after changing it in
+ * 'blk' - to a copy of the directory's own, if it was shared */
+static int dir_write_block(int dir_inum, struct fs_inode *dir_inode, int i, const char *blk)
+{
+    int rv = dir_block_unshare(dir_inum, dir_inode, i);
+    if (rv < 0)
+        return rv;
+    return bcache_write(blk, dir_inode->ptrs[i]);
+}
+
+/**
+ * Add 'name' -> child_inum to directory 'dir_inum'. With 'check' set,
+ * fail with -EEXIST if the name is already there. The directory is
+ * read at most once, for the EEXIST check or to build its slot map;
+ * the block that takes the new entry comes from the map, so without a
+ * check and with a map loaded only that block is read. Called with
+ * the directory's lock held, which also covers its slot map.
+ * Returns 0, -ENOSPC if the directory is full, or another error.
+ */
+static int dir_insert(int dir_inum, struct fs_inode *dir_inode, const char *name,
+                      int len, int child_inum, int check)
+{
+    if (!S_ISDIR(dir_inode->mode))
+        return -ENOTDIR;
+
+    if (len > MAX_NAME_LEN)
+        return -ENAMETOOLONG;
+    int need = FS_DIRENT_SIZE(len);
+    struct dir_key key;
+    if (check)
+        dir_key_init(&key, name, len);
+
+    struct dir_slots *ds = dirslot_lookup(dir_inum);
+    int build = (ds == NULL);
+    if (build)
+    {
+        ds = &dirslot_tab[dir_inum % DIRSLOT_CACHE];
+        memset(ds, 0, sizeof(*ds));
+        ds->inum = dir_inum;
+    }
+
+    int slot = -1;
+    for (int i = 0; !build && i < NDIRECT; i++)
+        if (dir_inode->ptrs[i] != 0 && ds->room[i] >= need)
+        {
+            slot = i;
+            break;
+        }
+
+    char blk[BLOCK_SIZE], slot_blk[BLOCK_SIZE];
+    for (int i = 0; i < NDIRECT; i++)
+    {
+        if (dir_inode->ptrs[i] == 0)
+            continue;
+        if (!check && !build && i != slot)
+            continue;
+        if (dir_read_block(dir_inode, i, blk) < 0)
+        {
+            dirslot_forget(dir_inum);
+            return -EIO;
+        }
+
+        if (check && dirblock_find(blk, &key) >= 0)
+        {
+            if (build)
+                dirslot_forget(dir_inum); // only partly built
+            return -EEXIST;
+        }
+
+        if (build)
+        {
+            ds->room[i] = dirblock_room(blk);
+            if (slot < 0 && ds->room[i] >= need)
+                slot = i;
+        }
+        if (i == slot)
+            memcpy(slot_blk, blk, BLOCK_SIZE);
+    }
+
+    if (slot >= 0)
+    {
+        for (int off = 0; off < BLOCK_SIZE; off += DIRENT_AT(slot_blk, off)->rec_len)
+        {
+            if (dirent_fits(DIRENT_AT(slot_blk, off), need))
+            {
+                dirent_fill(DIRENT_AT(slot_blk, off), name, len, child_inum);
+                ds->room[slot] = dirblock_room(slot_blk);
+                int rv = dir_write_block(dir_inum, dir_inode, slot, slot_blk);
+                if (rv < 0)
+                {
+                    dirslot_forget(dir_inum);
+                    return rv;
+                }
+                return 0;
+            }
+        }
+        dirslot_forget(dir_inum); // map was wrong
+        return -EIO;
+    }
+
+    // No room: allocate a new directory block
+    for (int i = 0; i < NDIRECT; i++)
+    {
+        if (dir_inode->ptrs[i] == 0)
+        {
+            int new_block = find_free_block();
+            if (new_block < 0)
+                return new_block; // Propagate error
+
+            // One entry, covering the whole block
+            memset(blk, 0, sizeof(blk));
+            DIRENT_AT(blk, 0)->rec_len = BLOCK_SIZE;
+            dirent_fill(DIRENT_AT(blk, 0), name, len, child_inum);
+
+            // Write the new block
+            if (bcache_write(blk, new_block) < 0)
+            {
+                free_block(new_block);
+                return -EIO;
+            }
+
+            // Update parent inode
+            dir_inode->ptrs[i] = new_block;
+            ds->room[i] = BLOCK_SIZE - need;
+
+            // Update size if necessary
+            if (dir_inode->size < (i + 1) * BLOCK_SIZE)
+                dir_inode->size = (i + 1) * BLOCK_SIZE;
+
+            return 0; // Success
+        }
+    }
+
+    return -ENOSPC; // No free pointers in parent inode
+}
+
+/**
+ * Add a new entry (name -> child_inum) to directory 'dir_inum', whose
+ * inode is 'parent_inode'. Returns 0 on success, -EEXIST if the name
+ * is taken, or another negative error (e.g. ENOSPC if dir is full).
+ */
+static int dir_add_entry(int dir_inum, struct fs_inode *parent_inode, const char *name,
+                         int len, int child_inum)
+{
+    return dir_insert(dir_inum, parent_inode, name, len, child_inum, 1);
+}
+
+/**
+ * Remove the entry with 'name' from 'dir_inode'. Its space is merged
+ * into the entry before it, or just marked unused if it comes first
+ * in the block. If not found, returns -ENOENT.
+ */
+static int dir_remove_entry(int dir_inum, struct fs_inode *dir_inode, const char *name,
+                            int len)
+{
+    if (!S_ISDIR(dir_inode->mode))
+        return -ENOTDIR;
+
+    char blk[BLOCK_SIZE];
+    int idx;
+    int off = dir_lookup(dir_inode, name, len, blk, &idx);
+    if (off < 0)
+        return off;
+
+    struct fs_dirent *de = DIRENT_AT(blk, off);
+    if (off == 0)
+        de->inode = 0;
+    else
+    {
+        int prev = 0;
+        while (prev + DIRENT_AT(blk, prev)->rec_len != off)
+            prev += DIRENT_AT(blk, prev)->rec_len;
+        DIRENT_AT(blk, prev)->rec_len += de->rec_len;
+    }
+    dirslot_update(dir_inum, idx, blk);
+    dcache_drop(dir_inum, name, len);
+    return dir_write_block(dir_inum, dir_inode, idx, blk);
+}
+
+/**
+ * Find the entry 'name' in 'dir_inode' and make it 'new_name' -> 'inum'.
+ * Used by rename, both to rename an entry in place and to point an
+ * existing name at a different inode. This is a single block write
+ * unless a longer new name doesn't fit where the old one was; then
+ * the entry is moved, and the caller must have checked that
+ * 'new_name' isn't already there. If not found, returns -ENOENT.
+ */
+static int dir_set_entry(int dir_inum, struct fs_inode *dir_inode, const char *name,
+                         int len, const char *new_name, int new_len, int inum)
+{
+    char blk[BLOCK_SIZE];
+    int idx;
+    int off = dir_lookup(dir_inode, name, len, blk, &idx);
+    if (off < 0)
+        return off;
+
+    struct fs_dirent *de = DIRENT_AT(blk, off);
+    if (new_len > MAX_NAME_LEN)
+        return -ENAMETOOLONG;
+    if (FS_DIRENT_SIZE(new_len) > de->rec_len)
+    {
+        int rv = dir_remove_entry(dir_inum, dir_inode, name, len);
+        if (rv < 0)
+            return rv;
+        return dir_insert(dir_inum, dir_inode, new_name, new_len, inum, 0);
+    }
+
+    de->inode = inum;
+    de->name_len = new_len;
+    memcpy(de->name, new_name, new_len);
+    dirslot_update(dir_inum, idx, blk);
+    dcache_drop(dir_inum, name, len);
+    return dir_write_block(dir_inum, dir_inode, idx, blk);
+}
+
+/**
  * Check if directory is empty (besides possibly "." or ".." if you implemented those).
  * Return 1 if empty, 0 if not empty, negative on error.
  */
@@ -327,44 +2048,191 @@ static int dir_is_empty(const struct fs_inode *dir_inode)
     if (!S_ISDIR(dir_inode->mode))
         return -ENOTDIR;
 
+    char blk[BLOCK_SIZE];
     for (int i = 0; i < NDIRECT; i++)
     {
         if (dir_inode->ptrs[i] == 0)
             continue;
-
-        struct fs_dirent dirents[MAX_DIR_ENTRIES];
-        if (block_read(dirents, dir_inode->ptrs[i], 1) < 0)
+        if (dir_read_block(dir_inode, i, blk) < 0)
             return -EIO;
 
-        for (int j = 0; j < MAX_DIR_ENTRIES; j++)
-        {
-            if (dirents[j].valid)
-            {
-                // We might consider "." or ".." as special, but
-                // if your assignment doesn't create them by default,
-                // then any valid entry means "not empty"
+        for (int off = 0; off < BLOCK_SIZE; off += DIRENT_AT(blk, off)->rec_len)
+            if (DIRENT_AT(blk, off)->inode != 0)
                 return 0;
-            }
-        }
     }
     return 1; // no valid entries found
 }
 
-/* init - this is called once by the FUSE framework at startup. Ignore
- * the 'conn' argument.
+/**
+ * Drop a reference to inode 'inum' - a directory entry or a snapshot
+ * going away. If it was the last, the inode is freed along with what
+ * it points to, and for a directory, the inodes in any blocks that go
+ * with it are released in turn. The caller has removed the entry.
+ */
+static void inode_put(int inum)
+{
+    if (block_shared(inum))
+    {
+        free_block(inum); // just drops the reference
+        return;
+    }
+
+    struct fs_inode inode;
+    if (read_inode(inum, &inode) < 0)
+        return;
+    if (!S_ISDIR(inode.mode))
+    {
+        /* again under the lock, in case the log cleaner moved a block */
+        inode_lock(inum);
+        if (read_inode(inum, &inode) == 0)
+        {
+            free_inode_blocks(&inode);
+            free_block(inum);
+            open_forget(inum);
+        }
+        inode_unlock(inum);
+        return;
+    }
+
+    char blk[BLOCK_SIZE];
+    for (int i = 0; i < NDIRECT; i++)
+    {
+        if (inode.ptrs[i] == 0 || dir_read_block(&inode, i, blk) < 0)
+            continue;
+        int last = !block_shared(inode.ptrs[i]);
+        for (int off = 0; off < BLOCK_SIZE; off += DIRENT_AT(blk, off)->rec_len)
+        {
+            struct fs_dirent *de = DIRENT_AT(blk, off);
+            if (de->inode == 0)
+                continue;
+            dcache_drop(inum, de->name, de->name_len);
+            if (last)
+                inode_put(de->inode);
+        }
+    }
+    inode_lock(inum);
+    dirslot_forget(inum);
+    inode_unlock(inum);
+    free_inode_blocks(&inode);
+    free_block(inum);
+}
+
+/**
+ * Make 'inode', a copy of another, a second owner of its blocks: take
+ * a reference to each of them, except that a packed tail is copied
+ * out to a block of its own (fragments have no reference counts). The
+ * reference table must have been allocated.
+ *
+ * Returns 0, or negative error, with nothing taken
+ */
+static int inode_share_blocks(struct fs_inode *inode)
+{
+    if (inode->flags & FS_INODE_INLINE)
+        return 0;
+
+    int tail = (inode->flags & FS_INODE_TAIL) ? tail_index(inode) : -1;
+    for (int i = 0; i < NDIRECT; i++)
+    {
+        if (inode->ptrs[i] == 0 || i == tail)
+            continue;
+        int rv = ref_get(inode->ptrs[i]);
+        if (rv < 0)
+        {
+            while (--i >= 0)
+                if (inode->ptrs[i] != 0 && i != tail)
+                    ref_put(inode->ptrs[i]);
+            return rv;
+        }
+    }
+    if (tail >= 0)
+    {
+        int block = tail_copy_out(inode);
+        inode->flags &= ~FS_INODE_TAIL;
+        if (block < 0)
+        {
+            inode->ptrs[tail] = 0;
+            free_inode_blocks(inode); // drops the references again
+            return block;
+        }
+        inode->ptrs[tail] = block;
+    }
+    return 0;
+}
+
+/**
+ * Copy an inode shared with a snapshot, so that the copy can be
+ * changed. The copy shares the original's blocks (see
+ * inode_share_blocks), and the original loses the caller's reference.
+ * The caller points its directory entry at the copy.
+ *
+ * Returns the copy's inode number, or negative error
+ */
+static int inode_unshare(int inum)
+{
+    struct fs_inode inode;
+    if (read_inode(inum, &inode) < 0)
+        return -EIO;
+
+    int copy = find_free_block();
+    if (copy < 0)
+        return copy;
+    int rv = inode_share_blocks(&inode);
+    if (rv < 0)
+    {
+        free_block(copy);
+        return rv;
+    }
+    if (write_inode(copy, &inode) < 0)
+    {
+        free_inode_blocks(&inode);
+        free_block(copy);
+        return -EIO;
+    }
+    if ((rv = free_block(inum)) < 0)
+    {
+        free_inode_blocks(&inode);
+        free_block(copy);
+        return rv;
+    }
+    return copy;
+}
+
+/* init - this is called once by the FUSE framework at startup.
+ * 'conn' describes the kernel connection (NULL when called from the
+ * unit tests); we use it to ask for large requests and splicing.
  * recommended actions:
  *   - read superblock
  *   - allocate memory, read bitmaps and inodes
  */
 void *fs_init(struct fuse_conn_info *conn)
 {
-    // Clear memory first to ensure clean state
+    // Ask for big requests, parallel readahead and splice support
+    // (read_buf/write_buf). FUSE clamps max_write to its buffer size.
+    if (conn != NULL)
+    {
+        conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_BIG_WRITES |
+                                       FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE |
+                                       FUSE_CAP_SPLICE_MOVE);
+        conn->async_read = 1;
+        conn->max_write = FS_MAX_XFER;
+        conn->max_readahead = FS_MAX_XFER;
+    }
+
+    // Stop the log cleaner, then clear memory to ensure clean state
+    log_reset();
     memset(g_bitmap, 0, sizeof(g_bitmap));
     memset(&superblock, 0, sizeof(superblock));
     memset(&g_root_node, 0, sizeof(g_root_node));
+    memset(dirslot_tab, 0, sizeof(dirslot_tab));
+    memset(lazytime_tab, 0, sizeof(lazytime_tab));
+
+    stats_reset();
+    trace_init();
+    cache_reset();
+    resv_reset();
 
     // Read superblock
-    if (block_read(&superblock, 0, 1) < 0)
+    if (disk_read(&superblock, 0, 1) < 0)
     {
         fprintf(stderr, "Error: Failed to read superblock\n");
     }
@@ -375,32 +2243,68 @@ void *fs_init(struct fuse_conn_info *conn)
         fprintf(stderr, "Warning: Invalid superblock magic\n");
     }
 
-    // Read bitmap
-    if (block_read(g_bitmap, 1, 1) < 0)
+    // Read the reference table, if there are snapshots
+    if (ref_load() < 0)
+    {
+        fprintf(stderr, "Error: Failed to read reference table\n");
+    }
+    open_reset();
+    blkgen_reset();
+
+    // Read bitmap now, unless the superblock's free count can stand in
+    // for it until the first allocation
+    bitmap_loaded = 0;
+    int clean = (superblock.state & FS_STATE_CLEAN) &&
+                superblock.free_blocks <= superblock.disk_size;
+    if (!clean && bitmap_load() < 0)
     {
         fprintf(stderr, "Error: Failed to read bitmap\n");
     }
 
     // Read root inode
-    if (block_read(&g_root_node, ROOT_INUM, 1) < 0)
+    if (disk_read(&g_root_node, ROOT_INUM, 1) < 0)
     {
         fprintf(stderr, "Error: Failed to read root inode\n");
     }
 
+    // Read fragment table, if the image has one
+    memset(g_fragtab, 0, sizeof(g_fragtab));
+    if (superblock.frag_table != 0 && disk_read(g_fragtab, superblock.frag_table, 1) < 0)
+    {
+        fprintf(stderr, "Error: Failed to read fragment table\n");
+    }
+
     // Verify root inode is a directory
     if (!S_ISDIR(g_root_node.mode))
     {
         fprintf(stderr, "Warning: Root inode is not a directory\n");
     }
 
-    // mark blocks 0, 1, 2  as used
-    bit_set(g_bitmap, 0);
-    bit_set(g_bitmap, 1);
-    bit_set(g_bitmap, 2);
-
     return NULL;
 }
 
+/* destroy - called on unmount. Write out pending timestamps, stop the
+ * log cleaner, give back any block reservations, and
+ * if the bitmap has changed, record the free count in the superblock
+ * and mark it clean, so the next mount needn't read the bitmap.
+ */
+void fs_destroy(void *private_data)
+{
+    lazytime_flush_all();
+    log_stop();
+    resv_reclaim();
+
+    pthread_mutex_lock(&bitmap_lock);
+    if (bitmap_loaded && !(superblock.state & FS_STATE_CLEAN))
+    {
+        superblock.free_blocks = fext_free_count() + resv_blocks;
+        superblock.state |= FS_STATE_CLEAN;
+        if (super_write(&superblock) < 0)
+            fprintf(stderr, "Error: Failed to write superblock\n");
+    }
+    pthread_mutex_unlock(&bitmap_lock);
+}
+
 /* Note on path translation errors:
  * In addition to the method-specific errors listed below, almost
  * every method can return one of the following errors if it fails to
@@ -409,20 +2313,17 @@ void *fs_init(struct fuse_conn_info *conn)
  * ENOENT - a component of the path doesn't exist.
  * ENOTDIR - an intermediate component of the path (e.g. 'b' in
  *           /a/b/c) is not a directory
+ * ENAMETOOLONG - a component of the path is longer than MAX_NAME_LEN
  */
 
 /* note on splitting the 'path' variable:
  * the value passed in by the FUSE framework is declared as 'const',
- * which means you can't modify it. The standard mechanisms for
- * splitting strings in C (strtok, strsep) modify the string in place,
- * so you have to copy the string and then free the copy when you're
- * done. One way of doing this:
- *
- *    char *_path = strdup(path);
- *    int inum = translate(_path);
- *    free(_path);
+ * which means you can't modify it. Rather than copying it so strtok
+ * can chop it up, path_next hands out each component as a view into
+ * the original string (a pointer and a length), and path_lookup
+ * resolves one component at a time, so there's no limit on depth and
+ * no malloc on the lookup path.
  */
-
 /* getattr - get file or directory attributes. For a description of
  *  the fields in 'struct stat', see 'man lstat'.
  *
@@ -437,93 +2338,378 @@ void *fs_init(struct fuse_conn_info *conn)
  *        again in readdir
  */
 
-int parse(char *path, char **argv)
+/* one path component: a view into the caller's path, which is not
+ * NUL-terminated at 'len'
+ */
+struct name_view
+{
+    const char *name;
+    int len;
+};
+
+/**
+ * Step *path past its next component, which is returned in *nv.
+ * Returns 1, or 0 (with nv->len = 0) at the end of the path.
+ */
+static int path_next(const char **path, struct name_view *nv)
+{
+    const char *p = *path;
+    while (*p == '/')
+        p++;
+    nv->name = p;
+    while (*p != '\0' && *p != '/')
+        p++;
+    nv->len = p - nv->name;
+    *path = p;
+    return nv->len > 0;
+}
+
+/* is there anything but slashes left in 'path'? */
+static int path_more(const char *path)
+{
+    while (*path == '/')
+        path++;
+    return *path != '\0';
+}
+
+/* Snapshots. /.snapshots is a directory that isn't stored anywhere,
+ * listing the snapshots in the superblock. mkdir /.snapshots/NAME
+ * takes one and rmdir removes it; /.snapshots/NAME is the tree as it
+ * was then, read-only. Taking a snapshot copies the root inode and
+ * takes a reference to each of its directory blocks, and nothing else:
+ * the rest of the tree is only copied as the live side changes it (see
+ * path_lookup_rw).
+ */
+#define SNAP_DIR ".snapshots"
+
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* step *path past a first component of SNAP_DIR, if it has one */
+static int snap_skip(const char **path)
+{
+    struct name_view nv;
+    const char *p = *path;
+    if (!path_next(&p, &nv) || nv.len != sizeof(SNAP_DIR) - 1 ||
+        memcmp(nv.name, SNAP_DIR, nv.len) != 0)
+        return 0;
+    *path = p;
+    return 1;
+}
+
+/* is 'path' in /.snapshots, or /.snapshots itself? */
+static int snap_path(const char *path)
+{
+    return snap_skip(&path);
+}
+
+static int is_snap_dir(const char *path)
+{
+    return snap_skip(&path) && !path_more(path);
+}
+
+/* is 'path' /.snapshots/NAME? If so NAME is returned in *nv */
+static int snap_name(const char *path, struct name_view *nv)
+{
+    return snap_skip(&path) && path_next(&path, nv) && !path_more(path);
+}
+
+/* are there any snapshots? */
+static int snap_any(void)
 {
-    int i;
-    for (i = 0; i < MAX_PATH_LEN; i++)
+    for (int i = 0; i < FS_SNAP_MAX; i++)
+        if (superblock.snaps[i].root != 0)
+            return 1;
+    return 0;
+}
+
+/* slot of the snapshot called 'name' (len bytes), or -1 */
+static int snap_find(const char *name, int len)
+{
+    for (int i = 0; i < FS_SNAP_MAX; i++)
     {
-        if ((argv[i] = strtok(path, "/")) == NULL)
-            break;
-        if (strlen(argv[i]) > MAX_NAME_LEN)
-            argv[i][MAX_NAME_LEN] = '\0';
-        path = NULL;
+        struct fs_snap *sn = &superblock.snaps[i];
+        if (sn->root != 0 && strnlen(sn->name, FS_SNAP_NAME) == (size_t)len &&
+            memcmp(sn->name, name, len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* snap_create's work, with snap_lock held */
+static int snap_take(const char *name, int len)
+{
+    int slot = -1;
+    for (int i = 0; i < FS_SNAP_MAX && slot < 0; i++)
+        if (superblock.snaps[i].root == 0)
+            slot = i;
+    if (snap_find(name, len) >= 0)
+        return -EEXIST;
+    if (slot < 0)
+        return -ENOSPC;
+
+    lazytime_flush_all();
+    int rv = ref_table_init();
+    if (rv < 0)
+        return rv;
+
+    struct fs_inode root;
+    if (read_inode(ROOT_INUM, &root) < 0)
+        return -EIO;
+    int copy = find_free_block();
+    if (copy < 0)
+        return copy;
+    rv = inode_share_blocks(&root);
+    if (rv == 0 && write_inode(copy, &root) < 0)
+    {
+        free_inode_blocks(&root);
+        rv = -EIO;
+    }
+    if (rv < 0)
+    {
+        free_block(copy);
+        return rv;
     }
-    return i;
+
+    struct fs_snap *sn = &superblock.snaps[slot];
+    sn->root = copy;
+    sn->ctime = time(NULL);
+    memset(sn->name, 0, sizeof(sn->name));
+    memcpy(sn->name, name, len);
+    if (super_write(&superblock) < 0)
+        return -EIO;
+    return 0;
+}
+
+/**
+ * Take a snapshot called 'name' (len bytes): a copy of the root inode
+ * that shares its directory blocks. Pending timestamps are written out
+ * first, so that the snapshot has them.
+ *
+ * Returns 0, -EEXIST, -ENAMETOOLONG, -ENOSPC if the snapshot table or
+ * the disk is full, or -EIO
+ */
+static int snap_create(const char *name, int len)
+{
+    if (len >= FS_SNAP_NAME)
+        return -ENAMETOOLONG;
+    if (fs_kernel_cache)
+        return -EOPNOTSUPP;
+
+    pthread_mutex_lock(&snap_lock);
+    int rv = snap_take(name, len);
+    pthread_mutex_unlock(&snap_lock);
+    return rv;
 }
 
-int translate(int pathc, char **pathv)
+/* remove the snapshot called 'name', freeing whatever only it used */
+static int snap_delete(const char *name, int len)
 {
-    // Special case for root directory "/"
-    if (pathc == 0)
+    pthread_mutex_lock(&snap_lock);
+    int slot = snap_find(name, len);
+    if (slot < 0)
     {
-        // fprintf(stderr, "translate: Root directory requested, returning inode %d\n", ROOT_INUM);
-        return ROOT_INUM;
+        pthread_mutex_unlock(&snap_lock);
+        return -ENOENT;
     }
 
+    int root = superblock.snaps[slot].root;
+    memset(&superblock.snaps[slot], 0, sizeof(superblock.snaps[slot]));
+    int rv = super_write(&superblock) < 0 ? -EIO : 0;
+    pthread_mutex_unlock(&snap_lock);
+
+    inode_put(root);
+    return rv;
+}
+
+/**
+ * Where a lookup of a path in /.snapshots starts: step *path past
+ * /.snapshots/NAME and return the snapshot's root. Fails with -EROFS
+ * if there is a 'leaf' (see path_lookup), as only changes want one,
+ * and -EISDIR for /.snapshots itself, which callers that can handle
+ * it check for first.
+ */
+static int snap_root(const char **path, struct name_view *leaf)
+{
+    struct name_view nv;
+
+    snap_skip(path);
+    if (leaf != NULL)
+        return -EROFS;
+    if (!path_next(path, &nv))
+        return -EISDIR;
+    int slot = snap_find(nv.name, nv.len);
+    return slot < 0 ? -ENOENT : (int)superblock.snaps[slot].root;
+}
+
+/**
+ * Translate 'path' to an inode number, a component at a time. If
+ * 'leaf' isn't NULL the last component isn't looked up but returned
+ * in *leaf, and the result is the directory that should hold it;
+ * then "/" gets -EINVAL, as it has no last component.
+ * Errors - ENOENT, ENOTDIR, ENAMETOOLONG, EINVAL, EIO
+ */
+static int path_lookup(const char *path, struct name_view *leaf)
+{
     int inum = ROOT_INUM;
-    // fprintf(stderr, "translate: Starting at root inode %d\n", inum);
+    struct name_view nv;
 
-    for (int i = 0; i < pathc; i++)
+    if (snap_path(path))
     {
+        inum = snap_root(&path, leaf);
+        if (inum < 0)
+            return inum;
+    }
+
+    while (path_next(&path, &nv))
+    {
+        if (leaf != NULL && !path_more(path))
+        {
+            *leaf = nv;
+            return nv.len > MAX_NAME_LEN ? -ENAMETOOLONG : inum;
+        }
+
+        // A cached name saves reading both the directory and its blocks
+        uint64_t gen = dcache_generation();
+        int cached = dcache_lookup(inum, nv.name, nv.len);
+        if (cached >= 0)
+        {
+            inum = cached;
+            continue;
+        }
+
+        TRACE_START(t0);
         struct fs_inode inode;
         if (read_inode(inum, &inode) < 0)
-        {
-            // fprintf(stderr, "translate: Failed to read inode %d\n", inum);
             return -EIO;
-        }
 
         if (!S_ISDIR(inode.mode))
-        {
-            // fprintf(stderr, "translate: inode %d is not a directory (mode: %o)\n", inum, inode.mode);
             return -ENOTDIR;
+
+        // Check if directory has any blocks allocated
+        int has_blocks = 0;
+        for (int j = 0; j < NDIRECT; j++)
+        {
+            if (inode.ptrs[j] != 0)
+            {
+                has_blocks = 1;
+                break;
+            }
+        }
+
+        if (!has_blocks)
+        {
+            TRACE(TR_LOOKUP, inum, -1, 0, nv.len, -ENOENT, t0);
+            return -ENOENT;
         }
 
-        // fprintf(stderr, "translate: Looking for '%s' in directory inode %d (size: %d)\n",pathv[i], inum, inode.size);
+        int child_inum = dir_find_entry(&inode, nv.name, nv.len);
+        TRACE(TR_LOOKUP, inum, -1, 0, nv.len, child_inum, t0);
+        if (child_inum < 0)
+            return child_inum; // Propagate error (likely -ENOENT)
+
+        dcache_add(inum, nv.name, nv.len, child_inum, gen);
+        inum = child_inum;
+    }
+
+    return leaf != NULL ? -EINVAL : inum;
+}
+
+/* path_lookup_rw's step from directory 'inum' to its entry 'nv',
+ * called with the directory's lock held.
+ */
+static int path_step_rw(int inum, const struct name_view *nv)
+{
+    struct fs_inode dir;
+    char blk[BLOCK_SIZE];
+    int idx;
+    uint64_t gen = dcache_generation();
+    if (read_inode(inum, &dir) < 0)
+        return -EIO;
+    if (!S_ISDIR(dir.mode))
+        return -ENOTDIR;
+    int off = dir_lookup(&dir, nv->name, nv->len, blk, &idx);
+    if (off < 0)
+        return off;
+    int rv = dir_block_unshare(inum, &dir, idx);
+    if (rv < 0)
+        return rv;
+
+    int child = DIRENT_AT(blk, off)->inode;
+    if (block_shared(child))
+    {
+        child = inode_unshare(child);
+        if (child < 0)
+            return child;
+        DIRENT_AT(blk, off)->inode = child;
+        if (bcache_write(blk, dir.ptrs[idx]) < 0)
+            return -EIO;
+        dcache_drop(inum, nv->name, nv->len);
+    }
+    dcache_add(inum, nv->name, nv->len, child, gen);
+    return child;
+}
 
-        // Check if directory has any blocks allocated
-        int has_blocks = 0;
-        for (int j = 0; j < NDIRECT; j++)
-        {
-            if (inode.ptrs[j] != 0)
-            {
-                has_blocks = 1;
-                break;
-            }
-        }
+/**
+ * path_lookup for an operation that is about to change what it finds
+ * (or with 'leaf', the directory that holds it). Snapshots are
+ * read-only, so paths in /.snapshots get -EROFS. While there are any
+ * snapshots, every directory block on the way and every inode up to
+ * the one returned is first made the live tree's own, by
+ * dir_block_unshare and inode_unshare, so the caller can change it in
+ * place; the directory cache is kept up to date as inodes move. Each
+ * directory is changed under its lock. (Clones only share data
+ * blocks, which the write paths take care of.)
+ */
+static int path_lookup_rw(const char *path, struct name_view *leaf)
+{
+    if (snap_path(path))
+        return -EROFS;
+    if (!snap_any())
+        return path_lookup(path, leaf);
 
-        if (!has_blocks)
-        {
-            // fprintf(stderr, "translate: Directory inode %d has no blocks allocated\n", inum);
-            return -ENOENT;
-        }
+    int inum = ROOT_INUM;
+    struct name_view nv;
 
-        int child_inum = dir_find_entry(&inode, pathv[i]);
-        if (child_inum < 0)
+    while (path_next(&path, &nv))
+    {
+        if (leaf != NULL && !path_more(path))
         {
-            // fprintf(stderr, "translate: Failed to find '%s' in directory %d\n", pathv[i], inum);
-            return child_inum; // Propagate error (likely -ENOENT)
+            *leaf = nv;
+            return nv.len > MAX_NAME_LEN ? -ENAMETOOLONG : inum;
         }
 
-        // fprintf(stderr, "translate: Found '%s' at inode %d\n", pathv[i], child_inum);
-        inum = child_inum;
+        inode_lock(inum);
+        int child = path_step_rw(inum, &nv);
+        inode_unlock(inum);
+        if (child < 0)
+            return child;
+        inum = child;
     }
 
-    // fprintf(stderr, "translate: Final path component resolves to inode %d\n", inum);
-    return inum;
+    return leaf != NULL ? -EINVAL : inum;
 }
 
 int fs_getattr(const char *path, struct stat *sb)
 {
-    char *c_path = strdup(path);
-    if (c_path == NULL)
+    if (is_stats_file(path))
     {
-        return -ENOMEM;
+        memset(sb, 0, sizeof(struct stat));
+        sb->st_mode = S_IFREG | 0444;
+        sb->st_size = stats_format(NULL, 0);
+        sb->st_nlink = 1;
+        sb->st_atime = sb->st_ctime = sb->st_mtime = time(NULL);
+        return 0;
+    }
+    if (is_snap_dir(path))
+    {
+        memset(sb, 0, sizeof(struct stat));
+        sb->st_mode = S_IFDIR | 0555;
+        sb->st_nlink = 1;
+        sb->st_atime = sb->st_ctime = sb->st_mtime = time(NULL);
+        return 0;
     }
 
-    char *tokens[MAX_PATH_LEN];
-    int num_tokens = parse(c_path, tokens);
-    int inum = translate(num_tokens, tokens);
-    free(c_path);
+    int inum = path_lookup(path, NULL);
 
     if (inum < 0)
         return inum;
@@ -537,6 +2723,7 @@ int fs_getattr(const char *path, struct stat *sb)
     memset(sb, 0, sizeof(struct stat));
     sb->st_mode = inode.mode;
     sb->st_size = inode.size;
+    sb->st_blocks = inode_blocks(&inode) * (BLOCK_SIZE / 512);
     sb->st_nlink = 1;
     sb->st_atime = sb->st_ctime = sb->st_mtime = inode.mtime;
     sb->st_uid = inode.uid;
@@ -544,6 +2731,37 @@ int fs_getattr(const char *path, struct stat *sb)
     return 0;
 }
 
+/* list /.snapshots: each snapshot, with the attributes of its root */
+static int snap_readdir(void *ptr, fuse_fill_dir_t filler)
+{
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFDIR | 0555;
+    st.st_nlink = 1;
+    if (filler(ptr, ".", &st, 0) != 0 || filler(ptr, "..", &st, 0) != 0)
+        return -ENOMEM;
+
+    for (int i = 0; i < FS_SNAP_MAX; i++)
+    {
+        struct fs_snap *sn = &superblock.snaps[i];
+        struct fs_inode root;
+        char name[FS_SNAP_NAME + 1];
+        if (sn->root == 0)
+            continue;
+        if (read_inode(sn->root, &root) < 0)
+            return -EIO;
+        st.st_mode = root.mode;
+        st.st_uid = root.uid;
+        st.st_gid = root.gid;
+        st.st_atime = st.st_ctime = st.st_mtime = sn->ctime;
+        memcpy(name, sn->name, FS_SNAP_NAME);
+        name[FS_SNAP_NAME] = '\0';
+        if (filler(ptr, name, &st, 0) != 0)
+            return -ENOMEM;
+    }
+    return 0;
+}
+
 /* readdir - get directory contents.
  *
  * call the 'filler' function once for each valid entry in the
@@ -559,18 +2777,10 @@ int fs_getattr(const char *path, struct stat *sb)
 int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
                off_t offset, struct fuse_file_info *fi)
 {
-    char *c_path = strdup(path);
-    if (c_path == NULL)
-    {
-        return -ENOMEM;
-    }
-
-    char *tokens[MAX_PATH_LEN];
-    int num_tokens = parse(c_path, tokens);
-    int inum;
+    if (is_snap_dir(path))
+        return snap_readdir(ptr, filler);
 
-    inum = translate(num_tokens, tokens);
-    free(c_path);
+    int inum = path_lookup(path, NULL);
 
     if (inum < 0)
         return inum;
@@ -594,22 +2804,24 @@ int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
     if (filler(ptr, "..", &st, 0) != 0)
         return -ENOMEM;
 
+    char blk[BLOCK_SIZE];
+    char name[MAX_NAME_LEN + 1];
     for (int j = 0; j < NDIRECT; j++)
     {
         if (dir_inode.ptrs[j] == 0)
             continue;
-        struct fs_dirent dirents[MAX_DIR_ENTRIES];
-        if (block_read(dirents, dir_inode.ptrs[j], 1) < 0)
+        if (dir_read_block(&dir_inode, j, blk) < 0)
             return -EIO;
 
-        for (int k = 0; k < MAX_DIR_ENTRIES; k++)
+        for (int off = 0; off < BLOCK_SIZE; off += DIRENT_AT(blk, off)->rec_len)
         {
-            if (!dirents[k].valid)
+            struct fs_dirent *de = DIRENT_AT(blk, off);
+            if (de->inode == 0)
                 continue;
             struct stat st;
             memset(&st, 0, sizeof(st));
             struct fs_inode entry_inode;
-            if (read_inode(dirents[k].inode, &entry_inode) < 0)
+            if (read_inode(de->inode, &entry_inode) < 0)
                 return -EIO;
             st.st_mode = entry_inode.mode;
             st.st_size = entry_inode.size;
@@ -617,7 +2829,9 @@ int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
             st.st_atime = st.st_ctime = st.st_mtime = entry_inode.mtime;
             st.st_uid = entry_inode.uid;
             st.st_gid = entry_inode.gid;
-            if (filler(ptr, dirents[k].name, &st, 0) != 0)
+            memcpy(name, de->name, de->name_len);
+            name[de->name_len] = '\0';
+            if (filler(ptr, name, &st, 0) != 0)
                 return -ENOMEM;
         }
     }
@@ -625,6 +2839,67 @@ int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
     return 0;
 }
 
+/**
+ * Make a new entry 'leaf' in directory 'parent_inum' for a new inode
+ * initialised from 'init', and update the directory's times. Called
+ * with the directory's lock held.
+ *
+ * Returns the new inode number, or negative error
+ */
+static int dir_create(int parent_inum, const struct name_view *leaf, const struct fs_inode *init)
+{
+    // Read parent inode
+    struct fs_inode parent_inode;
+    if (read_inode(parent_inum, &parent_inode) < 0)
+    {
+        return -EIO;
+    }
+
+    // Must be a directory
+    if (!S_ISDIR(parent_inode.mode))
+    {
+        return -ENOTDIR;
+    }
+
+    // Allocate the new inode. dir_add_entry checks for an existing
+    // name in the same pass that finds room for the new one.
+    int inum = find_free_block();
+    if (inum < 0)
+    {
+        // a full disk shouldn't hide EEXIST
+        if (dir_find_entry(&parent_inode, leaf->name, leaf->len) >= 0)
+            return -EEXIST;
+        return inum;
+    }
+
+    // Write the new inode
+    if (write_inode(inum, init) < 0)
+    {
+        free_block(inum);
+        return -EIO;
+    }
+
+    // Add entry to parent directory
+    int rv = dir_add_entry(parent_inum, &parent_inode, leaf->name, leaf->len, inum);
+    if (rv < 0)
+    {
+        free_block(inum);
+        return rv;
+    }
+
+    // Update parent timestamps
+    parent_inode.mtime = parent_inode.ctime = time(NULL);
+
+    // Write parent inode back
+    if (write_inode(parent_inum, &parent_inode) < 0)
+    {
+        // Note: the new inode is already allocated, we'll leave it orphaned
+        return -EIO;
+    }
+
+    return inum;
+}
+
 /* create - create a new file with specified permissions
  *
  * success - return 0
@@ -641,43 +2916,97 @@ int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
  */
 int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-    char *tmp = strdup(path);
-    if (!tmp)
-        return -ENOMEM;
+    if (is_stats_file(path))
+        return -EEXIST;
 
-    /* parse path */
-    char *tokens[MAX_PATH_LEN];
-    int count = parse(tmp, tokens);
+    // Get parent inode; 'leaf' is the last component of 'path'
+    struct name_view leaf;
+    int parent_inum = path_lookup_rw(path, &leaf);
 
-    if (count < 1)
+    if (parent_inum < 0)
     {
-        free(tmp);
-        return -EINVAL;
+        return parent_inum;
     }
 
-    char leaf[MAX_NAME_LEN + 1];
-    strncpy(leaf, tokens[count - 1], MAX_NAME_LEN);
-    leaf[MAX_NAME_LEN] = '\0';
+    // Initialize file inode
+    struct fs_inode file_inode;
+    memset(&file_inode, 0, sizeof(file_inode));
 
-    // Get parent inode
-    int parent_inum;
-    if (count == 1)
-    {
-        // File in root directory
-        parent_inum = ROOT_INUM;
-    }
-    else
-    {
-        parent_inum = translate(count - 1, tokens);
-    }
+    struct fuse_context *ctx = fuse_get_context();
+    file_inode.uid = ctx->uid;
+    file_inode.gid = ctx->gid;
+    file_inode.mode = mode;
+    file_inode.size = 0;
+    file_inode.flags = FS_INODE_INLINE; // small files never need a data block
+    file_inode.ctime = file_inode.mtime = time(NULL);
+
+    inode_lock(parent_inum);
+    int file_inum = dir_create(parent_inum, &leaf, &file_inode);
+    inode_unlock(parent_inum);
+    if (file_inum < 0)
+        return file_inum;
+
+    if (fi != NULL)
+        open_get(file_inum, fi->flags);
+    return 0;
+}
+
+/* mkdir - create a directory with the given mode.
+ *
+ * WARNING: unlike fs_create, @mode only has the permission bits. You
+ * have to OR it with S_IFDIR before setting the inode 'mode' field.
+ *
+ * success - return 0
+ * Errors - path resolution, EEXIST
+ * Conditions for EEXIST are the same as for create.
+ */
+int fs_mkdir(const char *path, mode_t mode)
+{
+    if (is_stats_file(path) || is_snap_dir(path))
+        return -EEXIST;
 
-    free(tmp); // Done with tokens
+    // mkdir /.snapshots/NAME takes a snapshot
+    struct name_view snap;
+    if (snap_name(path, &snap))
+        return snap_create(snap.name, snap.len);
+
+    // Get parent inode; 'leaf' is the last component of 'path'
+    struct name_view leaf;
+    int parent_inum = path_lookup_rw(path, &leaf);
 
     if (parent_inum < 0)
     {
         return parent_inum;
     }
 
+    // Initialize directory inode
+    struct fs_inode dir_inode;
+    memset(&dir_inode, 0, sizeof(dir_inode));
+
+    struct fuse_context *ctx = fuse_get_context();
+    dir_inode.uid = ctx->uid;
+    dir_inode.gid = ctx->gid;
+    dir_inode.mode = (mode & 0777) | S_IFDIR; // Add directory flag
+    dir_inode.size = BLOCK_SIZE;              // Directory has one block initially
+    dir_inode.ctime = dir_inode.mtime = time(NULL);
+
+    inode_lock(parent_inum);
+    int dir_inum = dir_create(parent_inum, &leaf, &dir_inode);
+    inode_unlock(parent_inum);
+    return dir_inum < 0 ? dir_inum : 0;
+}
+
+/**
+ * Remove the entry 'leaf' from directory 'parent_inum' for unlink
+ * ('is_dir' 0) or rmdir ('is_dir' 1), and update the directory's
+ * times. Called with the directory's lock held. The entry's inode is
+ * left for the caller to release with inode_put once it has dropped
+ * the lock, as inode_put may take the inode's own lock.
+ *
+ * Returns the entry's inode number, or negative error
+ */
+static int dir_unlink(int parent_inum, const struct name_view *leaf, int is_dir)
+{
     // Read parent inode
     struct fs_inode parent_inode;
     if (read_inode(parent_inum, &parent_inode) < 0)
@@ -691,47 +3020,46 @@ int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
         return -ENOTDIR;
     }
 
-    // Check if file already exists
-    int exists = dir_find_entry(&parent_inode, leaf);
-    if (exists >= 0)
+    // Find child inode
+    int child_inum = dir_find_entry(&parent_inode, leaf->name, leaf->len);
+    if (child_inum < 0)
     {
-        return -EEXIST; // File already exists
+        return child_inum; // Likely -ENOENT
     }
-    else if (exists != -ENOENT)
+
+    // Read child inode
+    struct fs_inode child_inode;
+    if (read_inode(child_inum, &child_inode) < 0)
     {
-        return exists; // Some other error
+        return -EIO;
     }
 
-    // Allocate inode for the new file
-    int file_inum = find_free_block();
-    if (file_inum < 0)
+    // A file for unlink, an empty directory for rmdir
+    if (!is_dir && S_ISDIR(child_inode.mode))
     {
-        return file_inum;
+        return -EISDIR;
     }
-
-    // Initialize file inode
-    struct fs_inode file_inode;
-    memset(&file_inode, 0, sizeof(file_inode));
-
-    struct fuse_context *ctx = fuse_get_context();
-    file_inode.uid = ctx->uid;
-    file_inode.gid = ctx->gid;
-    file_inode.mode = mode;
-    file_inode.size = 0;
-    file_inode.ctime = file_inode.mtime = time(NULL);
-
-    // Write file inode
-    if (write_inode(file_inum, &file_inode) < 0)
+    if (is_dir)
     {
-        free_block(file_inum);
-        return -EIO;
+        if (!S_ISDIR(child_inode.mode))
+        {
+            return -ENOTDIR;
+        }
+        int empty = dir_is_empty(&child_inode);
+        if (empty < 0)
+        {
+            return empty; // Error checking
+        }
+        if (empty == 0)
+        {
+            return -ENOTEMPTY;
+        }
     }
 
-    // Add entry to parent directory
-    int rv = dir_add_entry(&parent_inode, leaf, file_inum);
+    // Remove entry from parent directory
+    int rv = dir_remove_entry(parent_inum, &parent_inode, leaf->name, leaf->len);
     if (rv < 0)
     {
-        free_block(file_inum);
         return rv;
     }
 
@@ -741,935 +3069,1625 @@ int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     // Write parent inode back
     if (write_inode(parent_inum, &parent_inode) < 0)
     {
-        // Note: file inode is already allocated, we'll leave it orphaned
         return -EIO;
     }
 
-    return 0;
+    return child_inum;
 }
 
-/* mkdir - create a directory with the given mode.
- *
- * WARNING: unlike fs_create, @mode only has the permission bits. You
- * have to OR it with S_IFDIR before setting the inode 'mode' field.
- *
- * success - return 0
- * Errors - path resolution, EEXIST
- * Conditions for EEXIST are the same as for create.
+/* unlink - delete a file
+ *  success - return 0
+ *  errors - path resolution, ENOENT, EISDIR
  */
-int fs_mkdir(const char *path, mode_t mode)
+int fs_unlink(const char *path)
 {
-    char *tmp = strdup(path);
-    if (!tmp)
-        return -ENOMEM;
+    // Get parent inode; 'leaf' is the last component of 'path'
+    struct name_view leaf;
+    int parent_inum = path_lookup_rw(path, &leaf);
 
-    /* parse path */
-    char *tokens[MAX_PATH_LEN];
-    int count = parse(tmp, tokens);
-
-    if (count < 1)
+    if (parent_inum < 0)
     {
-        free(tmp);
-        return -EINVAL;
+        return parent_inum;
     }
 
-    char leaf[MAX_NAME_LEN + 1];
-    strncpy(leaf, tokens[count - 1], MAX_NAME_LEN);
-    leaf[MAX_NAME_LEN] = '\0';
+    inode_lock(parent_inum);
+    int child_inum = dir_unlink(parent_inum, &leaf, 0);
+    inode_unlock(parent_inum);
+    if (child_inum < 0)
+        return child_inum;
 
-    // Get parent inode
-    int parent_inum;
-    if (count == 1)
-    {
-        // Directory in root
-        parent_inum = ROOT_INUM;
-    }
-    else
-    {
-        parent_inum = translate(count - 1, tokens);
-    }
+    // Free the inode and its data blocks, unless a snapshot has them
+    inode_put(child_inum);
+    resv_release(child_inum);
+    return 0;
+}
 
-    free(tmp); // Done with tokens
+/* rmdir - remove a directory
+ *  success - return 0
+ *  Errors - path resolution, ENOENT, ENOTDIR, ENOTEMPTY
+ */
+int fs_rmdir(const char *path)
+{
+    // rmdir /.snapshots/NAME removes a snapshot
+    struct name_view snap;
+    if (snap_name(path, &snap))
+        return snap_delete(snap.name, snap.len);
+
+    // Get parent inode; 'leaf' is the last component of 'path'
+    struct name_view leaf;
+    int parent_inum = path_lookup_rw(path, &leaf);
 
     if (parent_inum < 0)
     {
         return parent_inum;
     }
 
-    // Read parent inode
-    struct fs_inode parent_inode;
-    if (read_inode(parent_inum, &parent_inode) < 0)
-    {
-        return -EIO;
-    }
-
-    // Must be a directory
-    if (!S_ISDIR(parent_inode.mode))
-    {
-        return -ENOTDIR;
-    }
+    inode_lock(parent_inum);
+    int child_inum = dir_unlink(parent_inum, &leaf, 1);
+    inode_unlock(parent_inum);
+    if (child_inum < 0)
+        return child_inum;
 
-    // Check if directory already exists
-    int exists = dir_find_entry(&parent_inode, leaf);
-    if (exists >= 0)
-    {
-        return -EEXIST; // Directory already exists
-    }
-    else if (exists != -ENOENT)
-    {
-        return exists; // Some other error
-    }
+    // Free the inode and its blocks, unless a snapshot has them
+    inode_put(child_inum);
+    return 0;
+}
 
-    // Allocate inode for the new directory
-    int dir_inum = find_free_block();
-    if (dir_inum < 0)
+/**
+ * rename's work: move entry 'src_leaf' of directory 'src_parent_inum'
+ * to 'dst_leaf' in 'dst_parent_inum', which may be the same directory.
+ * Called with both directories' locks held. An inode the destination
+ * name used to have is left in *replaced (else a negative number) for
+ * the caller to release once it has dropped the locks.
+ *
+ * Returns 0, or negative error
+ */
+static int dir_rename(int src_parent_inum, const struct name_view *src_leaf,
+                      int dst_parent_inum, const struct name_view *dst_leaf, int *replaced)
+{
+    int rv;
+    *replaced = -ENOENT;
+
+    // Read the parents' inodes. A rename within one directory works on
+    // a single copy, so both updates land in the same inode.
+    struct fs_inode src_parent, dst_parent_copy;
+    struct fs_inode *dst_parent = &src_parent;
+    if (read_inode(src_parent_inum, &src_parent) < 0)
+        return -EIO;
+    if (dst_parent_inum != src_parent_inum)
     {
-        return dir_inum;
+        dst_parent = &dst_parent_copy;
+        if (read_inode(dst_parent_inum, dst_parent) < 0)
+            return -EIO;
     }
+    if (!S_ISDIR(src_parent.mode) || !S_ISDIR(dst_parent->mode))
+        return -ENOTDIR;
 
-    // Initialize directory inode
-    struct fs_inode dir_inode;
-    memset(&dir_inode, 0, sizeof(dir_inode));
+    int src_inum = dir_find_entry(&src_parent, src_leaf->name, src_leaf->len);
+    if (src_inum < 0)
+        return src_inum;
 
-    struct fuse_context *ctx = fuse_get_context();
-    dir_inode.uid = ctx->uid;
-    dir_inode.gid = ctx->gid;
-    dir_inode.mode = (mode & 0777) | S_IFDIR; // Add directory flag
-    dir_inode.size = BLOCK_SIZE;              // Directory has one block initially
-    dir_inode.ctime = dir_inode.mtime = time(NULL);
+    struct fs_inode src_inode;
+    if (read_inode(src_inum, &src_inode) < 0)
+        return -EIO;
 
-    // Write directory inode
-    if (write_inode(dir_inum, &dir_inode) < 0)
+    // Check what we'd be replacing, if anything
+    struct fs_inode dst_inode;
+    int dst_inum = dir_find_entry(dst_parent, dst_leaf->name, dst_leaf->len);
+    if (dst_inum == src_inum)
+        return 0; // same file: nothing to do
+    if (dst_inum >= 0)
     {
-        free_block(dir_inum);
-        return -EIO;
+        if (read_inode(dst_inum, &dst_inode) < 0)
+            return -EIO;
+        if (S_ISDIR(dst_inode.mode) && !S_ISDIR(src_inode.mode))
+            return -EISDIR;
+        if (!S_ISDIR(dst_inode.mode) && S_ISDIR(src_inode.mode))
+            return -ENOTDIR;
+        if (S_ISDIR(dst_inode.mode))
+        {
+            rv = dir_is_empty(&dst_inode);
+            if (rv < 0)
+                return rv;
+            if (rv == 0)
+                return -ENOTEMPTY;
+        }
     }
+    else if (dst_inum != -ENOENT)
+        return dst_inum;
 
-    // Add entry to parent directory
-    int rv = dir_add_entry(&parent_inode, leaf, dir_inum);
+    // Point the destination name at the source, then drop the source
+    // name; a crash in between leaves two names rather than none.
+    if (dst_inum >= 0)
+        rv = dir_set_entry(dst_parent_inum, dst_parent, dst_leaf->name, dst_leaf->len,
+                           dst_leaf->name, dst_leaf->len, src_inum);
+    else if (dst_parent == &src_parent)
+        rv = dir_set_entry(src_parent_inum, &src_parent, src_leaf->name, src_leaf->len,
+                           dst_leaf->name, dst_leaf->len, src_inum);
+    else
+        rv = dir_insert(dst_parent_inum, dst_parent, dst_leaf->name, dst_leaf->len, src_inum, 0);
     if (rv < 0)
-    {
-        free_block(dir_inum);
         return rv;
-    }
-
-    // Update parent timestamps
-    parent_inode.mtime = parent_inode.ctime = time(NULL);
 
-    // Write parent inode back
-    if (write_inode(parent_inum, &parent_inode) < 0)
+    if (dst_inum >= 0 || dst_parent != &src_parent)
     {
-        // Note: directory inode is already allocated, we'll leave it orphaned
+        rv = dir_remove_entry(src_parent_inum, &src_parent, src_leaf->name, src_leaf->len);
+        if (rv < 0)
+            return rv;
+    }
+
+    // Update parent mtimes
+    src_parent.mtime = time(NULL);
+    src_parent.ctime = src_parent.mtime;
+    if (write_inode(src_parent_inum, &src_parent) < 0)
         return -EIO;
+    if (dst_parent != &src_parent)
+    {
+        dst_parent->mtime = dst_parent->ctime = src_parent.mtime;
+        if (write_inode(dst_parent_inum, dst_parent) < 0)
+            return -EIO;
     }
 
+    *replaced = dst_inum;
     return 0;
 }
 
-/* unlink - delete a file
- *  success - return 0
- *  errors - path resolution, ENOENT, EISDIR
+/* rename - rename or move a file or directory
+ * success - return 0
+ * Errors - path resolution, ENOENT, EINVAL, EISDIR, ENOTDIR, ENOTEMPTY
+ *
+ * Follows 'man 2 rename': the source can move to any directory, and
+ * an existing destination is replaced - a file by a file, or an empty
+ * directory by a directory.
+ * EINVAL - source is the root, or destination is inside the source
+ * EISDIR - destination is a directory, source isn't
+ * ENOTDIR - source is a directory, destination isn't
+ * ENOTEMPTY - destination is a non-empty directory
+ *
+ * Only directory entries move; the file's inode and data are untouched.
  */
-int fs_unlink(const char *path)
+int fs_rename(const char *src_path, const char *dst_path)
 {
-    char *tmp = strdup(path);
-    if (!tmp)
-        return -ENOMEM;
-
-    char *tokens[MAX_PATH_LEN];
-    int count = parse(tmp, tokens);
-
-    if (count < 1)
+    if (is_stats_file(src_path) || is_stats_file(dst_path))
+        return -EACCES;
+
+    // A directory can't be moved underneath itself. Every directory has
+    // exactly one path, so it's enough to compare path prefixes.
+    const char *sp = src_path, *dp = dst_path;
+    struct name_view sv, dv;
+    while (path_next(&sp, &sv))
     {
-        free(tmp);
-        return -EINVAL;
+        if (!path_next(&dp, &dv) || sv.len != dv.len || memcmp(sv.name, dv.name, sv.len) != 0)
+            break;
     }
+    if (sv.len == 0 && path_next(&dp, &dv))
+        return -EINVAL;
 
-    char leaf[MAX_NAME_LEN + 1];
-    strncpy(leaf, tokens[count - 1], MAX_NAME_LEN);
-    leaf[MAX_NAME_LEN] = '\0';
+    // Look up both parents; the basenames are views into the paths
+    struct name_view src_leaf, dst_leaf;
+    int src_parent_inum = path_lookup_rw(src_path, &src_leaf);
+    if (src_parent_inum < 0)
+        return src_parent_inum;
+    int dst_parent_inum = path_lookup_rw(dst_path, &dst_leaf);
+    if (dst_parent_inum < 0)
+        return dst_parent_inum;
+
+    int replaced;
+    inode_lock2(src_parent_inum, dst_parent_inum);
+    int rv = dir_rename(src_parent_inum, &src_leaf, dst_parent_inum, &dst_leaf, &replaced);
+    inode_unlock2(src_parent_inum, dst_parent_inum);
+    if (rv < 0)
+        return rv;
 
-    // Get parent inode
-    int parent_inum;
-    if (count == 1)
+    // Release whatever was replaced
+    if (replaced >= 0)
     {
-        // File in root directory
-        parent_inum = ROOT_INUM;
+        inode_put(replaced);
+        resv_release(replaced);
     }
+    return 0;
+}
+
+/* chmod - change file permissions
+ * utime - change access and modification times
+ *         (for definition of 'struct utimebuf', see 'man utime')
+ *
+ * success - return 0
+ * Errors - path resolution, ENOENT.
+ */
+int fs_chmod(const char *path, mode_t mode)
+{
+    int inum = path_lookup_rw(path, NULL);
+    if (inum < 0)
+        return inum;
+
+    struct fs_inode inode;
+    int rv = 0;
+    inode_lock(inum);
+    if (read_inode(inum, &inode) < 0)
+        rv = -EIO;
     else
     {
-        parent_inum = translate(count - 1, tokens);
+        /* Preserve file type bits, update permission bits.
+           S_IFMT masks the file type; ~S_IFMT masks the permission bits. */
+        inode.mode = (inode.mode & S_IFMT) | (mode & ~S_IFMT);
+        inode.ctime = time(NULL); // Update ctime when changing permissions
+
+        if (write_inode(inum, &inode) < 0)
+            rv = -EIO;
     }
+    inode_unlock(inum);
+    return rv;
+}
 
-    free(tmp); // Done with tokens
+int fs_utime(const char *path, struct utimbuf *ut)
+{
+    // fprintf(stderr, "fs_utime: Setting times for %s\n", path);
 
-    if (parent_inum < 0)
+    // Get the file/dir inode
+    int inum = path_lookup_rw(path, NULL);
+
+    if (inum < 0)
     {
-        return parent_inum;
+        // fprintf(stderr, "fs_utime: File not found, error %d\n", inum);
+        return inum; // Likely -ENOENT
     }
 
-    // Read parent inode
-    struct fs_inode parent_inode;
-    if (read_inode(parent_inum, &parent_inode) < 0)
+    // fprintf(stderr, "fs_utime: Found file at inode %d\n", inum);
+
+    // Read the inode
+    struct fs_inode inode;
+    inode_lock(inum);
+    if (read_inode(inum, &inode) < 0)
     {
+        // fprintf(stderr, "fs_utime: Failed to read inode\n");
+        inode_unlock(inum);
         return -EIO;
     }
 
-    // Must be a directory
-    if (!S_ISDIR(parent_inode.mode))
+    // Update times
+    if (ut)
     {
-        return -ENOTDIR;
+        // fprintf(stderr, "fs_utime: Setting mtime to %ld\n", ut->modtime);
+        inode.mtime = ut->modtime;
+        inode.ctime = inode.mtime; // Set ctime to mtime as per requirements
     }
-
-    // Find child inode
-    int child_inum = dir_find_entry(&parent_inode, leaf);
-    if (child_inum < 0)
+    else
     {
-        return child_inum; // Likely -ENOENT
+        // fprintf(stderr, "fs_utime: Setting times to current time\n");
+        inode.mtime = time(NULL);
+        inode.ctime = inode.mtime;
     }
 
-    // Read child inode
-    struct fs_inode child_inode;
-    if (read_inode(child_inum, &child_inode) < 0)
+    // Write inode back
+    int rv = write_inode(inum, &inode);
+    inode_unlock(inum);
+    if (rv < 0)
     {
+        // fprintf(stderr, "fs_utime: Failed to write inode\n");
         return -EIO;
     }
 
-    // Must be a file, not directory
-    if (S_ISDIR(child_inode.mode))
+    // fprintf(stderr, "fs_utime: Successfully updated times\n");
+    return 0;
+}
+
+/**
+ * Set the length of a file. Shrinking frees only the blocks past the
+ * new end (including any preallocated ones) and zeroes the rest of the
+ * new last block in place; growing just moves EOF, leaving a hole.
+ * Does not write the inode.
+ */
+static int file_resize(struct fs_inode *inode, off_t len)
+{
+    if (inode->flags & FS_INODE_INLINE)
     {
-        return -EISDIR;
+        if (len <= FS_INLINE_MAX)
+        {
+            if (len > inode->size)
+                memset(inode->data + inode->size, 0, len - inode->size);
+            inode->size = len;
+            return 0;
+        }
+        int rv = inode_uninline(inode);
+        if (rv < 0)
+            return rv;
     }
 
-    // Remove entry from parent directory
-    int rv = dir_remove_entry(&parent_inode, leaf);
-    if (rv < 0)
+    /* A packed tail either goes away entirely, or has to be a block of
+     * its own again so it can be cut or stop being the last block */
+    if ((inode->flags & FS_INODE_TAIL) && len != inode->size)
     {
-        return rv;
+        int idx = tail_index(inode);
+        if (len <= (off_t)idx * BLOCK_SIZE)
+        {
+            frag_free(inode->ptrs[idx], inode->tail_frag, tail_nfrags(inode));
+            inode->ptrs[idx] = 0;
+            inode->flags &= ~FS_INODE_TAIL;
+        }
+        else
+        {
+            int rv = tail_unpack(inode);
+            if (rv < 0)
+                return rv;
+        }
     }
 
-    // Free all data blocks
-    for (int i = 0; i < NDIRECT; i++)
+    if (len < inode->size)
     {
-        if (child_inode.ptrs[i] != 0)
+        for (int i = DIV_ROUND_UP(len, BLOCK_SIZE); i < NDIRECT; i++)
+        {
+            if (inode->ptrs[i] != 0)
+            {
+                free_block(inode->ptrs[i]);
+                inode->ptrs[i] = 0;
+            }
+            inode->unwritten &= ~(1u << i);
+        }
+
+        /* reads past EOF, and later extensions, must see zeros */
+        int last = len / BLOCK_SIZE;
+        if (len % BLOCK_SIZE != 0 && !block_is_hole(inode, last))
         {
-            free_block(child_inode.ptrs[i]);
+            char block_data[BLOCK_SIZE];
+            if (disk_read(block_data, inode->ptrs[last], 1) < 0)
+                return -EIO;
+            memset(block_data + len % BLOCK_SIZE, 0, BLOCK_SIZE - len % BLOCK_SIZE);
+            int rv = file_block_write(inode, last, block_data);
+            if (rv < 0)
+                return rv;
         }
     }
 
-    // Free inode block
-    free_block(child_inum);
+    inode->size = len;
+    if (len == 0)
+    {
+        /* the now-empty file goes back to inline storage */
+        inode->flags |= FS_INODE_INLINE;
+        inode->unwritten = 0;
+    }
+    return 0;
+}
 
-    // Update parent timestamps
-    parent_inode.mtime = parent_inode.ctime = time(NULL);
+/* truncate, with the file looked up and locked */
+static int file_truncate(int inum, off_t len)
+{
+    TRACE_START(t0);
 
-    // Write parent inode back
-    if (write_inode(parent_inum, &parent_inode) < 0)
-    {
+    // Read the inode
+    struct fs_inode inode;
+    if (read_inode(inum, &inode) < 0)
         return -EIO;
-    }
 
-    return 0;
+    // Make sure it's not a directory
+    if (S_ISDIR(inode.mode))
+        return -EISDIR;
+
+    int rv = file_resize(&inode, len);
+
+    // Update inode; blocks freed before a failure are gone either way
+    inode.mtime = time(NULL);
+    inode.ctime = inode.mtime;
+
+    // Write inode back
+    if (write_inode(inum, &inode) < 0)
+        rv = -EIO;
+    TRACE(TR_TRUNCATE, inum, -1, len, 0, rv, t0);
+    return rv;
 }
 
-/* rmdir - remove a directory
- *  success - return 0
- *  Errors - path resolution, ENOENT, ENOTDIR, ENOTEMPTY
+/* truncate - truncate or extend file to exactly 'len' bytes
+ * success - return 0
+ * Errors - path resolution, ENOENT, EISDIR, EINVAL, EFBIG
+ *    return EINVAL if len < 0, EFBIG if len is past the largest
+ *    possible file.
  */
-int fs_rmdir(const char *path)
+int fs_truncate(const char *path, off_t len)
 {
-    char *tmp = strdup(path);
-    if (!tmp)
-        return -ENOMEM;
+    if (is_stats_file(path))
+        return -EACCES;
 
-    char *tokens[MAX_PATH_LEN];
-    int count = parse(tmp, tokens);
-
-    if (count < 1)
-    {
-        free(tmp);
+    if (len < 0)
         return -EINVAL;
-    }
+    if (len > (off_t)NDIRECT * BLOCK_SIZE)
+        return -EFBIG;
 
-    char leaf[MAX_NAME_LEN + 1];
-    strncpy(leaf, tokens[count - 1], MAX_NAME_LEN);
-    leaf[MAX_NAME_LEN] = '\0';
+    // Look up the file
+    int inum = path_lookup_rw(path, NULL);
 
-    // Get parent inode
-    int parent_inum;
-    if (count == 1)
-    {
-        // Directory in root
-        parent_inum = ROOT_INUM;
-    }
-    else
-    {
-        parent_inum = translate(count - 1, tokens);
-    }
+    if (inum < 0)
+        return inum; // Likely -ENOENT
 
-    free(tmp); // Done with tokens
+    inode_lock(inum);
+    int rv = file_truncate(inum, len);
+    inode_unlock(inum);
+    return rv;
+}
 
-    if (parent_inum < 0)
+/* open - permission and existence checks happen in the individual
+ * operations, so the only things to do here are to make reads of the
+ * statistics file bypass the page cache and always see fresh numbers,
+ * to refuse to open snapshots for writing, and to count the handle
+ * (see fs_release).
+ */
+int fs_open(const char *path, struct fuse_file_info *fi)
+{
+    if (is_stats_file(path) && fi != NULL)
     {
-        return parent_inum;
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+        fi->direct_io = 1;
     }
-
-    // Read parent inode
-    struct fs_inode parent_inode;
-    if (read_inode(parent_inum, &parent_inode) < 0)
+    if (snap_path(path) && fi != NULL && (fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EROFS;
+    if (fi != NULL)
     {
-        return -EIO;
+        int inum = path_lookup(path, NULL);
+        if (inum >= 0)
+            open_get(inum, fi->flags);
     }
+    return 0;
+}
 
-    // Must be a directory
-    if (!S_ISDIR(parent_inode.mode))
+/* read - read data from an open file.
+ * success: should return exactly the number of bytes requested, except:
+ *   - if offset >= file len, return 0
+ *   - if offset+len > file len, return #bytes from offset to end
+ *   - on error, return <0
+ * Errors - path resolution, ENOENT, EISDIR
+ */
+int fs_read(const char *path, char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
+{
+    if (is_stats_file(path))
     {
-        return -ENOTDIR;
-    }
+        size_t text_len;
+        char *text = stats_render(&text_len);
+        if (text == NULL)
+            return -ENOMEM;
 
-    // Find child inode
-    int child_inum = dir_find_entry(&parent_inode, leaf);
-    if (child_inum < 0)
-    {
-        return child_inum; // Likely -ENOENT
+        size_t n = 0;
+        if (offset < (off_t)text_len)
+        {
+            n = text_len - offset < len ? text_len - offset : len;
+            memcpy(buf, text + offset, n);
+        }
+        free(text);
+        return n;
     }
 
-    // Read child inode
-    struct fs_inode child_inode;
-    if (read_inode(child_inum, &child_inode) < 0)
-    {
+    // Get file inode
+    int inum = path_lookup(path, NULL);
+
+    if (inum < 0)
+        return inum;
+
+    struct fs_inode inode;
+    if (read_inode(inum, &inode) < 0)
         return -EIO;
-    }
 
-    // Must be a directory
-    if (!S_ISDIR(child_inode.mode))
-    {
-        return -ENOTDIR;
-    }
+    // If directory, return error
+    if (S_ISDIR(inode.mode))
+        return -EISDIR;
 
-    // Check if directory is empty
-    int empty = dir_is_empty(&child_inode);
-    if (empty < 0)
-    {
-        return empty; // Error checking
-    }
-    if (empty == 0)
-    {
-        return -ENOTEMPTY;
-    }
+    // Handle offset past end of file
+    if (offset >= inode.size)
+        return 0;
 
-    // Remove entry from parent directory
-    int rv = dir_remove_entry(&parent_inode, leaf);
-    if (rv < 0)
+    // Calculate how many bytes to read (never more than file size)
+    size_t bytes_available = inode.size - offset;
+    size_t bytes_to_read = (bytes_available < len) ? bytes_available : len;
+
+    // Inline files are served straight out of the inode
+    if (inode.flags & FS_INODE_INLINE)
     {
-        return rv;
+        memcpy(buf, inode.data + offset, bytes_to_read);
+        return bytes_to_read;
     }
 
-    // Free all data blocks
-    for (int i = 0; i < NDIRECT; i++)
+    // Read data block by block
+    size_t bytes_read = 0;
+    int block_idx = offset / BLOCK_SIZE;
+    int block_offset = offset % BLOCK_SIZE;
+
+    while (bytes_read < bytes_to_read)
     {
-        if (child_inode.ptrs[i] != 0)
+        if (block_idx >= NDIRECT)
+            break;
+
+        size_t block_bytes = BLOCK_SIZE - block_offset;
+        size_t to_copy = (bytes_to_read - bytes_read < block_bytes) ? (bytes_to_read - bytes_read) : block_bytes;
+
+        // Holes read back as zeros, without any I/O
+        if (block_is_hole(&inode, block_idx))
         {
-            free_block(child_inode.ptrs[i]);
+            memset(buf + bytes_read, 0, to_copy);
+            bytes_read += to_copy;
+            block_idx++;
+            block_offset = 0;
+            continue;
         }
-    }
 
-    // Free inode block
-    free_block(child_inum);
+        char block_buf[BLOCK_SIZE];
+        if (disk_read(block_buf, inode.ptrs[block_idx], 1) < 0)
+            return -EIO;
 
-    // Update parent timestamps
-    parent_inode.mtime = parent_inode.ctime = time(NULL);
+        // A packed tail starts part way into its shared block
+        int base = 0;
+        if ((inode.flags & FS_INODE_TAIL) && block_idx == tail_index(&inode))
+            base = inode.tail_frag * FS_FRAG_SIZE;
 
-    // Write parent inode back
-    if (write_inode(parent_inum, &parent_inode) < 0)
-    {
-        return -EIO;
+        memcpy(buf + bytes_read, block_buf + base + block_offset, to_copy);
+
+        bytes_read += to_copy;
+        block_idx++;
+        block_offset = 0; // Only first block has offset
     }
 
-    return 0;
+    return bytes_read;
+}
+
+/* The parts of an inode that a data write can change, apart from the
+ * times. If none of them did, the inode needn't be written now (see
+ * lazytime_set).
+ */
+struct inode_shape
+{
+    int32_t size;
+    uint32_t flags, unwritten;
+    uint32_t ptrs[NDIRECT];
+};
+
+static void inode_shape(const struct fs_inode *inode, struct inode_shape *shape)
+{
+    shape->size = inode->size;
+    shape->flags = inode->flags;
+    shape->unwritten = inode->unwritten;
+    memcpy(shape->ptrs, inode->ptrs, sizeof(shape->ptrs));
+}
+
+static int inode_reshaped(const struct fs_inode *inode, const struct inode_shape *old)
+{
+    struct inode_shape now;
+    inode_shape(inode, &now);
+    return memcmp(&now, old, sizeof(now)) != 0;
 }
 
-/* rename - rename a file or directory
- * success - return 0
- * Errors - path resolution, ENOENT, EINVAL, EEXIST
- *
- * ENOENT - source does not exist
- * EEXIST - destination already exists
- * EINVAL - source and destination are not in the same directory
+/**
+ * Get a file ready to have bytes [offset, end_pos) written through its
+ * block pointers: move inline data and any packed tail out to blocks
+ * of their own, then allocate (zeroed) blocks for any holes in the
+ * range, from file 'inum''s reservation window. Holes elsewhere in the
+ * file are left alone. The caller writes the inode back.
  *
- * Note that this is a simplified version of the UNIX rename
- * functionality - see 'man 2 rename' for full semantics. In
- * particular, the full version can move across directories, replace a
- * destination file, and replace an empty directory with a full one.
+ * Returns 0 on success, negative error on failure
  */
-int fs_rename(const char *src_path, const char *dst_path)
+static int file_map_for_write(int inum, struct fs_inode *inode, off_t offset, size_t end_pos)
 {
-    char *src_copy = strdup(src_path);
-    char *dst_copy = strdup(dst_path);
-    if (!src_copy || !dst_copy)
-    {
-        free(src_copy);
-        free(dst_copy);
-        return -ENOMEM;
-    }
+    int needed_blocks = (end_pos + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-    char *src_tokens[MAX_PATH_LEN];
-    char *dst_tokens[MAX_PATH_LEN];
-    int src_count = parse(src_copy, src_tokens);
-    int dst_count = parse(dst_copy, dst_tokens);
-    if (src_count < 1 || dst_count < 1 || src_count != dst_count)
-    {
-        free(src_copy);
-        free(dst_copy);
-        return -EINVAL;
-    }
-    // Check that the parent tokens match.
-    for (int i = 0; i < src_count - 1; i++)
+    if (needed_blocks > NDIRECT)
+        return -ENOSPC;
+
+    /* Growing past the inline limit - convert to block-mapped form */
+    if (inode->flags & FS_INODE_INLINE)
     {
-        if (strcmp(src_tokens[i], dst_tokens[i]) != 0)
-        {
-            free(src_copy);
-            free(dst_copy);
-            return -EINVAL;
-        }
+        int rv = inode_uninline(inode);
+        if (rv < 0)
+            return rv;
     }
 
-    // Save only the last (basename) tokens.
-    char src_basename[MAX_NAME_LEN + 1];
-    char dst_basename[MAX_NAME_LEN + 1];
-    strncpy(src_basename, src_tokens[src_count - 1], MAX_NAME_LEN);
-    src_basename[MAX_NAME_LEN] = '\0';
-    strncpy(dst_basename, dst_tokens[dst_count - 1], MAX_NAME_LEN);
-    dst_basename[MAX_NAME_LEN] = '\0';
+    /* The tail gets packed again on release */
+    int rv = tail_unpack(inode);
+    if (rv < 0)
+        return rv;
 
-    // We only need the parent's tokens (all but the last).
-    int parent_inum = ROOT_INUM;
-    if (src_count > 1)
+    /* Allocate blocks as needed */
+    for (int i = offset / BLOCK_SIZE; i < needed_blocks; i++)
     {
-        parent_inum = translate(src_count - 1, src_tokens);
-        free(src_copy);
-        free(dst_copy);
-        if (parent_inum < 0)
+        if (inode->ptrs[i] == 0)
         {
+            int block = resv_alloc_block(inum, i);
+            TRACE(TR_ALLOC, inum, block, (off_t)i * BLOCK_SIZE, BLOCK_SIZE, block < 0 ? block : 0, 0);
+            if (block < 0)
+                return block;
 
-            return parent_inum;
+            /* Initialize new block */
+            char zeros[BLOCK_SIZE] = {0};
+            if (disk_write(zeros, block, 1) < 0)
+            {
+                free_block(block);
+                return -EIO;
+            }
+
+            inode->ptrs[i] = block;
+        }
+        else if (inode->unwritten & (1u << i))
+        {
+            /* Preallocated - zero whatever part of it we won't write */
+            off_t block_start = (off_t)i * BLOCK_SIZE;
+            if (offset > block_start || (off_t)end_pos < block_start + BLOCK_SIZE)
+            {
+                char zeros[BLOCK_SIZE] = {0};
+                rv = file_block_write(inode, i, zeros);
+                if (rv < 0)
+                    return rv;
+            }
+            inode->unwritten &= ~(1u << i);
         }
     }
 
-    // Read the parent's inode.
-    struct fs_inode parent_inode;
-    if (read_inode(parent_inum, &parent_inode) < 0)
+    return 0;
+}
+
+/* write, with the file looked up and locked */
+static int file_write(int inum, const char *buf, size_t len, off_t offset)
+{
+    TRACE_START(t0);
+
+    struct fs_inode inode;
+    if (read_inode(inum, &inode) < 0)
         return -EIO;
-    if (!S_ISDIR(parent_inode.mode))
-        return -ENOTDIR;
 
-    // Find the source entry first to make sure it exists
-    int src_inum = dir_find_entry(&parent_inode, src_basename);
-    if (src_inum < 0)
-        return -ENOENT; // Source doesn't exist
+    if (S_ISDIR(inode.mode))
+        return -EISDIR;
 
-    // Check if destination already exists
-    int dst_inum = dir_find_entry(&parent_inode, dst_basename);
-    if (dst_inum >= 0)
-        return -EEXIST; // Destination already exists
+    if (len == 0)
+        return 0;
 
-    int entry_found = 0;
-    // Iterate through parent's directory blocks.
-    for (int i = 0; i < NDIRECT; i++)
+    /* Calculate end position */
+    size_t end_pos = offset + len;
+
+    /* Small files stay in the inode: one inode write and we're done */
+    if ((inode.flags & FS_INODE_INLINE) && end_pos <= FS_INLINE_MAX)
     {
-        if (parent_inode.ptrs[i] == 0)
-            continue;
-        struct fs_dirent dirents[MAX_DIR_ENTRIES];
-        if (block_read(dirents, parent_inode.ptrs[i], 1) < 0)
+        if (offset > inode.size)
+            memset(inode.data + inode.size, 0, offset - inode.size);
+        memcpy(inode.data + offset, buf, len);
+        if (end_pos > inode.size)
+            inode.size = end_pos;
+        inode.mtime = time(NULL);
+        inode.ctime = inode.mtime;
+        if (write_inode(inum, &inode) < 0)
             return -EIO;
+        TRACE(TR_WRITE, inum, -1, offset, len, len, t0);
+        return len;
+    }
 
-        // Look for the source entry to rename it
-        for (int j = 0; j < MAX_DIR_ENTRIES; j++)
-        {
-            if (dirents[j].valid && strcmp(dirents[j].name, src_basename) == 0)
-            {
-                // Update name to dst_basename.
-                strncpy(dirents[j].name, dst_basename, MAX_NAME_LEN);
-                dirents[j].name[MAX_NAME_LEN] = '\0';
-                if (block_write(dirents, parent_inode.ptrs[i], 1) < 0)
-                    return -EIO;
-                entry_found = 1;
-                break;
-            }
-        }
-        if (entry_found)
-            break;
+    struct inode_shape old;
+    inode_shape(&inode, &old);
+
+    /* In log mode, blocks the file already had are written to the log
+     * rather than in place (see log_append) */
+    int log = fs_log_writes && !(old.flags & FS_INODE_INLINE);
+    int freed[NDIRECT], nfreed = 0;
+
+    int rv = file_map_for_write(inum, &inode, offset, end_pos);
+    if (rv < 0)
+    {
+        TRACE(TR_WRITE, inum, -1, offset, len, rv, t0);
+        return rv;
     }
 
-    // Update parent mtime
-    if (entry_found)
+    /* Actually write the data */
+    size_t written = 0;
+    int curr_block = offset / BLOCK_SIZE;
+    int block_offset = offset % BLOCK_SIZE;
+
+    while (written < len)
     {
-        parent_inode.mtime = time(NULL);
-        parent_inode.ctime = parent_inode.mtime;
-        if (write_inode(parent_inum, &parent_inode) < 0)
+        TRACE_START(tb);
+        char block_data[BLOCK_SIZE];
+        if (disk_read(block_data, inode.ptrs[curr_block], 1) < 0)
             return -EIO;
-    }
 
-    return entry_found ? 0 : -ENOENT;
-}
+        /* Calculate bytes to write in this block */
+        int bytes_this_block = BLOCK_SIZE - block_offset;
+        if (bytes_this_block > (len - written))
+            bytes_this_block = len - written;
 
-/* chmod - change file permissions
- * utime - change access and modification times
- *         (for definition of 'struct utimebuf', see 'man utime')
- *
- * success - return 0
- * Errors - path resolution, ENOENT.
- */
-int fs_chmod(const char *path, mode_t mode)
-{
-    char *dup_path = strdup(path);
-    if (!dup_path)
-        return -ENOMEM;
-    char *tokens[MAX_PATH_LEN];
-    int token_count = parse(dup_path, tokens);
-    int inum = translate(token_count, tokens);
-    free(dup_path);
-    if (inum < 0)
-        return inum;
+        /* Copy data to block buffer */
+        memcpy(block_data + block_offset, buf + written, bytes_this_block);
 
-    struct fs_inode inode;
-    if (read_inode(inum, &inode) < 0)
-        return -EIO;
+        /* Write block back */
+        if (log && old.ptrs[curr_block] != 0 && old.ptrs[curr_block] == inode.ptrs[curr_block] &&
+            !(old.unwritten & (1u << curr_block)))
+        {
+            int blk = log_append(inum, curr_block, block_data);
+            if (blk < 0)
+                return blk;
+            freed[nfreed++] = inode.ptrs[curr_block];
+            inode.ptrs[curr_block] = blk;
+        }
+        else if ((rv = file_block_write(&inode, curr_block, block_data)) < 0)
+            return rv;
+        TRACE(TR_WRITE_BLOCK, inum, inode.ptrs[curr_block], block_offset, bytes_this_block, 0, tb);
+
+        written += bytes_this_block;
+        curr_block++;
+        block_offset = 0;
+    }
 
-    /* Preserve file type bits, update permission bits.
-       S_IFMT masks the file type; ~S_IFMT masks the permission bits. */
-    inode.mode = (inode.mode & S_IFMT) | (mode & ~S_IFMT);
-    inode.ctime = time(NULL); // Update ctime when changing permissions
+    /* Update file size if needed */
+    if (end_pos > inode.size)
+        inode.size = end_pos;
 
-    if (write_inode(inum, &inode) < 0)
+    /* Update times */
+    inode.mtime = time(NULL);
+    inode.ctime = inode.mtime;
+
+    /* Write inode back, unless only the times changed */
+    if (inode_reshaped(&inode, &old))
+        rv = write_inode(inum, &inode);
+    else
+        rv = lazytime_set(inum, &inode);
+    if (rv < 0)
         return -EIO;
 
-    return 0;
+    /* the overwritten blocks can go now the inode doesn't use them */
+    for (int i = 0; i < nfreed; i++)
+        free_block(freed[i]);
+
+    TRACE(TR_WRITE, inum, -1, offset, len, written, t0);
+    return written;
 }
 
-int fs_utime(const char *path, struct utimbuf *ut)
+/* write - write data to a file
+ * success - return number of bytes written. (this will be the same as
+ *           the number requested, or else it's an error)
+ * Errors - path resolution, ENOENT, EISDIR
+ *  Writing past the end of the file leaves a hole: the blocks in
+ *  between aren't allocated, and read back as zeros.
+ */
+int fs_write(const char *path, const char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
 {
-    // fprintf(stderr, "fs_utime: Setting times for %s\n", path);
+    if (is_stats_file(path))
+        return -EACCES;
 
-    // Parse the path
-    char *tmp = strdup(path);
-    if (!tmp)
-        return -ENOMEM;
+    int inum = path_lookup_rw(path, NULL);
 
-    char *tokens[MAX_PATH_LEN];
-    int count = parse(tmp, tokens);
+    if (inum < 0)
+        return inum;
 
-    // fprintf(stderr, "fs_utime: Path has %d components\n", count);
+    inode_lock(inum);
+    int rv = file_write(inum, buf, len, offset);
+    inode_unlock(inum);
+    return rv;
+}
 
-    // Get the file/dir inode
-    int inum = translate(count, tokens);
-    free(tmp);
+/* Can FUSE splice the blocks behind bytes [offset, offset + len) of a
+ * file straight from the image after read_buf has returned, with no
+ * locks held? Only if they can't be freed and reused first: not in log
+ * mode, where every overwrite and the cleaner move blocks, not while
+ * the file is open for writing, and not if a block is shared with a
+ * clone or snapshot, whose other owner may be left to change it.
+ */
+static int read_buf_stable(int inum, const struct fs_inode *inode, off_t offset, size_t len)
+{
+    if (fs_log_writes || open_writing(inum))
+        return 0;
+    int last = (offset + len - 1) / BLOCK_SIZE;
+    for (int i = offset / BLOCK_SIZE; i <= last && i < NDIRECT; i++)
+        if (!block_is_hole(inode, i) && block_shared(inode->ptrs[i]))
+            return 0;
+    return 1;
+}
 
-    if (inum < 0)
+/* read_buf - zero-copy version of read. Rather than copying file data
+ * into a buffer, return a vector of (image fd, offset) pieces so FUSE
+ * can splice it straight from the image file to /dev/fuse. Physically
+ * contiguous blocks are merged into a single piece. Inline data and
+ * holes go in malloc'ed buffers; FUSE frees them along with the vector.
+ * When the blocks might not stay put (see read_buf_stable) the data is
+ * read into memory instead, as fs_read does.
+ * Errors - same as read
+ */
+int fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t len, off_t offset, struct fuse_file_info *fi)
+{
+    if (is_stats_file(path))
     {
-        // fprintf(stderr, "fs_utime: File not found, error %d\n", inum);
-        return inum; // Likely -ENOENT
+        struct fuse_bufvec *bv = malloc(sizeof(*bv));
+        if (!bv)
+            return -ENOMEM;
+        *bv = FUSE_BUFVEC_INIT(0);
+        *bufp = bv;
+
+        size_t text_len;
+        char *text = stats_render(&text_len);
+        if (text == NULL)
+            return -ENOMEM;
+
+        size_t n = 0;
+        if (offset < (off_t)text_len)
+        {
+            n = text_len - offset < len ? text_len - offset : len;
+            memmove(text, text + offset, n);
+        }
+        bv->buf[0].mem = text;
+        bv->buf[0].size = n;
+        return 0;
     }
 
-    // fprintf(stderr, "fs_utime: Found file at inode %d\n", inum);
+    int inum = path_lookup(path, NULL);
+
+    if (inum < 0)
+        return inum;
 
-    // Read the inode
     struct fs_inode inode;
     if (read_inode(inum, &inode) < 0)
-    {
-        // fprintf(stderr, "fs_utime: Failed to read inode\n");
         return -EIO;
-    }
 
-    // Update times
-    if (ut)
+    if (S_ISDIR(inode.mode))
+        return -EISDIR;
+
+    size_t bytes_to_read = 0;
+    if (offset < inode.size)
     {
-        // fprintf(stderr, "fs_utime: Setting mtime to %ld\n", ut->modtime);
-        inode.mtime = ut->modtime;
-        inode.ctime = inode.mtime; // Set ctime to mtime as per requirements
+        size_t bytes_available = inode.size - offset;
+        bytes_to_read = (bytes_available < len) ? bytes_available : len;
     }
-    else
+
+    // Worst case is one piece per block touched
+    int nblocks = DIV_ROUND_UP(offset % BLOCK_SIZE + bytes_to_read, BLOCK_SIZE);
+    struct fuse_bufvec *bv = malloc(sizeof(*bv) + nblocks * sizeof(struct fuse_buf));
+    if (!bv)
+        return -ENOMEM;
+    *bv = FUSE_BUFVEC_INIT(0);
+    *bufp = bv;
+
+    if (bytes_to_read == 0)
+        return 0;
+
+    if (inode.flags & FS_INODE_INLINE)
     {
-        // fprintf(stderr, "fs_utime: Setting times to current time\n");
-        inode.mtime = time(NULL);
-        inode.ctime = inode.mtime;
+        bv->buf[0].mem = malloc(bytes_to_read);
+        if (!bv->buf[0].mem)
+            return -ENOMEM;
+        memcpy(bv->buf[0].mem, inode.data + offset, bytes_to_read);
+        bv->buf[0].size = bytes_to_read;
+        return 0;
     }
 
-    // Write inode back
-    if (write_inode(inum, &inode) < 0)
+    if (!read_buf_stable(inum, &inode, offset, bytes_to_read))
     {
-        // fprintf(stderr, "fs_utime: Failed to write inode\n");
-        return -EIO;
+        bv->buf[0].mem = malloc(bytes_to_read);
+        if (!bv->buf[0].mem)
+            return -ENOMEM;
+        int n = fs_read(path, bv->buf[0].mem, bytes_to_read, offset, fi);
+        if (n < 0)
+            return n;
+        bv->buf[0].size = n;
+        return 0;
     }
 
-    // fprintf(stderr, "fs_utime: Successfully updated times\n");
-    return 0;
-}
-
-/* truncate - truncate file to exactly 'len' bytes
- * success - return 0
- * Errors - path resolution, ENOENT, EISDIR, EINVAL
- *    return EINVAL if len > 0.
- */
-int fs_truncate(const char *path, off_t len)
-{
-    // fprintf(stderr, "fs_truncate: Truncating file %s to length %ld\n", path, len);
+    bv->count = 0;
+    size_t bytes_read = 0;
+    int block_idx = offset / BLOCK_SIZE;
+    int block_offset = offset % BLOCK_SIZE;
 
-    if (len != 0)
+    while (bytes_read < bytes_to_read)
     {
-        // fprintf(stderr, "fs_truncate: Non-zero length not supported\n");
-        return -EINVAL;
-    }
+        if (block_idx >= NDIRECT)
+            break;
 
-    // Parse the path
-    char *tmp = strdup(path);
-    if (!tmp)
-        return -ENOMEM;
+        size_t block_bytes = BLOCK_SIZE - block_offset;
+        size_t to_copy = (bytes_to_read - bytes_read < block_bytes) ? (bytes_to_read - bytes_read) : block_bytes;
+        struct fuse_buf *prev = bv->count ? &bv->buf[bv->count - 1] : NULL;
 
-    char *tokens[MAX_PATH_LEN];
-    int count = parse(tmp, tokens);
+        /* Holes become zero-filled memory pieces, merged like the rest */
+        if (block_is_hole(&inode, block_idx))
+        {
+            struct fuse_buf *b = prev;
+            if (!b || (b->flags & FUSE_BUF_IS_FD))
+            {
+                b = &bv->buf[bv->count++];
+                *b = (struct fuse_buf){0};
+            }
+            size_t start = b->size;
+            char *mem = realloc(b->mem, start + to_copy);
+            if (!mem)
+                return -ENOMEM;
+            memset(mem + start, 0, to_copy);
+            b->mem = mem;
+            b->size = start + to_copy;
 
-    // fprintf(stderr, "fs_truncate: Path has %d components\n", count);
+            bytes_read += to_copy;
+            block_idx++;
+            block_offset = 0;
+            continue;
+        }
 
-    // Handle special case for root path
-    int inum;
-    if (count == 0)
-    {
-        // fprintf(stderr, "fs_truncate: Cannot truncate root directory\n");
-        free(tmp);
-        return -EISDIR;
-    }
+        int base = 0;
+        if ((inode.flags & FS_INODE_TAIL) && block_idx == tail_index(&inode))
+            base = inode.tail_frag * FS_FRAG_SIZE;
+        off_t pos = (off_t)inode.ptrs[block_idx] * BLOCK_SIZE + base + block_offset;
 
-    // Get the file inode
-    inum = translate(count, tokens);
-    free(tmp);
+        if (prev && (prev->flags & FUSE_BUF_IS_FD) && prev->pos + (off_t)prev->size == pos)
+        {
+            prev->size += to_copy;
+        }
+        else
+        {
+            struct fuse_buf *b = &bv->buf[bv->count++];
+            b->size = to_copy;
+            b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            b->mem = NULL;
+            b->fd = block_fd();
+            b->pos = pos;
+        }
 
-    if (inum < 0)
-    {
-        // fprintf(stderr, "fs_truncate: File not found, error %d\n", inum);
-        return inum; // Likely -ENOENT
+        bytes_read += to_copy;
+        block_idx++;
+        block_offset = 0;
     }
 
-    // fprintf(stderr, "fs_truncate: Found file at inode %d\n", inum);
+    if (bv->count == 0)
+        *bv = FUSE_BUFVEC_INIT(0);
+    for (int i = 0; i < (int)bv->count; i++)
+        if (bv->buf[i].flags & FUSE_BUF_IS_FD)
+            block_trace(BLKTRACE_READ, bv->buf[i].pos / BLOCK_SIZE,
+                        DIV_ROUND_UP(bv->buf[i].pos % BLOCK_SIZE + bv->buf[i].size, BLOCK_SIZE));
+    return 0;
+}
+
+/* copy a write out of the FUSE buffer and give it to file_write */
+static int write_buf_mem(int inum, struct fuse_bufvec *buf, size_t len, off_t offset)
+{
+    char *mem = malloc(len);
+    if (mem == NULL)
+        return -ENOMEM;
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+    dst.buf[0].mem = mem;
+    ssize_t n = fuse_buf_copy(&dst, buf, 0);
+    int rv = n < 0 ? (int)n : file_write(inum, mem, n, offset);
+    free(mem);
+    return rv;
+}
+
+/* does bytes [offset, end_pos) of a block-mapped file touch a block
+ * shared with a snapshot? */
+static int file_range_shared(const struct fs_inode *inode, off_t offset, size_t end_pos)
+{
+    int last = DIV_ROUND_UP(end_pos, BLOCK_SIZE);
+    for (int i = offset / BLOCK_SIZE; i < last && i < NDIRECT; i++)
+        if (inode->ptrs[i] != 0 && block_shared(inode->ptrs[i]))
+            return 1;
+    return 0;
+}
+
+/* write_buf, with the file looked up and locked */
+static int file_write_buf(int inum, struct fuse_bufvec *buf, size_t len, off_t offset)
+{
+    /* log writes go through memory anyway */
+    if (fs_log_writes)
+        return write_buf_mem(inum, buf, len, offset);
 
-    // Read the inode
     struct fs_inode inode;
     if (read_inode(inum, &inode) < 0)
-    {
-        // fprintf(stderr, "fs_truncate: Failed to read inode\n");
         return -EIO;
-    }
 
-    // Make sure it's not a directory
     if (S_ISDIR(inode.mode))
-    {
-        // fprintf(stderr, "fs_truncate: Cannot truncate directory\n");
         return -EISDIR;
-    }
 
-    // Free all data blocks
-    // fprintf(stderr, "fs_truncate: Freeing %d blocks\n", NDIRECT);
-    for (int i = 0; i < NDIRECT; i++)
+    if (len == 0)
+        return 0;
+
+    size_t end_pos = offset + len;
+    if (!(inode.flags & FS_INODE_INLINE) && file_range_shared(&inode, offset, end_pos))
+        return write_buf_mem(inum, buf, len, offset);
+    ssize_t n;
+    int in_inode = 0;
+    struct inode_shape old;
+    inode_shape(&inode, &old);
+
+    if ((inode.flags & FS_INODE_INLINE) && end_pos <= FS_INLINE_MAX)
+    {
+        if (offset > inode.size)
+            memset(inode.data + inode.size, 0, offset - inode.size);
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+        dst.buf[0].mem = inode.data + offset;
+        n = fuse_buf_copy(&dst, buf, 0);
+        if (n < 0)
+            return n;
+        if ((size_t)n != len)
+            return -EIO;
+        in_inode = 1;
+    }
+    else
     {
-        if (inode.ptrs[i] != 0)
+        int rv = file_map_for_write(inum, &inode, offset, end_pos);
+        if (rv < 0)
+            return rv;
+
+        size_t written = 0;
+        int curr_block = offset / BLOCK_SIZE;
+        int block_offset = offset % BLOCK_SIZE;
+
+        while (written < len)
         {
-            // fprintf(stderr, "fs_truncate: Freeing block %d\n", inode.ptrs[i]);
-            if (free_block(inode.ptrs[i]) < 0)
+            /* Extend the run over physically contiguous blocks */
+            size_t run = BLOCK_SIZE - block_offset;
+            int first = curr_block;
+            while (written + run < len && curr_block + 1 < NDIRECT &&
+                   inode.ptrs[curr_block + 1] == inode.ptrs[curr_block] + 1)
             {
-                // fprintf(stderr, "fs_truncate: Failed to free block %d\n", inode.ptrs[i]);
+                curr_block++;
+                run += BLOCK_SIZE;
             }
-            inode.ptrs[i] = 0;
+            if (run > len - written)
+                run = len - written;
+
+            struct fuse_bufvec dst = FUSE_BUFVEC_INIT(run);
+            dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            dst.buf[0].fd = block_fd();
+            dst.buf[0].pos = (off_t)inode.ptrs[first] * BLOCK_SIZE + block_offset;
+            block_trace(BLKTRACE_WRITE, inode.ptrs[first], curr_block - first + 1);
+            bcache_drop(inode.ptrs[first], curr_block - first + 1);
+            n = fuse_buf_copy(&dst, buf, 0);
+            if (n < 0)
+                return n;
+            if ((size_t)n != run)
+                return -EIO;
+
+            written += run;
+            curr_block++;
+            block_offset = 0;
         }
     }
 
-    // Update inode
-    inode.size = 0;
+    if (end_pos > inode.size)
+        inode.size = end_pos;
     inode.mtime = time(NULL);
     inode.ctime = inode.mtime;
 
-    // Write inode back
-    if (write_inode(inum, &inode) < 0)
-    {
-        // fprintf(stderr, "fs_truncate: Failed to write inode\n");
+    int rv;
+    if (in_inode || inode_reshaped(&inode, &old))
+        rv = write_inode(inum, &inode);
+    else
+        rv = lazytime_set(inum, &inode);
+    if (rv < 0)
         return -EIO;
-    }
 
-    // fprintf(stderr, "fs_truncate: Successfully truncated file\n");
-    return 0;
+    return len;
+}
+
+/* write_buf - zero-copy version of write. The data is copied by
+ * fuse_buf_copy straight from the FUSE buffer (which may itself be a
+ * pipe) into the image file, one run of contiguous blocks at a time,
+ * so partial blocks don't need a read-modify-write through memory.
+ * In log mode, or if the range has blocks shared with a snapshot,
+ * the data is copied out and written by file_write instead.
+ * Errors - same as write
+ */
+int fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+    size_t len = fuse_buf_size(buf);
+
+    if (is_stats_file(path))
+        return -EACCES;
+
+    int inum = path_lookup_rw(path, NULL);
+
+    if (inum < 0)
+        return inum;
+
+    inode_lock(inum);
+    int rv = file_write_buf(inum, buf, len, offset);
+    inode_unlock(inum);
+    return rv;
 }
 
-/* read - read data from an open file.
- * success: should return exactly the number of bytes requested, except:
- *   - if offset >= file len, return 0
- *   - if offset+len > file len, return #bytes from offset to end
- *   - on error, return <0
- * Errors - path resolution, ENOENT, EISDIR
+/* release - called once for each handle on a file as it is closed.
+ * We write out any timestamps left pending, and when the file's last
+ * handle goes (see open_get) give back the rest of its block
+ * reservation and pack its tail into a shared fragment block, so that
+ * a file being written in pieces isn't repacked on every write, nor
+ * while another handle is still writing it.
+ * FUSE ignores the return value.
  */
-int fs_read(const char *path, char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
+int fs_release(const char *path, struct fuse_file_info *fi)
 {
-    // Get file inode
-    char *dup_path = strdup(path);
-    if (!dup_path)
-        return -ENOMEM;
-
-    char *tokens[MAX_PATH_LEN];
-    int token_count = parse(dup_path, tokens);
-    int inum = translate(token_count, tokens);
-    free(dup_path);
+    int inum = path_lookup(path, NULL);
 
     if (inum < 0)
         return inum;
 
+    int last = (fi == NULL || open_put(inum, fi->flags) == 0);
+    inode_lock(inum);
+    int rv = lazytime_flush(inum);
+    inode_unlock(inum);
+    if (rv < 0)
+        return -EIO;
+    if (!last)
+        return 0;
+    resv_release(inum);
+
+    /* a file a snapshot can see isn't repacked */
     struct fs_inode inode;
+    inode_lock(inum);
     if (read_inode(inum, &inode) < 0)
-        return -EIO;
+        rv = -EIO;
+    else if (S_ISREG(inode.mode) && !snap_path(path) && !block_shared(inum))
+        rv = tail_pack(inum, &inode);
+    inode_unlock(inum);
+    return rv;
+}
 
-    // If directory, return error
-    if (S_ISDIR(inode.mode))
-        return -EISDIR;
+/* fsync - the data and the rest of the inode are written through
+ * already, so only timestamps can be pending (see lazytime_set).
+ * Errors - path resolution, ENOENT
+ */
+int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int inum = path_lookup(path, NULL);
 
-    // Handle offset past end of file
-    if (offset >= inode.size)
+    if (inum < 0)
+        return inum;
+    if (datasync)
         return 0;
+    inode_lock(inum);
+    int rv = lazytime_flush(inum);
+    inode_unlock(inum);
+    return rv;
+}
 
-    // Calculate how many bytes to read (never more than file size)
-    size_t bytes_available = inode.size - offset;
-    size_t bytes_to_read = (bytes_available < len) ? bytes_available : len;
-
-    // Read data block by block
-    size_t bytes_read = 0;
-    int block_idx = offset / BLOCK_SIZE;
-    int block_offset = offset % BLOCK_SIZE;
+/* statfs - get file system statistics
+ * see 'man 2 statfs' for description of 'struct statvfs'.
+ * Errors - none. Needs to work.
+ */
+int fs_statfs(const char *path, struct statvfs *st)
+{
+    /* Set block and fragment sizes */
+    st->f_bsize = BLOCK_SIZE;
+    st->f_frsize = BLOCK_SIZE;
+    st->f_blocks = superblock.disk_size;
+
+    /* blocks merely reserved for files being written are still free.
+     * log_lock keeps out the log cleaner, so that a move isn't
+     * caught half done. */
+    pthread_mutex_lock(&log_lock);
+    pthread_mutex_lock(&bitmap_lock);
+    if (bitmap_loaded)
+        st->f_bfree = fext_free_count() + resv_blocks;
+    else
+        st->f_bfree = superblock.free_blocks;
+    pthread_mutex_unlock(&bitmap_lock);
+    pthread_mutex_unlock(&log_lock);
+    st->f_bavail = st->f_bfree;
+    st->f_namemax = MAX_NAME_LEN;
 
-    while (bytes_read < bytes_to_read)
-    {
-        if (block_idx >= NDIRECT || inode.ptrs[block_idx] == 0)
-            break;
+    /* any free block can hold an inode */
+    st->f_files = superblock.disk_size;
+    st->f_ffree = st->f_bfree;
+    st->f_favail = st->f_bfree;
 
-        char block_buf[BLOCK_SIZE];
-        if (block_read(block_buf, inode.ptrs[block_idx], 1) < 0)
-            return -EIO;
+    /* Other fields can be set to 0 */
+    st->f_fsid = 0;
+    st->f_flag = 0;
 
-        size_t block_bytes = BLOCK_SIZE - block_offset;
-        size_t to_copy = (bytes_to_read - bytes_read < block_bytes) ? (bytes_to_read - bytes_read) : block_bytes;
+    return 0;
+}
 
-        memcpy(buf + bytes_read, block_buf + block_offset, to_copy);
+/**
+ * Make file 'inum', whose inode is 'dst', a clone of 'src': the same
+ * size and contents, sharing its data blocks (see inode_share_blocks).
+ * Whatever 'dst' had before is released. Does not write the inode.
+ *
+ * Returns 0, or negative error
+ */
+static int file_clone(int inum, struct fs_inode *dst, const struct fs_inode *src)
+{
+    int rv = ref_table_init();
+    if (rv < 0)
+        return rv;
 
-        bytes_read += to_copy;
-        block_idx++;
-        block_offset = 0; // Only first block has offset
-    }
+    struct fs_inode copy = *src;
+    rv = inode_share_blocks(&copy);
+    if (rv < 0)
+        return rv;
 
-    return bytes_read;
+    free_inode_blocks(dst);
+    resv_release(inum);
+    dst->size = copy.size;
+    dst->flags = copy.flags;
+    dst->tail_frag = copy.tail_frag;
+    dst->unwritten = copy.unwritten;
+    memcpy(dst->ptrs, copy.ptrs, sizeof(dst->ptrs)); // or the inline data
+    return 0;
 }
 
-/* write - write data to a file
- * success - return number of bytes written. (this will be the same as
- *           the number requested, or else it's an error)
- * Errors - path resolution, ENOENT, EISDIR
- *  return EINVAL if 'offset' is greater than current file length.
- *  (POSIX semantics support the creation of files with "holes" in them,
- *   but we don't)
+/* FS_IOC_CLONE: make 'path' a clone of arg->src. Not while the kernel
+ * may be caching the target's old size and pages (see fs_kernel_cache).
  */
-int fs_write(const char *path, const char *buf, size_t len, off_t offset, struct fuse_file_info *fi)
+static int fs_clone(const char *path, struct fs_clone_arg *arg)
 {
-    /* Debug info */
-    // fprintf(stderr, "fs_write: Writing %zu bytes to file %s at offset %ld\n", len, path, offset);
+    if (fs_kernel_cache)
+        return -EOPNOTSUPP;
+    if (memchr(arg->src, '\0', sizeof(arg->src)) == NULL)
+        return -ENAMETOOLONG;
+    if (is_stats_file(arg->src))
+        return -EINVAL;
 
-    char *tmp = strdup(path);
-    if (!tmp)
-        return -ENOMEM;
+    int inum = path_lookup_rw(path, NULL);
+    if (inum < 0)
+        return inum;
+    int src_inum = path_lookup(arg->src, NULL);
+    if (src_inum < 0)
+        return src_inum;
+    if (src_inum == inum)
+        return -EINVAL;
 
-    char *tokens[MAX_PATH_LEN];
-    int count = parse(tmp, tokens);
+    struct fs_inode inode, src;
+    int rv;
+    inode_lock2(inum, src_inum);
+    if (read_inode(inum, &inode) < 0 || read_inode(src_inum, &src) < 0)
+        rv = -EIO;
+    else if (S_ISDIR(inode.mode) || S_ISDIR(src.mode))
+        rv = -EISDIR;
+    else
+    {
+        rv = file_clone(inum, &inode, &src);
+        inode.mtime = time(NULL);
+        inode.ctime = inode.mtime;
+        if (write_inode(inum, &inode) < 0)
+            rv = -EIO;
+    }
+    inode_unlock2(inum, src_inum);
+    return rv;
+}
 
-    /* Print path components for debugging */
-    // fprintf(stderr, "fs_write: Path broken into %d components: ", count);
-    // for (int i = 0; i < count; i++)
-    // {
-    //     fprintf(stderr, "[%s] ", tokens[i]);
-    // }
-    // fprintf(stderr, "\n");
+/* ioctl - private commands on an open file (see fs5600.h).
+ * FS_IOC_SEEK_DATA and FS_IOC_SEEK_HOLE look for the next data or
+ * hole by walking the block pointers; there is always a hole at end
+ * of file. FS_IOC_CLONE is handled by fs_clone.
+ * Errors - path resolution, ENOENT, EISDIR, ENXIO, ENOTTY, and for
+ *          FS_IOC_CLONE, EINVAL, EROFS, ENOSPC
+ */
+int fs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+             unsigned int flags, void *data)
+{
+    /* FUSE passes the command as an int; the _IOWR encoding sets the
+     * top bit, so compare as unsigned */
+    unsigned int ucmd = cmd;
+    if (ucmd == FS_IOC_CLONE)
+        return fs_clone(path, data);
+    if (ucmd != FS_IOC_SEEK_DATA && ucmd != FS_IOC_SEEK_HOLE)
+        return -ENOTTY;
 
-    int inum = translate(count, tokens);
-    free(tmp);
+    int inum = path_lookup(path, NULL);
 
     if (inum < 0)
-    {
-        // fprintf(stderr, "fs_write: translate returned error %d\n", inum);
         return inum;
-    }
-
-    // fprintf(stderr, "fs_write: File found at inode %d\n", inum);
 
     struct fs_inode inode;
     if (read_inode(inum, &inode) < 0)
-    {
-        // fprintf(stderr, "fs_write: read_inode failed\n");
         return -EIO;
-    }
 
     if (S_ISDIR(inode.mode))
-    {
-        // fprintf(stderr, "fs_write: Cannot write to directory\n");
         return -EISDIR;
-    }
 
-    /* No holes */
-    if (offset > inode.size)
+    int64_t *offset = data;
+    if (*offset < 0 || *offset >= inode.size)
+        return -ENXIO;
+
+    /* inline files are all data */
+    if (inode.flags & FS_INODE_INLINE)
     {
-        // fprintf(stderr, "fs_write: Offset %ld beyond file size %d\n", offset, inode.size);
-        return -EINVAL;
+        if (ucmd == FS_IOC_SEEK_HOLE)
+            *offset = inode.size;
+        return 0;
     }
 
-    /* Calculate end position and necessary blocks */
-    size_t end_pos = offset + len;
-    int needed_blocks = (end_pos + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
-    // fprintf(stderr, "fs_write: Need %d blocks for file size %zu\n", needed_blocks, end_pos);
-
-    if (needed_blocks > NDIRECT)
+    int want_data = (ucmd == FS_IOC_SEEK_DATA);
+    int nblocks = DIV_ROUND_UP(inode.size, BLOCK_SIZE);
+    for (int i = *offset / BLOCK_SIZE; i < nblocks; i++)
     {
-        // fprintf(stderr, "fs_write: Too many blocks needed\n");
-        return -ENOSPC;
+        if (block_is_hole(&inode, i) != want_data)
+        {
+            if (i > *offset / BLOCK_SIZE)
+                *offset = (int64_t)i * BLOCK_SIZE;
+            return 0;
+        }
     }
 
-    /* Allocate blocks as needed */
-    for (int i = 0; i < needed_blocks; i++)
+    if (want_data)
+        return -ENXIO;
+    *offset = inode.size;
+    return 0;
+}
+
+/**
+ * Allocate blocks for any holes in [offset, offset+len) of a file,
+ * taking each run of holes as one contiguous run of blocks if possible.
+ * The new blocks are marked unwritten rather than zeroed. Does not
+ * write the inode.
+ */
+static int file_prealloc(struct fs_inode *inode, off_t offset, off_t len, int keep_size)
+{
+    off_t end = offset + len;
+    if (end > (off_t)NDIRECT * BLOCK_SIZE)
+        return -EFBIG;
+
+    if (inode->flags & FS_INODE_INLINE)
     {
-        if (inode.ptrs[i] == 0)
+        /* the inode itself already has room */
+        if (end <= FS_INLINE_MAX)
         {
-            // fprintf(stderr, "fs_write: Allocating block for position %d\n", i);
-            int block = find_free_block();
-            if (block < 0)
-            {
-                // fprintf(stderr, "fs_write: Failed to find free block\n");
-                return block;
-            }
-
-            /* Initialize new block */
-            char zeros[BLOCK_SIZE] = {0};
-            if (block_write(zeros, block, 1) < 0)
+            if (!keep_size && end > inode->size)
             {
-                // fprintf(stderr, "fs_write: Failed to initialize block\n");
-                free_block(block);
-                return -EIO;
+                memset(inode->data + inode->size, 0, end - inode->size);
+                inode->size = end;
             }
-
-            inode.ptrs[i] = block;
+            return 0;
         }
+        int rv = inode_uninline(inode);
+        if (rv < 0)
+            return rv;
     }
 
-    /* Actually write the data */
-    size_t written = 0;
-    int curr_block = offset / BLOCK_SIZE;
-    int block_offset = offset % BLOCK_SIZE;
+    int rv = tail_unpack(inode);
+    if (rv < 0)
+        return rv;
 
-    while (written < len)
+    int last = DIV_ROUND_UP(end, BLOCK_SIZE);
+    for (int i = offset / BLOCK_SIZE; i < last;)
     {
-        // fprintf(stderr, "fs_write: Writing to block %d (inode %d) with offset %d\n", curr_block, inode.ptrs[curr_block], block_offset);
-
-        char block_data[BLOCK_SIZE];
-        if (block_read(block_data, inode.ptrs[curr_block], 1) < 0)
+        if (inode->ptrs[i] != 0)
         {
-            // fprintf(stderr, "fs_write: Failed to read block %d\n", inode.ptrs[curr_block]);
-            return -EIO;
+            i++;
+            continue;
         }
 
-        /* Calculate bytes to write in this block */
-        int bytes_this_block = BLOCK_SIZE - block_offset;
-        if (bytes_this_block > (len - written))
-            bytes_this_block = len - written;
+        int n = 0;
+        while (i + n < last && inode->ptrs[i + n] == 0)
+            n++;
 
-        /* Copy data to block buffer */
-        memcpy(block_data + block_offset, buf + written, bytes_this_block);
-
-        /* Write block back */
-        if (block_write(block_data, inode.ptrs[curr_block], 1) < 0)
+        int got;
+        int start = find_free_run(n, &got);
+        if (start < 0)
+            return start;
+        for (int j = 0; j < got; j++)
         {
-            // fprintf(stderr, "fs_write: Failed to write block %d\n", inode.ptrs[curr_block]);
-            return -EIO;
+            inode->ptrs[i + j] = start + j;
+            inode->unwritten |= 1u << (i + j);
         }
-
-        written += bytes_this_block;
-        curr_block++;
-        block_offset = 0;
+        i += got;
     }
 
-    /* Update file size if needed */
-    if (end_pos > inode.size)
-    {
-        // fprintf(stderr, "fs_write: Updating file size from %d to %zu\n", inode.size, end_pos);
-        inode.size = end_pos;
-    }
+    if (!keep_size && end > inode->size)
+        inode->size = end;
+    return 0;
+}
 
-    /* Update times */
-    inode.mtime = time(NULL);
-    inode.ctime = inode.mtime;
+/**
+ * Free the blocks entirely inside [offset, offset+len) of a file and
+ * zero the parts of any blocks it only partly covers. Does not write
+ * the inode.
+ */
+static int file_punch_hole(struct fs_inode *inode, off_t offset, off_t len)
+{
+    off_t end = offset + len;
+    if (end > (off_t)NDIRECT * BLOCK_SIZE)
+        end = (off_t)NDIRECT * BLOCK_SIZE;
 
-    /* Write inode back */
-    if (write_inode(inum, &inode) < 0)
+    if (inode->flags & FS_INODE_INLINE)
     {
-        // fprintf(stderr, "fs_write: Failed to write inode\n");
-        return -EIO;
+        if (offset < inode->size)
+            memset(inode->data + offset, 0, (end < inode->size ? end : inode->size) - offset);
+        return 0;
     }
 
-    // fprintf(stderr, "fs_write: Successfully wrote %zu bytes\n", written);
-    return written;
-}
-/* statfs - get file system statistics
- * see 'man 2 statfs' for description of 'struct statvfs'.
- * Errors - none. Needs to work.
- */
-int fs_statfs(const char *path, struct statvfs *st)
-{
-    /* Set block and fragment sizes */
-    st->f_bsize = BLOCK_SIZE;
-    st->f_frsize = BLOCK_SIZE;
-    st->f_blocks = 400;
+    int rv = tail_unpack(inode);
+    if (rv < 0)
+        return rv;
 
-    /* Count used blocks */
-    unsigned int used_blocks = 0;
-    for (int i = 0; i < 4096; i++)
+    for (int i = offset / BLOCK_SIZE; i < DIV_ROUND_UP(end, BLOCK_SIZE); i++)
     {
-        for (int j = 0; j < 8; j++)
+        if (inode->ptrs[i] == 0)
+            continue;
+
+        off_t block_start = (off_t)i * BLOCK_SIZE;
+        off_t block_end = block_start + BLOCK_SIZE;
+        off_t s = offset > block_start ? offset : block_start;
+        off_t e = end < block_end ? end : block_end;
+        if (e >= inode->size)
+            e = block_end; // the rest of the block is past EOF
+
+        if (s == block_start && e == block_end)
+        {
+            free_block(inode->ptrs[i]);
+            inode->ptrs[i] = 0;
+            inode->unwritten &= ~(1u << i);
+        }
+        else if (!(inode->unwritten & (1u << i)))
         {
-            int bit_index = i * 8 + j;
-            if (bit_index < (int)superblock.disk_size && bit_test(g_bitmap, bit_index))
-                used_blocks++;
+            char block_data[BLOCK_SIZE];
+            if (disk_read(block_data, inode->ptrs[i], 1) < 0)
+                return -EIO;
+            memset(block_data + (s - block_start), 0, e - s);
+            rv = file_block_write(inode, i, block_data);
+            if (rv < 0)
+                return rv;
         }
     }
+    return 0;
+}
 
-    st->f_bfree = 400 - used_blocks;
-    st->f_bavail = st->f_bfree;
-    st->f_namemax = MAX_NAME_LEN;
+/* fallocate - manipulate the space allocated to a file
+ *  mode 0 - allocate blocks for [offset, offset+len), extending the
+ *           file if the range goes past the end
+ *  FALLOC_FL_KEEP_SIZE - allocate, but leave the file size alone
+ *  FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE - free the blocks in the
+ *           range; partially covered blocks are zeroed in place
+ * Preallocated blocks read as zeros until they are written.
+ * Errors - path resolution, ENOENT, EISDIR, EINVAL, EFBIG, ENOSPC, EOPNOTSUPP
+ */
+int fs_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi)
+{
+    if (is_stats_file(path))
+        return -EACCES;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+        return -EOPNOTSUPP;
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))
+        return -EOPNOTSUPP;
+    if (offset < 0 || len <= 0)
+        return -EINVAL;
 
-    /* Other fields can be set to 0 */
-    st->f_files = 0;
-    st->f_ffree = 0;
-    st->f_favail = 0;
-    st->f_fsid = 0;
-    st->f_flag = 0;
+    int inum = path_lookup_rw(path, NULL);
 
-    return 0;
+    if (inum < 0)
+        return inum;
+
+    struct fs_inode inode;
+    int rv;
+    inode_lock(inum);
+    if (read_inode(inum, &inode) < 0)
+        rv = -EIO;
+    else if (S_ISDIR(inode.mode))
+        rv = -EISDIR;
+    else
+    {
+        if (mode & FALLOC_FL_PUNCH_HOLE)
+            rv = file_punch_hole(&inode, offset, len);
+        else
+            rv = file_prealloc(&inode, offset, len, mode & FALLOC_FL_KEEP_SIZE);
+
+        /* even after a failure, blocks allocated so far are in the inode */
+        inode.mtime = time(NULL);
+        inode.ctime = inode.mtime;
+        if (write_inode(inum, &inode) < 0)
+            rv = -EIO;
+    }
+    inode_unlock(inum);
+    return rv;
+}
+
+/* Statistics wrappers - every entry point in fs_ops goes through one
+ * of these, which times the call and accounts for it under 'op'. The
+ * 'bytes' expression can use the call's return value as 'rv'.
+ */
+#define TIMED_OP(op, bytes, call)                              \
+    do                                                         \
+    {                                                          \
+        uint64_t t0 = stats_now();                             \
+        int rv = (call);                                       \
+        stats_record(op, stats_now() - t0, (bytes), rv);       \
+        return rv;                                             \
+    } while (0)
+
+static int timed_getattr(const char *path, struct stat *sb)
+{
+    TIMED_OP(STATS_GETATTR, 0, fs_getattr(path, sb));
+}
+static int timed_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi)
+{
+    TIMED_OP(STATS_READDIR, 0, fs_readdir(path, ptr, filler, offset, fi));
+}
+static int timed_rename(const char *src_path, const char *dst_path)
+{
+    TIMED_OP(STATS_RENAME, 0, fs_rename(src_path, dst_path));
+}
+static int timed_chmod(const char *path, mode_t mode)
+{
+    TIMED_OP(STATS_CHMOD, 0, fs_chmod(path, mode));
+}
+static int timed_open(const char *path, struct fuse_file_info *fi)
+{
+    TIMED_OP(STATS_OPEN, 0, fs_open(path, fi));
+}
+static int timed_read(const char *path, char *buf, size_t len, off_t offset,
+                      struct fuse_file_info *fi)
+{
+    TIMED_OP(STATS_READ, rv > 0 ? rv : 0, fs_read(path, buf, len, offset, fi));
+}
+static int timed_read_buf(const char *path, struct fuse_bufvec **bufp, size_t len,
+                          off_t offset, struct fuse_file_info *fi)
+{
+    TIMED_OP(STATS_READ_BUF, rv == 0 ? fuse_buf_size(*bufp) : 0,
+             fs_read_buf(path, bufp, len, offset, fi));
+}
+static int timed_statfs(const char *path, struct statvfs *st)
+{
+    TIMED_OP(STATS_STATFS, 0, fs_statfs(path, st));
+}
+static int timed_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                       unsigned int flags, void *data)
+{
+    TIMED_OP(STATS_IOCTL, 0, fs_ioctl(path, cmd, arg, fi, flags, data));
+}
+static int timed_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    TIMED_OP(STATS_CREATE, 0, fs_create(path, mode, fi));
+}
+static int timed_mkdir(const char *path, mode_t mode)
+{
+    TIMED_OP(STATS_MKDIR, 0, fs_mkdir(path, mode));
+}
+static int timed_unlink(const char *path)
+{
+    TIMED_OP(STATS_UNLINK, 0, fs_unlink(path));
+}
+static int timed_rmdir(const char *path)
+{
+    TIMED_OP(STATS_RMDIR, 0, fs_rmdir(path));
+}
+static int timed_utime(const char *path, struct utimbuf *ut)
+{
+    TIMED_OP(STATS_UTIME, 0, fs_utime(path, ut));
+}
+static int timed_truncate(const char *path, off_t len)
+{
+    TIMED_OP(STATS_TRUNCATE, 0, fs_truncate(path, len));
+}
+static int timed_write(const char *path, const char *buf, size_t len, off_t offset,
+                       struct fuse_file_info *fi)
+{
+    TIMED_OP(STATS_WRITE, rv > 0 ? rv : 0, fs_write(path, buf, len, offset, fi));
+}
+static int timed_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                           struct fuse_file_info *fi)
+{
+    TIMED_OP(STATS_WRITE_BUF, rv > 0 ? rv : 0, fs_write_buf(path, buf, offset, fi));
+}
+static int timed_release(const char *path, struct fuse_file_info *fi)
+{
+    TIMED_OP(STATS_RELEASE, 0, fs_release(path, fi));
+}
+static int timed_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    TIMED_OP(STATS_FSYNC, 0, fs_fsync(path, datasync, fi));
+}
+static int timed_fallocate(const char *path, int mode, off_t offset, off_t len,
+                           struct fuse_file_info *fi)
+{
+    TIMED_OP(STATS_FALLOCATE, 0, fs_fallocate(path, mode, offset, len, fi));
 }
 
 /* operations vector. Please don't rename it, or else you'll break things
  */
 struct fuse_operations fs_ops = {
     .init = fs_init, /* read-mostly operations */
-    .getattr = fs_getattr,
-    .readdir = fs_readdir,
-    .rename = fs_rename,
-    .chmod = fs_chmod,
-    .read = fs_read,
-    .statfs = fs_statfs,
-
-    .create = fs_create, /* write operations */
-    .mkdir = fs_mkdir,
-    .unlink = fs_unlink,
-    .rmdir = fs_rmdir,
-    .utime = fs_utime,
-    .truncate = fs_truncate,
-    .write = fs_write,
+    .destroy = fs_destroy,
+    .getattr = timed_getattr,
+    .readdir = timed_readdir,
+    .rename = timed_rename,
+    .chmod = timed_chmod,
+    .open = timed_open,
+    .read = timed_read,
+    .read_buf = timed_read_buf,
+    .statfs = timed_statfs,
+    .ioctl = timed_ioctl,
+
+    .create = timed_create, /* write operations */
+    .mkdir = timed_mkdir,
+    .unlink = timed_unlink,
+    .rmdir = timed_rmdir,
+    .utime = timed_utime,
+    .truncate = timed_truncate,
+    .write = timed_write,
+    .write_buf = timed_write_buf,
+    .release = timed_release,
+    .fsync = timed_fsync,
+    .fallocate = timed_fallocate,
 };
\ No newline at end of file
@@ -11,8 +11,11 @@
 #include <fuse.h>
 
 #include "fs5600.h"
+#include "disk.h"
 
-extern void block_init(char *file);
+extern int fs_log_writes;
+extern int fs_kernel_cache;
+extern int fs_shares_blocks(void);
 
 /* All homework functions are accessed through the operations
  * structure.  
@@ -23,20 +26,50 @@ struct data {
     char *image_name;
     int   part;
     int   cmd_mode;
+    int   nocache;
+    char *blktrace;
+    int   logwrite;
 } _data;
 
+/* Kernel cache timeouts, in seconds. Every change to the image goes
+ * through this process, and the kernel updates or drops its cached
+ * entries and attributes for each operation it forwards to us - except
+ * for clones and snapshots. The kernel doesn't know an FS_IOC_CLONE
+ * changed anything, and a snapshot made again under an old name
+ * replaces everything under its path; either way the kernel could go
+ * on serving old sizes for up to ATTR_TIMEOUT, and old pages
+ * (kernel_cache keeps them across opens) until they are evicted. So
+ * these are only used on an image that has never had a clone or a
+ * snapshot, and then new ones are refused (see fs_kernel_cache). With
+ * -nocache, or on an image that has them, pages are dropped on every
+ * open and attributes cached for only FUSE's default of a second. Use
+ * -nocache too if the image is modified behind our back.
+ */
+#define ENTRY_TIMEOUT    30
+#define ATTR_TIMEOUT     30
+#define NEGATIVE_TIMEOUT 5
+
 /**************/
 
 /*
  * See comments in /usr/include/fuse/fuse_opts.h for details of 
  * FUSE argument processing.
  * 
- *  usage: ./homework -image disk.img directory
+ *  usage: ./homework -image disk.img [-nocache] [-blktrace file] [-logwrite] directory
  *              disk.img  - name of the image file to mount
+ *              -nocache  - disable kernel page, entry and attribute caching;
+ *                          needed to make clones and snapshots
+ *              -blktrace - record every block transfer to 'file' (see
+ *                          blktrace.h); replay it with ./replay
+ *              -logwrite - write file overwrites to a log rather than
+ *                          in place (see log_append in homework.c)
  *              directory - directory to mount it on
  */
 static struct fuse_opt opts[] = {
     {"-image %s", offsetof(struct data, image_name), 0},
+    {"-nocache", offsetof(struct data, nocache), 1},
+    {"-blktrace %s", offsetof(struct data, blktrace), 0},
+    {"-logwrite", offsetof(struct data, logwrite), 1},
     FUSE_OPT_END
 };
 
@@ -48,7 +81,28 @@ int main(int argc, char **argv)
     if (fuse_opt_parse(&args, &_data, opts, NULL) == -1)
 	exit(1);
 
-    block_init(_data.image_name);
+    disk_init(_data.image_name);
+    if (_data.blktrace)
+        block_trace_open(_data.blktrace);
+    fs_log_writes = _data.logwrite;
+
+    /* Large requests: up to FS_MAX_XFER per read, write and readahead
+     */
+    char xfer_opts[128];
+    snprintf(xfer_opts, sizeof(xfer_opts),
+             "-obig_writes,async_read,max_write=%d,max_readahead=%d",
+             FS_MAX_XFER, FS_MAX_XFER);
+    fuse_opt_add_arg(&args, xfer_opts);
+
+    if (!_data.nocache && !fs_shares_blocks())
+    {
+        char cache_opts[128];
+        snprintf(cache_opts, sizeof(cache_opts),
+                 "-okernel_cache,entry_timeout=%d,attr_timeout=%d,negative_timeout=%d",
+                 ENTRY_TIMEOUT, ATTR_TIMEOUT, NEGATIVE_TIMEOUT);
+        fuse_opt_add_arg(&args, cache_opts);
+        fs_kernel_cache = 1;
+    }
 
     return fuse_main(args.argc, args.argv, &fs_ops, NULL);
 }
@@ -16,9 +16,18 @@ print ('superblock: magic:  %08X%s' %
            (sb.magic, ' *BAD*' if sb.magic != fs.MAGIC else ''))
 print ('            blocks: %d%s' %
            (sb.disk_sz, (' *BAD* %d' % nblks) if sb.disk_sz != nblks else ''))
-print
 
 blkmap = fs.bitmap.from_buffer_copy(blks[1])
+nfree = sum(1 for i in range(3, nblks) if not blkmap.get(i))
+if sb.state & fs.STATE_CLEAN:
+    print ('            clean, free: %d%s' %
+               (sb.free_blocks, (' *BAD* %d' % nfree) if sb.free_blocks != nfree else ''))
+else:
+    print ('            not clean, free: %d' % nfree)
+snaps = [(sn.name.decode('ascii'), sn.root) for sn in sb.snaps if sn.root]
+for name, root in snaps:
+    print ('            snapshot "%s": root %d' % (name, root))
+print
 inodes = dict()
 
 print("blocks used:"),
@@ -50,11 +59,22 @@ def iter(name, inum, v):
                                                  _in.size, alloc))
     
     xblks = (_in.size + 4095) // 4096
-    if fs.S_ISREG(_in.mode):
+    if fs.S_ISREG(_in.mode) and (_in.flags & fs.INODE_INLINE):
+        if v:
+            print ('  inline: %d bytes' % _in.size)
+    elif fs.S_ISREG(_in.mode):
         if v:
             print ('  blocks: ', end='')
         for i in range(xblks):
+            if _in.ptrs[i] == 0:
+                if v:
+                    print ('hole', end=' ')
+                continue
             alloc = '' if blkmap.get(_in.ptrs[i]) else '(NOT ALLOCATED)'
+            if _in.unwritten & (1 << i):
+                alloc += '(unwritten)'
+            if i == xblks - 1 and (_in.flags & fs.INODE_TAIL):
+                alloc += '(tail frag %d)' % _in.tail_frag
             if v:
                 print (str(_in.ptrs[i]) + alloc, end=' '),
         print("\n")
@@ -63,17 +83,16 @@ def iter(name, inum, v):
     elif fs.S_ISDIR(_in.mode):
         for i in range(xblks):
             dblk = _in.ptrs[i]
+            if dblk == 0:
+                continue
             alloc = '' if blkmap.get(_in.ptrs[i]) else '(NOT ALLOCATED)'
             if v:
                 print ('  block', dblk, alloc)
-            _blk = blks[dblk]
-            des = [fs.dirent.from_buffer_copy(_blk[j:j+32])
-                       for j in range(0, 4096, 32)]
-            for j in range(128):
-                if des[j].valid:
+            for off, de, dname in fs.dirents(blks[dblk]):
+                if de.inode:
                     if v:
-                        print ('    [%d] "%s" -> %d' % (j, des[j].name.decode('ascii'), des[j].inode))
-                    children.append([name + '/' + des[j].name.decode('ascii'), des[j].inode])
+                        print ('    [%d] "%s" -> %d' % (off, dname, de.inode))
+                    children.append([name + '/' + dname, de.inode])
             print("")
     else:
         if v:
@@ -86,6 +105,8 @@ def iter(name, inum, v):
         iter(n,i, v)
 
 iter('', 2, False)
+for name, root in snaps:
+    iter('/.snapshots/' + name, root, False)
 
 print ("inodes found:")
 
@@ -0,0 +1,501 @@
+/*
+ * file:        replay.c
+ * description: replay a block I/O trace (see blktrace.h) against an
+ *              image file, to compare I/O engines and caching on a
+ *              real access pattern without re-running the workload.
+ *
+ * usage: ./replay [-e fd|mmap|uring] [-c blocks] [-q depth] [-d] [-t]
+ *                 trace image.img
+ *      -e engine  - pread/pwrite (default), memcpy to/from an mmap of
+ *                   the image, or io_uring
+ *      -c blocks  - put a write-through LRU cache of this many blocks
+ *                   in front of the engine
+ *      -q depth   - io_uring queue depth (default 32)
+ *      -d         - O_DIRECT, for the fd and uring engines
+ *      -t         - keep the original timing between requests, rather
+ *                   than issuing them back to back
+ *
+ * Writes land on the image, so replay against a copy. Output is one
+ * CSV line:
+ *   engine,cache_blocks,ops,blocks,secs,ops_per_sec,MB_per_sec,
+ *   p50_us,p99_us,max_us,hit_ratio
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+#include "fs5600.h"
+#include "blktrace.h"
+
+static struct blktrace_rec *recs;
+static long n_recs;
+static int max_nblks;
+
+static int image_fd;
+static off_t image_blocks;
+static char *buf;               /* scratch data for every request */
+static int o_direct;
+static int qdepth = 32;
+
+static uint64_t *lat;           /* per-request latency, ns */
+static long n_lat;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void die(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+/****** CACHE ******/
+
+/* LRU block cache: open hash on lba, doubly linked LRU list. Only
+ * tracks which blocks are resident - the data itself doesn't matter
+ * for replay.
+ */
+struct cblock {
+    uint32_t lba;
+    int hnext;
+    int prev, next;
+};
+
+static struct cblock *cache;
+static int *cache_hash;
+static int cache_size, cache_used, cache_nhash;
+static int lru_head = -1, lru_tail = -1;        /* head = most recent */
+static long cache_hits, cache_lookups;
+
+static void lru_unlink(int i)
+{
+    if (cache[i].prev >= 0)
+        cache[cache[i].prev].next = cache[i].next;
+    else
+        lru_head = cache[i].next;
+    if (cache[i].next >= 0)
+        cache[cache[i].next].prev = cache[i].prev;
+    else
+        lru_tail = cache[i].prev;
+}
+
+static void lru_push(int i)
+{
+    cache[i].prev = -1;
+    cache[i].next = lru_head;
+    if (lru_head >= 0)
+        cache[lru_head].prev = i;
+    lru_head = i;
+    if (lru_tail < 0)
+        lru_tail = i;
+}
+
+static void hash_remove(int i)
+{
+    int *pp = &cache_hash[cache[i].lba % cache_nhash];
+    while (*pp != i)
+        pp = &cache[*pp].hnext;
+    *pp = cache[i].hnext;
+}
+
+/* look up 'lba', inserting it (and evicting the LRU block) on a miss.
+ * Returns 1 on a hit.
+ */
+static int cache_access(uint32_t lba)
+{
+    cache_lookups++;
+    for (int i = cache_hash[lba % cache_nhash]; i >= 0; i = cache[i].hnext)
+    {
+        if (cache[i].lba == lba)
+        {
+            cache_hits++;
+            lru_unlink(i);
+            lru_push(i);
+            return 1;
+        }
+    }
+
+    int i;
+    if (cache_used < cache_size)
+        i = cache_used++;
+    else
+    {
+        i = lru_tail;
+        lru_unlink(i);
+        hash_remove(i);
+    }
+    cache[i].lba = lba;
+    cache[i].hnext = cache_hash[lba % cache_nhash];
+    cache_hash[lba % cache_nhash] = i;
+    lru_push(i);
+    return 0;
+}
+
+static void cache_init(int nblocks)
+{
+    cache_size = nblocks;
+    cache_nhash = nblocks * 2 + 1;
+    cache = calloc(nblocks, sizeof(*cache));
+    cache_hash = malloc(cache_nhash * sizeof(int));
+    if (!cache || !cache_hash)
+        die("cache");
+    memset(cache_hash, 0xff, cache_nhash * sizeof(int));
+}
+
+/* Returns 1 if a read is entirely satisfied by the cache. Writes are
+ * write-through: they update the cache and always go to the engine.
+ */
+static int cache_filter(struct blktrace_rec *r)
+{
+    if (cache_size == 0)
+        return 0;
+
+    int all_hit = 1;
+    for (int i = 0; i < r->nblks; i++)
+        if (!cache_access(r->lba + i))
+            all_hit = 0;
+    return r->rw == BLKTRACE_READ && all_hit;
+}
+
+/****** ENGINES ******/
+
+struct engine {
+    const char *name;
+    void (*init)(void);
+    /* issue a request; complete() is called (possibly later) with the
+     * index of the request when it finishes
+     */
+    void (*submit)(long idx);
+    void (*drain)(void);
+};
+
+static uint64_t *issue_ts;
+
+static void complete(long idx)
+{
+    lat[n_lat++] = now_ns() - issue_ts[idx];
+}
+
+static void fd_init(void)
+{
+}
+
+static void fd_submit(long idx)
+{
+    struct blktrace_rec *r = &recs[idx];
+    size_t len = (size_t)r->nblks * FS_BLOCK_SIZE;
+    off_t pos = (off_t)r->lba * FS_BLOCK_SIZE;
+    ssize_t n = r->rw == BLKTRACE_WRITE ? pwrite(image_fd, buf, len, pos)
+                                        : pread(image_fd, buf, len, pos);
+    if (n != (ssize_t)len)
+        die("replay I/O");
+    complete(idx);
+}
+
+static void fd_drain(void)
+{
+}
+
+static char *map;
+
+static void mmap_init(void)
+{
+    map = mmap(NULL, image_blocks * FS_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+               MAP_SHARED, image_fd, 0);
+    if (map == MAP_FAILED)
+        die("mmap");
+}
+
+static void mmap_submit(long idx)
+{
+    struct blktrace_rec *r = &recs[idx];
+    size_t len = (size_t)r->nblks * FS_BLOCK_SIZE;
+    char *p = map + (size_t)r->lba * FS_BLOCK_SIZE;
+    if (r->rw == BLKTRACE_WRITE)
+        memcpy(p, buf, len);
+    else
+        memcpy(buf, p, len);
+    complete(idx);
+}
+
+static void mmap_drain(void)
+{
+    msync(map, image_blocks * FS_BLOCK_SIZE, MS_SYNC);
+}
+
+#ifdef HAVE_IO_URING
+
+/* io_uring through the raw system calls, so we don't need liburing.
+ * Requests are issued as fast as the ring accepts them, with up to
+ * 'qdepth' in flight; all of them share the one scratch buffer.
+ */
+static int ring_fd;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static int inflight, unsubmitted;
+
+static void uring_init(void)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = syscall(__NR_io_uring_setup, qdepth, &p);
+    if (ring_fd < 0)
+        die("io_uring_setup");
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd, IORING_OFF_SQ_RING);
+    char *cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd, IORING_OFF_CQ_RING);
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+        die("io_uring mmap");
+
+    sq_head = (unsigned *)(sq + p.sq_off.head);
+    sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + p.sq_off.array);
+    cq_head = (unsigned *)(cq + p.cq_off.head);
+    cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+}
+
+/* submit what's queued, and wait for at least 'min' completions */
+static void uring_enter(int min)
+{
+    int rv = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, min,
+                     min ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (rv < 0)
+        die("io_uring_enter");
+    unsubmitted -= rv;
+
+    unsigned head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        if (cqe->res < 0)
+        {
+            errno = -cqe->res;
+            die("replay I/O");
+        }
+        complete(cqe->user_data);
+        inflight--;
+        head++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void uring_submit(long idx)
+{
+    struct blktrace_rec *r = &recs[idx];
+
+    if (inflight == qdepth)
+        uring_enter(1);
+
+    unsigned tail = *sq_tail;
+    unsigned i = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = r->rw == BLKTRACE_WRITE ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = image_fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = r->nblks * FS_BLOCK_SIZE;
+    sqe->off = (uint64_t)r->lba * FS_BLOCK_SIZE;
+    sqe->user_data = idx;
+    sq_array[i] = i;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    inflight++;
+    unsubmitted++;
+
+    /* batch submissions, but don't let the ring fill up */
+    if (unsubmitted >= qdepth / 2)
+        uring_enter(0);
+}
+
+static void uring_drain(void)
+{
+    while (inflight > 0)
+        uring_enter(1);
+}
+
+#endif
+
+static struct engine engines[] = {
+    {"fd", fd_init, fd_submit, fd_drain},
+    {"mmap", mmap_init, mmap_submit, mmap_drain},
+#ifdef HAVE_IO_URING
+    {"uring", uring_init, uring_submit, uring_drain},
+#endif
+};
+#define N_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+/****** MAIN ******/
+
+static void load_trace(const char *file)
+{
+    FILE *fp = fopen(file, "r");
+    if (fp == NULL)
+        die(file);
+
+    struct blktrace_hdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != BLKTRACE_MAGIC)
+    {
+        fprintf(stderr, "%s: not a block trace\n", file);
+        exit(1);
+    }
+    if (hdr.block_size != FS_BLOCK_SIZE)
+    {
+        fprintf(stderr, "%s: block size %u, expected %d\n", file, hdr.block_size, FS_BLOCK_SIZE);
+        exit(1);
+    }
+
+    struct stat sb;
+    fstat(fileno(fp), &sb);
+    long max = (sb.st_size - sizeof(hdr)) / sizeof(*recs);
+    recs = malloc((max + 1) * sizeof(*recs));
+    if (!recs)
+        die("malloc");
+    n_recs = fread(recs, sizeof(*recs), max, fp);
+    fclose(fp);
+
+    for (long i = 0; i < n_recs; i++)
+    {
+        if (recs[i].nblks > max_nblks)
+            max_nblks = recs[i].nblks;
+        if (recs[i].lba + recs[i].nblks > image_blocks)
+        {
+            fprintf(stderr, "%s: request %ld (lba %u+%u) is past the end of the image\n",
+                    file, i, recs[i].lba, recs[i].nblks);
+            exit(1);
+        }
+    }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-e fd|mmap|uring] [-c blocks] [-q depth] [-d] [-t] "
+            "trace image.img\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct engine *eng = &engines[0];
+    int c, timed = 0, cache_blocks = 0;
+
+    while ((c = getopt(argc, argv, "e:c:q:dt")) != -1)
+    {
+        switch (c)
+        {
+        case 'e':
+            eng = NULL;
+            for (int i = 0; i < (int)N_ENGINES; i++)
+                if (strcmp(optarg, engines[i].name) == 0)
+                    eng = &engines[i];
+            if (eng == NULL)
+            {
+                fprintf(stderr, "unknown engine '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'c':
+            cache_blocks = atoi(optarg);
+            break;
+        case 'q':
+            qdepth = atoi(optarg);
+            break;
+        case 'd':
+            o_direct = 1;
+            break;
+        case 't':
+            timed = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || qdepth < 1)
+        usage(argv[0]);
+
+    int flags = O_RDWR;
+    if (o_direct && eng->init != mmap_init)
+        flags |= O_DIRECT;
+    if ((image_fd = open(argv[optind + 1], flags)) < 0)
+        die(argv[optind + 1]);
+    struct stat sb;
+    fstat(image_fd, &sb);
+    image_blocks = sb.st_size / FS_BLOCK_SIZE;
+
+    load_trace(argv[optind]);
+    if (posix_memalign((void **)&buf, FS_BLOCK_SIZE, (size_t)(max_nblks + 1) * FS_BLOCK_SIZE))
+        die("malloc");
+    memset(buf, 0x5a, (size_t)(max_nblks + 1) * FS_BLOCK_SIZE);
+    lat = malloc((n_recs + 1) * sizeof(*lat));
+    issue_ts = malloc((n_recs + 1) * sizeof(*issue_ts));
+    if (cache_blocks > 0)
+        cache_init(cache_blocks);
+    eng->init();
+
+    long nblocks = 0;
+    uint64_t t0 = now_ns();
+    for (long i = 0; i < n_recs; i++)
+    {
+        struct blktrace_rec *r = &recs[i];
+        if (timed)
+            while (now_ns() - t0 < r->ts)
+                ;
+        nblocks += r->nblks;
+        issue_ts[i] = now_ns();
+        if (cache_filter(r))
+            complete(i);
+        else
+            eng->submit(i);
+    }
+    eng->drain();
+    double secs = (now_ns() - t0) / 1e9;
+
+    qsort(lat, n_lat, sizeof(*lat), cmp_u64);
+    double p50 = n_lat ? lat[(long)(0.50 * (n_lat - 1))] / 1000.0 : 0;
+    double p99 = n_lat ? lat[(long)(0.99 * (n_lat - 1))] / 1000.0 : 0;
+    double max = n_lat ? lat[n_lat - 1] / 1000.0 : 0;
+    double hit = cache_lookups ? (double)cache_hits / cache_lookups : 0;
+
+    printf("engine,cache_blocks,ops,blocks,secs,ops_per_sec,MB_per_sec,p50_us,p99_us,max_us,hit_ratio\n");
+    printf("%s,%d,%ld,%ld,%.3f,%.0f,%.1f,%.2f,%.2f,%.2f,%.3f\n", eng->name, cache_blocks,
+           n_recs, nblocks, secs, n_recs / secs, nblocks * (double)FS_BLOCK_SIZE / secs / 1e6,
+           p50, p99, max, hit);
+
+    close(image_fd);
+    return 0;
+}
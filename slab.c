@@ -0,0 +1,209 @@
+/*
+ * file:        slab.c
+ * description: fixed-size object allocators for the in-memory caches
+ *              of the CS 5600 file system.
+ *
+ * Objects are carved out of large chunks mapped with mmap, and are
+ * never handed back to the system, so the caches don't fragment the
+ * malloc heap however much they churn. Every thread keeps a magazine
+ * of free objects per cache, so most allocs and frees take no lock;
+ * magazines are refilled from, and spilled back to, a per-cache depot
+ * under a mutex, half a magazine at a time.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+
+#define CACHE_LINE 64
+#define CHUNK_SIZE (256 * 1024)
+#define HUGE_CHUNK (2 * 1024 * 1024)
+
+#define SLAB_MAX_CACHES 8
+#define MAG_SIZE 32
+
+struct slab_cache
+{
+    const char *name;
+    size_t size;       // object size, rounded up to a cache line
+    size_t chunk_size;
+    int flags;
+    int id;            // index into each thread's magazines
+
+    pthread_mutex_t lock;
+    void *free_list;   // depot, linked through each object's first word
+    uint64_t bytes;    // chunk memory mapped so far
+    uint64_t in_use;
+};
+
+static struct slab_cache caches[SLAB_MAX_CACHES];
+static int n_caches;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct magazine
+{
+    int n;
+    void *obj[MAG_SIZE];
+};
+
+static __thread struct magazine mags[SLAB_MAX_CACHES];
+static __thread int mags_registered;
+static pthread_key_t mags_key;
+static pthread_once_t mags_once = PTHREAD_ONCE_INIT;
+
+struct slab_cache *slab_create(const char *name, size_t size, int flags)
+{
+    pthread_mutex_lock(&caches_lock);
+    if (n_caches == SLAB_MAX_CACHES)
+    {
+        pthread_mutex_unlock(&caches_lock);
+        fprintf(stderr, "slab: too many caches (%s)\n", name);
+        abort();
+    }
+    struct slab_cache *c = &caches[n_caches];
+    c->id = n_caches++;
+    pthread_mutex_unlock(&caches_lock);
+
+    c->name = name;
+    c->size = (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    c->flags = flags;
+    c->chunk_size = (flags & SLAB_HUGEPAGE) ? HUGE_CHUNK : CHUNK_SIZE;
+    if (c->chunk_size < c->size)
+        c->chunk_size = c->size;
+    pthread_mutex_init(&c->lock, NULL);
+    return c;
+}
+
+/* map a chunk, aligned to its own size so a huge page can back it */
+static void *chunk_map(struct slab_cache *c)
+{
+    size_t len = c->chunk_size;
+    size_t align = (c->flags & SLAB_HUGEPAGE) ? HUGE_CHUNK : 0;
+    char *p = mmap(NULL, len + align, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    if (align)
+    {
+        char *start = (char *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+        if (start > p)
+            munmap(p, start - p);
+        if (start + len < p + len + align)
+            munmap(start + len, p + len + align - (start + len));
+        p = start;
+#ifdef MADV_HUGEPAGE
+        madvise(p, len, MADV_HUGEPAGE); // just a hint
+#endif
+    }
+    return p;
+}
+
+/* refill the depot with a new chunk's worth of objects. Called with
+ * c->lock held.
+ */
+static int depot_grow(struct slab_cache *c)
+{
+    char *p = chunk_map(c);
+    if (p == NULL)
+        return -1;
+    c->bytes += c->chunk_size;
+    for (size_t off = 0; off + c->size <= c->chunk_size; off += c->size)
+    {
+        *(void **)(p + off) = c->free_list;
+        c->free_list = p + off;
+    }
+    return 0;
+}
+
+/* thread exit: give the magazines' objects back to the depots */
+static void mags_flush(void *arg)
+{
+    struct magazine *m = arg;
+    for (int i = 0; i < n_caches; i++)
+    {
+        struct slab_cache *c = &caches[i];
+        pthread_mutex_lock(&c->lock);
+        while (m[i].n > 0)
+        {
+            void *obj = m[i].obj[--m[i].n];
+            *(void **)obj = c->free_list;
+            c->free_list = obj;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+static void mags_key_create(void)
+{
+    pthread_key_create(&mags_key, mags_flush);
+}
+
+static struct magazine *thread_mag(struct slab_cache *c)
+{
+    if (!mags_registered)
+    {
+        pthread_once(&mags_once, mags_key_create);
+        pthread_setspecific(mags_key, mags);
+        mags_registered = 1;
+    }
+    return &mags[c->id];
+}
+
+void *slab_alloc(struct slab_cache *c)
+{
+    struct magazine *m = thread_mag(c);
+
+    if (m->n == 0)
+    {
+        pthread_mutex_lock(&c->lock);
+        while (m->n < MAG_SIZE / 2)
+        {
+            if (c->free_list == NULL && depot_grow(c) < 0)
+                break;
+            void *obj = c->free_list;
+            c->free_list = *(void **)obj;
+            m->obj[m->n++] = obj;
+        }
+        pthread_mutex_unlock(&c->lock);
+        if (m->n == 0)
+            return NULL;
+    }
+
+    __atomic_fetch_add(&c->in_use, 1, __ATOMIC_RELAXED);
+    return m->obj[--m->n];
+}
+
+void slab_free(struct slab_cache *c, void *obj)
+{
+    struct magazine *m = thread_mag(c);
+
+    if (m->n == MAG_SIZE)
+    {
+        pthread_mutex_lock(&c->lock);
+        while (m->n > MAG_SIZE / 2)
+        {
+            void *o = m->obj[--m->n];
+            *(void **)o = c->free_list;
+            c->free_list = o;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    __atomic_fetch_sub(&c->in_use, 1, __ATOMIC_RELAXED);
+    m->obj[m->n++] = obj;
+}
+
+void slab_usage(struct slab_cache *c, uint64_t *in_use, uint64_t *bytes)
+{
+    *in_use = __atomic_load_n(&c->in_use, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&c->lock);
+    *bytes = c->bytes;
+    pthread_mutex_unlock(&c->lock);
+}
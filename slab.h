@@ -0,0 +1,32 @@
+/*
+ * file:        slab.h
+ * description: fixed-size object allocators for the in-memory caches
+ *              of the CS 5600 file system
+ */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* back the cache with 2 MB transparent huge pages where the kernel
+ * allows it; meant for the 4 KB block buffers.
+ */
+#define SLAB_HUGEPAGE 1
+
+struct slab_cache;
+
+/* a cache of 'size'-byte objects, aligned to a cache line. Caches
+ * live for the life of the process.
+ */
+struct slab_cache *slab_create(const char *name, size_t size, int flags);
+
+/* returns NULL only if the system is out of memory */
+void *slab_alloc(struct slab_cache *c);
+void slab_free(struct slab_cache *c, void *obj);
+
+/* objects handed out and not yet freed, and memory reserved in all */
+void slab_usage(struct slab_cache *c, uint64_t *in_use, uint64_t *bytes);
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ * file:        stats.c
+ * description: per-operation counters and latency histograms for the
+ *              CS 5600 file system.
+ *
+ * Latencies go into HDR-style log-linear histograms: each power of two
+ * is split into HIST_SUB equal sub-buckets, giving a fixed relative
+ * error (12.5%) over the whole range with a few hundred counters.
+ * Updates are single relaxed atomic adds, so recording is cheap and
+ * safe from any FUSE worker thread.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct op_stats {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t hist[HIST_BUCKETS];
+};
+
+static struct op_stats op_stats[STATS_NOPS];
+
+struct cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+};
+
+static struct cache_stats cache_stats[STATS_NCACHES];
+
+static const char *cache_names[STATS_NCACHES] = {
+    [STATS_CACHE_INODE] = "inode",
+    [STATS_CACHE_DENTRY] = "dentry",
+    [STATS_CACHE_DIRBLOCK] = "dirblock",
+};
+
+static const char *op_names[STATS_NOPS] = {
+    [STATS_GETATTR] = "getattr",
+    [STATS_READDIR] = "readdir",
+    [STATS_CREATE] = "create",
+    [STATS_MKDIR] = "mkdir",
+    [STATS_UNLINK] = "unlink",
+    [STATS_RMDIR] = "rmdir",
+    [STATS_RENAME] = "rename",
+    [STATS_CHMOD] = "chmod",
+    [STATS_UTIME] = "utime",
+    [STATS_TRUNCATE] = "truncate",
+    [STATS_OPEN] = "open",
+    [STATS_READ] = "read",
+    [STATS_READ_BUF] = "read_buf",
+    [STATS_WRITE] = "write",
+    [STATS_WRITE_BUF] = "write_buf",
+    [STATS_RELEASE] = "release",
+    [STATS_STATFS] = "statfs",
+    [STATS_IOCTL] = "ioctl",
+    [STATS_FALLOCATE] = "fallocate",
+    [STATS_FSYNC] = "fsync",
+    [STATS_BLOCK_READ] = "block_read",
+    [STATS_BLOCK_WRITE] = "block_write",
+};
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* histogram bucket for a value: values below HIST_SUB get a bucket
+ * each, after that each power of two gets HIST_SUB buckets.
+ */
+static int hist_bucket(uint64_t v)
+{
+    if (v < HIST_SUB)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+/* largest value that falls in bucket 'b' */
+static uint64_t hist_value(int b)
+{
+    if (b < HIST_SUB)
+        return b;
+    int shift = b / HIST_SUB - 1;
+    return (((uint64_t)HIST_SUB + b % HIST_SUB + 1) << shift) - 1;
+}
+
+void stats_record(enum stats_op op, uint64_t ns, size_t bytes, int rv)
+{
+    struct op_stats *s = &op_stats[op];
+
+    __atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+    if (rv < 0)
+        __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->hist[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+void stats_cache_access(enum stats_cache c, int hit)
+{
+    if (hit)
+        __atomic_fetch_add(&cache_stats[c].hits, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_add(&cache_stats[c].misses, 1, __ATOMIC_RELAXED);
+}
+
+void stats_reset(void)
+{
+    memset(op_stats, 0, sizeof(op_stats));
+    memset(cache_stats, 0, sizeof(cache_stats));
+}
+
+/* value at percentile 'p' (0..1) of a histogram with 'count' samples
+ */
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t count, double p)
+{
+    uint64_t rank = (uint64_t)(p * count + 0.5), seen = 0;
+    if (rank == 0)
+        rank = 1;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += __atomic_load_n(&hist[b], __ATOMIC_RELAXED);
+        if (seen >= rank)
+            return hist_value(b);
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+int stats_format(char *buf, size_t len)
+{
+    size_t n = 0;
+
+#define EMIT(...)                                                          \
+    n += snprintf(buf ? buf + (n < len ? n : len) : NULL,                 \
+                  n < len ? len - n : 0, __VA_ARGS__)
+
+    EMIT("%-12s %10s %8s %14s %10s %10s %10s %10s %10s\n", "op", "count",
+         "errors", "bytes", "avg_us", "p50_us", "p90_us", "p99_us", "max_us");
+
+    for (int i = 0; i < STATS_NOPS; i++)
+    {
+        struct op_stats *s = &op_stats[i];
+        uint64_t count = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+        if (count == 0)
+            continue;
+
+        uint64_t total = __atomic_load_n(&s->total_ns, __ATOMIC_RELAXED);
+        EMIT("%-12s %10llu %8llu %14llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+             op_names[i], (unsigned long long)count,
+             (unsigned long long)__atomic_load_n(&s->errors, __ATOMIC_RELAXED),
+             (unsigned long long)__atomic_load_n(&s->bytes, __ATOMIC_RELAXED),
+             total / 1000.0 / count,
+             hist_percentile(s->hist, count, 0.50) / 1000.0,
+             hist_percentile(s->hist, count, 0.90) / 1000.0,
+             hist_percentile(s->hist, count, 0.99) / 1000.0,
+             hist_percentile(s->hist, count, 1.0) / 1000.0);
+    }
+
+    EMIT("\n%-12s %10s %10s %8s\n", "cache", "hits", "misses", "hit_pct");
+    for (int i = 0; i < STATS_NCACHES; i++)
+    {
+        uint64_t hits = __atomic_load_n(&cache_stats[i].hits, __ATOMIC_RELAXED);
+        uint64_t misses = __atomic_load_n(&cache_stats[i].misses, __ATOMIC_RELAXED);
+        EMIT("%-12s %10llu %10llu %8.1f\n", cache_names[i], (unsigned long long)hits,
+             (unsigned long long)misses,
+             hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+    }
+#undef EMIT
+
+    return n;
+}
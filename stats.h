@@ -0,0 +1,72 @@
+/*
+ * file:        stats.h
+ * description: per-operation counters and latency histograms for the
+ *              CS 5600 file system, readable at runtime via /.fsstats
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Everything we keep statistics for: the fs_ops entry points, and
+ * the block I/O layer underneath them.
+ */
+enum stats_op {
+    STATS_GETATTR,
+    STATS_READDIR,
+    STATS_CREATE,
+    STATS_MKDIR,
+    STATS_UNLINK,
+    STATS_RMDIR,
+    STATS_RENAME,
+    STATS_CHMOD,
+    STATS_UTIME,
+    STATS_TRUNCATE,
+    STATS_OPEN,
+    STATS_READ,
+    STATS_READ_BUF,
+    STATS_WRITE,
+    STATS_WRITE_BUF,
+    STATS_RELEASE,
+    STATS_STATFS,
+    STATS_IOCTL,
+    STATS_FALLOCATE,
+    STATS_FSYNC,
+    STATS_BLOCK_READ,
+    STATS_BLOCK_WRITE,
+    STATS_NOPS
+};
+
+/* The in-memory caches (see cache.h), for hit ratios. Inodes and
+ * directory blocks share one block cache but are counted apart.
+ */
+enum stats_cache {
+    STATS_CACHE_INODE,
+    STATS_CACHE_DENTRY,
+    STATS_CACHE_DIRBLOCK,
+    STATS_NCACHES
+};
+
+/* monotonic clock in nanoseconds */
+uint64_t stats_now(void);
+
+/* account for one call of 'op' that took 'ns' nanoseconds, moved
+ * 'bytes' bytes, and returned 'rv' (negative means error).
+ */
+void stats_record(enum stats_op op, uint64_t ns, size_t bytes, int rv);
+
+/* count a hit or a miss in cache 'c' */
+void stats_cache_access(enum stats_cache c, int hit);
+
+/* zero all counters */
+void stats_reset(void);
+
+/* render the statistics as text, snprintf-style: writes at most 'len'
+ * bytes to 'buf' (which may be NULL if len is 0) and returns the full
+ * length of the text.
+ */
+int stats_format(char *buf, size_t len);
+
+#endif
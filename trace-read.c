@@ -0,0 +1,141 @@
+/*
+ * file:        trace-read.c
+ * description: dump or follow the trace rings of a file system built
+ *              with 'make TRACE=1'. Records from all threads are merged
+ *              by timestamp.
+ *
+ * usage: ./trace-read [-f]
+ *   -f    keep polling and print new records as they arrive
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+static const char *op_names[] = {
+    [TR_BLOCK_READ] = "block_read",
+    [TR_BLOCK_WRITE] = "block_write",
+    [TR_LOOKUP] = "lookup",
+    [TR_ALLOC] = "alloc",
+    [TR_WRITE] = "write",
+    [TR_WRITE_BLOCK] = "write_block",
+    [TR_TRUNCATE] = "truncate",
+};
+
+static int cmp_rec(const void *a, const void *b)
+{
+    uint64_t x = ((const struct trace_rec *)a)->ts;
+    uint64_t y = ((const struct trace_rec *)b)->ts;
+    return (x > y) - (x < y);
+}
+
+static void print_rec(struct trace_rec *r)
+{
+    const char *name = r->op < TR_NOPS ? op_names[r->op] : "?";
+
+    printf("%llu.%09llu %6d %-12s inum=%d lba=%d off=%lld len=%u rv=%d dur_us=%.3f\n",
+           (unsigned long long)(r->ts / 1000000000ull),
+           (unsigned long long)(r->ts % 1000000000ull), r->tid, name,
+           r->inum, r->lba, (long long)r->off, r->len, r->rv, r->dur / 1000.0);
+}
+
+/* Copy out the records added to each ring since seen[i]. The writer
+ * never waits for us, so records it overwrote while we were copying
+ * are discarded by re-reading the head afterwards.
+ */
+static int collect(struct trace_shm *shm, uint64_t *seen, struct trace_rec *out)
+{
+    int n = 0;
+    uint32_t nrings = __atomic_load_n(&shm->next_ring, __ATOMIC_ACQUIRE);
+    if (nrings > TRACE_NRINGS)
+        nrings = TRACE_NRINGS;
+
+    for (uint32_t i = 0; i < nrings; i++)
+    {
+        struct trace_ring *ring = &shm->rings[i];
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = seen[i];
+        if (head - first > TRACE_RING_SIZE)
+            first = head - TRACE_RING_SIZE;
+
+        int start = n;
+        for (uint64_t j = first; j < head; j++)
+        {
+            out[n++] = ring->rec[j & (TRACE_RING_SIZE - 1)];
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint64_t head2 = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        if (head2 - first > TRACE_RING_SIZE)
+        {
+            /* drop the overwritten prefix */
+            uint64_t lost = head2 - TRACE_RING_SIZE - first;
+            if (lost > (uint64_t)(n - start))
+                lost = n - start;
+            memmove(&out[start], &out[start + lost], (n - start - lost) * sizeof(*out));
+            n -= lost;
+        }
+        seen[i] = head;
+    }
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    int c, follow = 0;
+    while ((c = getopt(argc, argv, "f")) != -1)
+    {
+        if (c == 'f')
+            follow = 1;
+        else
+        {
+            fprintf(stderr, "usage: %s [-f]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    int fd = shm_open(TRACE_SHM_NAME, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        perror("shm_open " TRACE_SHM_NAME " (is the file system built with TRACE=1?)");
+        exit(1);
+    }
+    struct trace_shm *shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != TRACE_MAGIC)
+    {
+        fprintf(stderr, "bad trace segment magic\n");
+        exit(1);
+    }
+
+    uint64_t seen[TRACE_NRINGS] = {0};
+    struct trace_rec *buf = malloc(sizeof(*buf) * TRACE_NRINGS * TRACE_RING_SIZE);
+
+    do
+    {
+        int n = collect(shm, seen, buf);
+        qsort(buf, n, sizeof(*buf), cmp_rec);
+        for (int i = 0; i < n; i++)
+            print_rec(&buf[i]);
+        fflush(stdout);
+        if (follow)
+            usleep(100000);
+    } while (follow);
+
+    if (shm->dropped)
+        fprintf(stderr, "%llu events dropped (more than %d threads)\n",
+                (unsigned long long)shm->dropped, TRACE_NRINGS);
+    free(buf);
+    return 0;
+}
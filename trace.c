@@ -0,0 +1,149 @@
+/*
+ * file:        trace.c
+ * description: per-thread lock-free trace rings in shared memory.
+ *              See trace.h; this file is empty unless FS_TRACE is set.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#ifdef FS_TRACE
+
+static struct trace_shm *shm;
+static __thread struct trace_ring *my_ring;
+static __thread int32_t my_tid;
+static int rings_live; // owned by threads of this process
+static pthread_key_t ring_key;
+
+uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* thread exit: give the ring back. Its records stay until they are
+ * overwritten, and carry their writer's tid, so trace-read still
+ * attributes them correctly.
+ */
+static void put_ring(void *arg)
+{
+    struct trace_ring *ring = arg;
+    __atomic_store_n(&ring->tid, 0, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&rings_live, 1, __ATOMIC_RELAXED);
+}
+
+/* Create the shared memory segment, emptying any left over from an
+ * earlier run. Tracing stays off if this fails.
+ */
+static void trace_setup(void)
+{
+    int fd = shm_open(TRACE_SHM_NAME, O_CREAT | O_RDWR, 0644);
+    if (fd < 0)
+    {
+        perror("trace: shm_open");
+        return;
+    }
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(*shm)) < 0)
+    {
+        perror("trace: ftruncate");
+        close(fd);
+        return;
+    }
+    void *p = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        perror("trace: mmap");
+        return;
+    }
+
+    struct trace_shm *s = p;
+    pthread_key_create(&ring_key, put_ring);
+    s->nrings = TRACE_NRINGS;
+    s->ring_size = TRACE_RING_SIZE;
+    __atomic_store_n(&s->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+    shm = s;
+}
+
+/* fs_init calls this on every mount, but the segment is only set up
+ * once per process: threads keep the ring they claimed in my_ring, so
+ * handing the rings out again after a remount would give one ring two
+ * writers.
+ */
+void trace_init(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, trace_setup);
+}
+
+/* claim a free ring for the calling thread, the first time it traces,
+ * or later if they were all taken then
+ */
+static struct trace_ring *get_ring(void)
+{
+    if (my_ring != NULL || shm == NULL)
+        return my_ring;
+    if (__atomic_load_n(&rings_live, __ATOMIC_RELAXED) >= TRACE_NRINGS)
+        return NULL;
+
+    if (my_tid == 0)
+        my_tid = syscall(SYS_gettid);
+    for (uint32_t i = 0; i < TRACE_NRINGS; i++)
+    {
+        int32_t free_tid = 0;
+        if (!__atomic_compare_exchange_n(&shm->rings[i].tid, &free_tid, my_tid, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+        __atomic_fetch_add(&rings_live, 1, __ATOMIC_RELAXED);
+        uint32_t n = __atomic_load_n(&shm->next_ring, __ATOMIC_RELAXED);
+        while (n <= i && !__atomic_compare_exchange_n(&shm->next_ring, &n, i + 1, 0,
+                                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        my_ring = &shm->rings[i];
+        pthread_setspecific(ring_key, my_ring);
+        return my_ring;
+    }
+    return NULL;
+}
+
+void trace_emit(enum trace_op op, int inum, int lba, int64_t off,
+                uint32_t len, int rv, uint64_t t0)
+{
+    struct trace_ring *ring = get_ring();
+    if (ring == NULL)
+    {
+        if (shm != NULL)
+            __atomic_fetch_add(&shm->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint64_t now = trace_now();
+    uint64_t head = ring->head;
+    struct trace_rec *r = &ring->rec[head & (TRACE_RING_SIZE - 1)];
+
+    r->ts = t0 ? t0 : now;
+    r->dur = t0 ? now - t0 : 0;
+    r->op = op;
+    r->inum = inum;
+    r->lba = lba;
+    r->off = off;
+    r->len = len;
+    r->rv = rv;
+    r->tid = my_tid;
+
+    /* publish: a reader that sees the new head sees the record */
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * file:        trace.h
+ * description: structured tracepoints for the CS 5600 file system
+ *
+ * Tracepoints are compiled in only when FS_TRACE is defined (build
+ * with 'make TRACE=1'); otherwise TRACE_START and TRACE expand to
+ * nothing and their arguments are never evaluated.
+ *
+ * When enabled, each thread appends fixed-size records to its own ring
+ * in a shared memory segment (TRACE_SHM_NAME). Every ring has a single
+ * writer, so appending is a plain store plus a release store of the
+ * head index - no locks, no system calls. A ring goes back to the pool
+ * when its thread exits, so FUSE starting and stopping worker threads
+ * doesn't use them up. Use trace-read to dump or follow the rings of a
+ * running mount.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+#define TRACE_SHM_NAME  "/fs5600-trace"
+#define TRACE_MAGIC     0x54524332      /* "TRC2" */
+#define TRACE_NRINGS    64              /* max threads traced at once */
+#define TRACE_RING_SIZE 2048            /* records per ring, power of 2 */
+
+enum trace_op {
+    TR_BLOCK_READ,      /* lba, len = bytes */
+    TR_BLOCK_WRITE,     /* lba, len = bytes */
+    TR_LOOKUP,          /* inum = directory, rv = child inode or error */
+    TR_ALLOC,           /* lba = block allocated */
+    TR_WRITE,           /* inum, off, len, rv */
+    TR_WRITE_BLOCK,     /* inum, lba, off = offset in block, len */
+    TR_TRUNCATE,        /* inum, off = new length, rv */
+    TR_NOPS
+};
+
+struct trace_rec {
+    uint64_t ts;        /* CLOCK_MONOTONIC, ns, at start of event */
+    int64_t  off;       /* file offset, if any */
+    uint32_t dur;       /* ns, 0 for instantaneous events */
+    uint16_t op;        /* enum trace_op */
+    uint16_t pad;
+    int32_t  inum;      /* -1 if not applicable */
+    int32_t  lba;       /* -1 if not applicable */
+    uint32_t len;
+    int32_t  rv;
+    int32_t  tid;       /* thread that wrote it */
+    uint32_t pad2;
+};
+
+struct trace_ring {
+    uint64_t head;      /* records ever written; written by owner only */
+    int32_t  tid;       /* owner, or 0 if free */
+    char     pad[52];   /* keep each ring's head on its own cache line */
+    struct trace_rec rec[TRACE_RING_SIZE];
+};
+
+struct trace_shm {
+    uint32_t magic;
+    uint32_t nrings;
+    uint32_t ring_size;
+    uint32_t next_ring; /* rings ever used; readers scan this many */
+    uint64_t dropped;   /* events from threads that didn't get a ring */
+    char     pad[40];
+    struct trace_ring rings[TRACE_NRINGS];
+};
+
+#ifdef FS_TRACE
+
+void trace_init(void);
+void trace_emit(enum trace_op op, int inum, int lba, int64_t off,
+                uint32_t len, int rv, uint64_t t0);
+uint64_t trace_now(void);
+
+/* TRACE_START(t) declares a start timestamp for a TRACE(..., t) call
+ * further on; instantaneous events pass 0 instead.
+ */
+#define TRACE_START(t) uint64_t t = trace_now()
+#define TRACE(op, inum, lba, off, len, rv, t0) \
+    trace_emit(op, inum, lba, off, len, rv, t0)
+
+#else
+
+#define trace_init() ((void)0)
+#define TRACE_START(t)
+#define TRACE(op, inum, lba, off, len, rv, t0) ((void)0)
+
+#endif
+
+#endif
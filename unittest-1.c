@@ -27,8 +27,9 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 
+#include "disk.h"
+
 extern struct fuse_operations fs_ops;
-extern void block_init(char *file);
 
 /* Test data for files in test.img */
 struct test_file_info
@@ -335,6 +336,68 @@ START_TEST(test_read_errors)
 }
 END_TEST
 
+/* Copy a bufvec returned by read_buf into memory and free it, the
+ * same way FUSE does when replying
+ */
+static int read_buf_copy(const char *path, char *buf, size_t len, off_t offset)
+{
+    struct fuse_bufvec *bv = NULL;
+    int rv = fs_ops.read_buf(path, &bv, len, offset, NULL);
+    if (rv == 0)
+    {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+        dst.buf[0].mem = buf;
+        rv = fuse_buf_copy(&dst, bv, 0);
+    }
+    if (bv)
+    {
+        for (size_t i = 0; i < bv->count; i++)
+            free(bv->buf[i].mem);
+        free(bv);
+    }
+    return rv;
+}
+
+/* Tests for fs_read_buf */
+START_TEST(test_read_buf)
+{
+    int i;
+    char *buf;
+
+    for (i = 0; test_files[i].path != NULL; i++)
+    {
+        int size = test_files[i].size;
+        buf = malloc(size + 100);
+        memset(buf, 0xAA, size + 100);
+
+        int rv = read_buf_copy(test_files[i].path, buf, size + 50, 0);
+        ck_assert_msg(rv == size, "read_buf(%s) returned %d, expected %d",
+                      test_files[i].path, rv, size);
+
+        unsigned int cksum = crc32(0, (unsigned char *)buf, size);
+        ck_assert_msg(cksum == test_files[i].cksum,
+                      "Checksum mismatch for %s: got %u, expected %u",
+                      test_files[i].path, cksum, test_files[i].cksum);
+        ck_assert_int_eq((unsigned char)buf[size + 10], 0xAA);
+
+        free(buf);
+    }
+
+    /* Offset reads must match the copying read path */
+    char full_buf[12288], part_buf[12288];
+    int rv = fs_ops.read("/dir3/subdir/file.12k", full_buf, 12288, 0, NULL);
+    ck_assert_int_eq(rv, 12288);
+    rv = read_buf_copy("/dir3/subdir/file.12k", part_buf, 5000, 3000);
+    ck_assert_int_eq(rv, 5000);
+    ck_assert_int_eq(memcmp(full_buf + 3000, part_buf, 5000), 0);
+
+    rv = read_buf_copy("/file.10", part_buf, 100, 20);
+    ck_assert_int_eq(rv, 0);
+    rv = read_buf_copy("/dir2", part_buf, 100, 0);
+    ck_assert_int_eq(rv, -EISDIR);
+}
+END_TEST
+
 /* Test for fs_statfs */
 START_TEST(test_statfs)
 {
@@ -346,7 +409,7 @@ START_TEST(test_statfs)
     ck_assert_int_eq(st.f_blocks, 400);
     ck_assert_int_eq(st.f_bfree, 355);
     ck_assert_int_eq(st.f_bavail, 355);
-    ck_assert_int_eq(st.f_namemax, 27);
+    ck_assert_int_eq(st.f_namemax, 255);
 }
 END_TEST
 
@@ -426,13 +489,49 @@ START_TEST(test_rename)
 }
 END_TEST
 
+/* Test the synthetic statistics file */
+START_TEST(test_stats_file)
+{
+    struct stat sb;
+    char buf[8192];
+    int rv;
+
+    /* Make sure there is something to report */
+    rv = fs_ops.read("/file.1k", buf, 1000, 0, NULL);
+    ck_assert_int_eq(rv, 1000);
+
+    rv = fs_ops.getattr("/.fsstats", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert(S_ISREG(sb.st_mode));
+    ck_assert_int_eq(sb.st_mode & 0777, 0444);
+    ck_assert_int_gt(sb.st_size, 0);
+
+    rv = fs_ops.read("/.fsstats", buf, sizeof(buf) - 1, 0, NULL);
+    ck_assert_int_gt(rv, 0);
+    buf[rv] = '\0';
+    ck_assert_ptr_ne(strstr(buf, "\nread "), NULL);
+    ck_assert_ptr_ne(strstr(buf, "\nblock_read "), NULL);
+
+    /* Cache hit ratios follow the per-op table */
+    ck_assert_ptr_ne(strstr(buf, "\ncache "), NULL);
+    ck_assert_ptr_ne(strstr(buf, "\ninode "), NULL);
+    ck_assert_ptr_ne(strstr(buf, "\ndentry "), NULL);
+
+    /* Read-only */
+    rv = fs_ops.write("/.fsstats", buf, 10, 0, NULL);
+    ck_assert_int_eq(rv, -EACCES);
+    rv = fs_ops.truncate("/.fsstats", 0);
+    ck_assert_int_eq(rv, -EACCES);
+}
+END_TEST
+
 /* Main test runner */
 int main(int argc, char **argv)
 {
     /* Regenerate test disk each time */
     system("python gen-disk.py -q disk1.in test.img");
 
-    block_init("test.img");
+    disk_init("test.img");
     fs_ops.init(NULL);
 
     Suite *s = suite_create("fs5600_part1");
@@ -454,10 +553,12 @@ int main(int argc, char **argv)
     tcase_add_test(tc_read, test_read_partial);
     tcase_add_test(tc_read, test_read_offset);
     tcase_add_test(tc_read, test_read_errors);
+    tcase_add_test(tc_read, test_read_buf);
     suite_add_tcase(s, tc_read);
 
     TCase *tc_statfs = tcase_create("statfs");
     tcase_add_test(tc_statfs, test_statfs);
+    tcase_add_test(tc_statfs, test_stats_file);
     suite_add_tcase(s, tc_statfs);
 
     TCase *tc_modify = tcase_create("modify");
@@ -19,6 +19,14 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <utime.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <linux/falloc.h>
+#include <pthread.h>
+
+#include "fs5600.h"
+#include "disk.h"
+#include "cache.h"
 
 /* Mock fuse_get_context for testing */
 static struct fuse_context ctx = {.uid = 500, .gid = 500};
@@ -28,7 +36,9 @@ struct fuse_context *fuse_get_context(void)
 }
 
 extern struct fuse_operations fs_ops;
-extern void block_init(char *file);
+extern int fs_log_writes;
+extern int fs_kernel_cache;
+extern struct fs_super superblock;
 
 /* Helper function to create test data */
 static char *create_test_data(size_t size)
@@ -318,6 +328,1177 @@ START_TEST(test_utime)
 }
 END_TEST
 
+/* Test that small files live in the inode and convert when they grow */
+START_TEST(test_inline_file)
+{
+    int rv;
+    struct stat sb;
+    struct statvfs st_before, st;
+    char *test_data = create_test_data(6000);
+    char read_buffer[6000];
+
+    rv = fs_ops.statfs("/", &st_before);
+    ck_assert_int_eq(rv, 0);
+
+    rv = fs_ops.create("/inlinefile", 0644 | S_IFREG, NULL);
+    ck_assert_int_eq(rv, 0);
+
+    /* A tiny file only costs its inode block */
+    rv = fs_ops.write("/inlinefile", test_data, 10, 0, NULL);
+    ck_assert_int_eq(rv, 10);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 1);
+
+    rv = fs_ops.read("/inlinefile", read_buffer, 100, 0, NULL);
+    ck_assert_int_eq(rv, 10);
+    ck_assert_int_eq(memcmp(test_data, read_buffer, 10), 0);
+
+    /* Growing past the inline limit moves the data out to blocks */
+    rv = fs_ops.write("/inlinefile", test_data + 10, 5990, 10, NULL);
+    ck_assert_int_eq(rv, 5990);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 3);
+
+    rv = fs_ops.getattr("/inlinefile", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sb.st_size, 6000);
+    rv = fs_ops.read("/inlinefile", read_buffer, 6000, 0, NULL);
+    ck_assert_int_eq(rv, 6000);
+    ck_assert_int_eq(memcmp(test_data, read_buffer, 6000), 0);
+
+    /* Truncating frees the blocks, and the file is inline again */
+    rv = fs_ops.truncate("/inlinefile", 0);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.write("/inlinefile", test_data, 100, 0, NULL);
+    ck_assert_int_eq(rv, 100);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 1);
+
+    rv = fs_ops.unlink("/inlinefile");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree);
+
+    free(test_data);
+}
+END_TEST
+
+/* Test that small file tails are packed together into shared blocks */
+START_TEST(test_tail_packing)
+{
+    int rv;
+    char path[100];
+    struct statvfs st_before, st;
+    char *test_data = create_test_data(5096);
+    char read_buffer[6000];
+
+    rv = fs_ops.statfs("/", &st_before);
+    ck_assert_int_eq(rv, 0);
+
+    /* Four files of one full block plus a 1000-byte tail */
+    for (int i = 0; i < 4; i++)
+    {
+        sprintf(path, "/tailfile%d", i);
+        rv = fs_ops.create(path, 0644 | S_IFREG, NULL);
+        ck_assert_int_eq(rv, 0);
+        rv = fs_ops.write(path, test_data, 5096, 0, NULL);
+        ck_assert_int_eq(rv, 5096);
+        rv = fs_ops.release(path, NULL);
+        ck_assert_int_eq(rv, 0);
+    }
+
+    /* 4 inodes + 4 full blocks + 1 shared tail block + fragment table */
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 10);
+
+    for (int i = 0; i < 4; i++)
+    {
+        sprintf(path, "/tailfile%d", i);
+        memset(read_buffer, 0, sizeof(read_buffer));
+        rv = fs_ops.read(path, read_buffer, sizeof(read_buffer), 0, NULL);
+        ck_assert_int_eq(rv, 5096);
+        ck_assert_int_eq(memcmp(test_data, read_buffer, 5096), 0);
+    }
+
+    /* Appending to a packed file moves its tail back out */
+    rv = fs_ops.write("/tailfile1", test_data, 10, 5096, NULL);
+    ck_assert_int_eq(rv, 10);
+    rv = fs_ops.read("/tailfile1", read_buffer, sizeof(read_buffer), 0, NULL);
+    ck_assert_int_eq(rv, 5106);
+    ck_assert_int_eq(memcmp(test_data, read_buffer, 5096), 0);
+    ck_assert_int_eq(memcmp(test_data, read_buffer + 5096, 10), 0);
+    rv = fs_ops.read("/tailfile2", read_buffer, sizeof(read_buffer), 0, NULL);
+    ck_assert_int_eq(rv, 5096);
+    ck_assert_int_eq(memcmp(test_data, read_buffer, 5096), 0);
+
+    /* A file open twice is packed - into the room tailfile1 left -
+     * when the second handle is closed, not the first
+     */
+    struct fuse_file_info fi1 = {.flags = O_RDWR}, fi2 = {.flags = O_RDWR};
+    struct statvfs st_open;
+    rv = fs_ops.create("/tailshared", 0644 | S_IFREG, &fi1);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.open("/tailshared", &fi2);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.write("/tailshared", test_data, 5096, 0, &fi1);
+    ck_assert_int_eq(rv, 5096);
+    rv = fs_ops.statfs("/", &st_open);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.release("/tailshared", &fi1);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_open.f_bfree);
+    rv = fs_ops.release("/tailshared", &fi2);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_open.f_bfree + 1);
+    rv = fs_ops.read("/tailshared", read_buffer, sizeof(read_buffer), 0, NULL);
+    ck_assert_int_eq(rv, 5096);
+    ck_assert_int_eq(memcmp(test_data, read_buffer, 5096), 0);
+    rv = fs_ops.unlink("/tailshared");
+    ck_assert_int_eq(rv, 0);
+
+    /* A file removed while still open leaves no handle count for the
+     * next file to be given its inode
+     */
+    rv = fs_ops.create("/tailgone", 0644 | S_IFREG, &fi1);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.unlink("/tailgone");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.create("/tailshared", 0644 | S_IFREG, &fi2);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.write("/tailshared", test_data, 5096, 0, &fi2);
+    ck_assert_int_eq(rv, 5096);
+    rv = fs_ops.statfs("/", &st_open);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.release("/tailshared", &fi2);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_open.f_bfree + 1);
+    rv = fs_ops.unlink("/tailshared");
+    ck_assert_int_eq(rv, 0);
+
+    /* Only the fragment table is left once all the files are gone */
+    for (int i = 0; i < 4; i++)
+    {
+        sprintf(path, "/tailfile%d", i);
+        rv = fs_ops.unlink(path);
+        ck_assert_int_eq(rv, 0);
+    }
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 1);
+
+    free(test_data);
+}
+END_TEST
+
+/* Test writing through write_buf, both inline and block-mapped */
+START_TEST(test_write_buf)
+{
+    int rv;
+    char *test_data = create_test_data(9000);
+    char read_buffer[9000];
+
+    rv = fs_ops.create("/writebuf", 0644 | S_IFREG, NULL);
+    ck_assert_int_eq(rv, 0);
+
+    /* Small enough to stay inline */
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(100);
+    src.buf[0].mem = test_data;
+    rv = fs_ops.write_buf("/writebuf", &src, 0, NULL);
+    ck_assert_int_eq(rv, 100);
+
+    /* Grows the file out of the inode and across block boundaries */
+    src = (struct fuse_bufvec)FUSE_BUFVEC_INIT(8900);
+    src.buf[0].mem = test_data + 100;
+    rv = fs_ops.write_buf("/writebuf", &src, 100, NULL);
+    ck_assert_int_eq(rv, 8900);
+
+    rv = fs_ops.read("/writebuf", read_buffer, 9000, 0, NULL);
+    ck_assert_int_eq(rv, 9000);
+    ck_assert_int_eq(memcmp(test_data, read_buffer, 9000), 0);
+
+    /* Overwrite in the middle of a block */
+    src = (struct fuse_bufvec)FUSE_BUFVEC_INIT(10);
+    src.buf[0].mem = "0123456789";
+    rv = fs_ops.write_buf("/writebuf", &src, 5000, NULL);
+    ck_assert_int_eq(rv, 10);
+    memcpy(test_data + 5000, "0123456789", 10);
+
+    rv = fs_ops.read("/writebuf", read_buffer, 9000, 0, NULL);
+    ck_assert_int_eq(rv, 9000);
+    ck_assert_int_eq(memcmp(test_data, read_buffer, 9000), 0);
+
+    free(test_data);
+}
+END_TEST
+
+/* Test sparse files: holes aren't allocated and read back as zeros */
+START_TEST(test_sparse_file)
+{
+    int rv;
+    struct statvfs st_before, st;
+    struct stat sb;
+    char *test_data = create_test_data(100);
+    char read_buffer[5 * 4096];
+    int64_t off;
+
+    rv = fs_ops.create("/sparse", 0644 | S_IFREG, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.statfs("/", &st_before);
+    ck_assert_int_eq(rv, 0);
+
+    /* 100 bytes in block 3; blocks 0-2 are holes */
+    rv = fs_ops.write("/sparse", test_data, 100, 3 * 4096 + 50, NULL);
+    ck_assert_int_eq(rv, 100);
+
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 1);
+
+    rv = fs_ops.getattr("/sparse", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sb.st_size, 3 * 4096 + 150);
+    ck_assert_int_eq(sb.st_blocks, 4096 / 512);
+
+    memset(read_buffer, 0xAA, sizeof(read_buffer));
+    rv = fs_ops.read("/sparse", read_buffer, sizeof(read_buffer), 0, NULL);
+    ck_assert_int_eq(rv, 3 * 4096 + 150);
+    for (int i = 0; i < 3 * 4096 + 50; i++)
+        ck_assert_int_eq(read_buffer[i], 0);
+    ck_assert_int_eq(memcmp(read_buffer + 3 * 4096 + 50, test_data, 100), 0);
+
+    /* read_buf hands out zero-filled memory for the holes */
+    struct fuse_bufvec *bv = NULL;
+    rv = fs_ops.read_buf("/sparse", &bv, sizeof(read_buffer), 0, NULL);
+    ck_assert_int_eq(rv, 0);
+    memset(read_buffer, 0xAA, sizeof(read_buffer));
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(sizeof(read_buffer));
+    dst.buf[0].mem = read_buffer;
+    rv = fuse_buf_copy(&dst, bv, 0);
+    ck_assert_int_eq(rv, 3 * 4096 + 150);
+    for (int i = 0; i < 3 * 4096 + 50; i++)
+        ck_assert_int_eq(read_buffer[i], 0);
+    ck_assert_int_eq(memcmp(read_buffer + 3 * 4096 + 50, test_data, 100), 0);
+    for (size_t i = 0; i < bv->count; i++)
+        free(bv->buf[i].mem);
+    free(bv);
+
+    /* SEEK_DATA / SEEK_HOLE */
+    off = 0;
+    rv = fs_ops.ioctl("/sparse", FS_IOC_SEEK_DATA, NULL, NULL, 0, &off);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(off, 3 * 4096);
+    off = 10;
+    rv = fs_ops.ioctl("/sparse", FS_IOC_SEEK_HOLE, NULL, NULL, 0, &off);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(off, 10);
+    off = 3 * 4096;
+    rv = fs_ops.ioctl("/sparse", FS_IOC_SEEK_HOLE, NULL, NULL, 0, &off);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(off, 3 * 4096 + 150);
+    off = 3 * 4096 + 150;
+    rv = fs_ops.ioctl("/sparse", FS_IOC_SEEK_DATA, NULL, NULL, 0, &off);
+    ck_assert_int_eq(rv, -ENXIO);
+
+    /* Filling in a hole allocates just that block */
+    rv = fs_ops.write("/sparse", test_data, 100, 4096, NULL);
+    ck_assert_int_eq(rv, 100);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 2);
+    rv = fs_ops.read("/sparse", read_buffer, 200, 4000, NULL);
+    ck_assert_int_eq(rv, 200);
+    for (int i = 0; i < 96; i++)
+        ck_assert_int_eq(read_buffer[i], 0);
+    ck_assert_int_eq(memcmp(read_buffer + 96, test_data, 100), 0);
+
+    rv = fs_ops.unlink("/sparse");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree + 1);
+
+    free(test_data);
+}
+END_TEST
+
+/* Test truncating to, and extending to, arbitrary lengths */
+START_TEST(test_truncate_length)
+{
+    int rv;
+    struct statvfs st_before, st;
+    char *test_data = create_test_data(14000);
+    char read_buffer[20000];
+
+    rv = fs_ops.create("/trunclen", 0644 | S_IFREG, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.statfs("/", &st_before);
+    ck_assert_int_eq(rv, 0);
+
+    /* Extending an inline file zero-fills it */
+    rv = fs_ops.write("/trunclen", test_data, 100, 0, NULL);
+    ck_assert_int_eq(rv, 100);
+    rv = fs_ops.truncate("/trunclen", 50);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.truncate("/trunclen", 200);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.read("/trunclen", read_buffer, sizeof(read_buffer), 0, NULL);
+    ck_assert_int_eq(rv, 200);
+    ck_assert_int_eq(memcmp(read_buffer, test_data, 50), 0);
+    for (int i = 50; i < 200; i++)
+        ck_assert_int_eq(read_buffer[i], 0);
+
+    /* 14000 bytes = 4 blocks; cutting to 5000 frees two */
+    rv = fs_ops.write("/trunclen", test_data, 14000, 0, NULL);
+    ck_assert_int_eq(rv, 14000);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 4);
+
+    rv = fs_ops.truncate("/trunclen", 5000);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 2);
+    rv = fs_ops.read("/trunclen", read_buffer, sizeof(read_buffer), 0, NULL);
+    ck_assert_int_eq(rv, 5000);
+    ck_assert_int_eq(memcmp(read_buffer, test_data, 5000), 0);
+
+    /* Growing again is sparse, and the old data past 5000 is gone */
+    rv = fs_ops.truncate("/trunclen", 20000);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 2);
+    rv = fs_ops.read("/trunclen", read_buffer, sizeof(read_buffer), 0, NULL);
+    ck_assert_int_eq(rv, 20000);
+    ck_assert_int_eq(memcmp(read_buffer, test_data, 5000), 0);
+    for (int i = 5000; i < 20000; i++)
+        ck_assert_int_eq(read_buffer[i], 0);
+
+    /* A packed tail that is cut off entirely is just dropped */
+    rv = fs_ops.truncate("/trunclen", 5000);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.release("/trunclen", NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.truncate("/trunclen", 4096);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.read("/trunclen", read_buffer, sizeof(read_buffer), 0, NULL);
+    ck_assert_int_eq(rv, 4096);
+    ck_assert_int_eq(memcmp(read_buffer, test_data, 4096), 0);
+
+    rv = fs_ops.truncate("/trunclen", 0);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.unlink("/trunclen");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree + 1);
+
+    free(test_data);
+}
+END_TEST
+
+/* Test rename across directories, with replacement and loop checks */
+START_TEST(test_rename_move)
+{
+    int rv;
+    struct stat sb;
+    struct statvfs st_before, st;
+    char *test_data = create_test_data(5000);
+    char read_buffer[6000];
+
+    ck_assert_int_eq(fs_ops.mkdir("/mvsrc", 0755), 0);
+    ck_assert_int_eq(fs_ops.mkdir("/mvdst", 0755), 0);
+    ck_assert_int_eq(fs_ops.create("/mvsrc/f", 0644 | S_IFREG, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/mvsrc/f", test_data, 5000, 0, NULL), 5000);
+
+    /* Move a file to another directory, under a new name */
+    rv = fs_ops.rename("/mvsrc/f", "/mvdst/g");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/mvsrc/f", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+    rv = fs_ops.read("/mvdst/g", read_buffer, sizeof(read_buffer), 0, NULL);
+    ck_assert_int_eq(rv, 5000);
+    ck_assert_int_eq(memcmp(read_buffer, test_data, 5000), 0);
+
+    /* Replace an existing file; its inode and blocks are freed */
+    ck_assert_int_eq(fs_ops.create("/mvdst/h", 0644 | S_IFREG, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/mvdst/h", test_data + 1, 4500, 0, NULL), 4500);
+    rv = fs_ops.statfs("/", &st_before);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.rename("/mvdst/g", "/mvdst/h");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree + 3);
+    rv = fs_ops.getattr("/mvdst/g", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+    rv = fs_ops.read("/mvdst/h", read_buffer, sizeof(read_buffer), 0, NULL);
+    ck_assert_int_eq(rv, 5000);
+    ck_assert_int_eq(memcmp(read_buffer, test_data, 5000), 0);
+
+    /* Renaming a file onto itself does nothing */
+    rv = fs_ops.rename("/mvdst/h", "/mvdst/h");
+    ck_assert_int_eq(rv, 0);
+
+    /* Move a directory, contents and all */
+    ck_assert_int_eq(fs_ops.mkdir("/mvsrc/sub", 0755), 0);
+    ck_assert_int_eq(fs_ops.create("/mvsrc/sub/x", 0644 | S_IFREG, NULL), 0);
+    rv = fs_ops.rename("/mvsrc/sub", "/mvdst/sub");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/mvdst/sub/x", &sb);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/mvsrc/sub", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+
+    /* Not into itself or its own subdirectory */
+    rv = fs_ops.rename("/mvdst", "/mvdst/sub/loop");
+    ck_assert_int_eq(rv, -EINVAL);
+    rv = fs_ops.rename("/mvdst/sub", "/mvdst/sub/loop");
+    ck_assert_int_eq(rv, -EINVAL);
+
+    /* File and directory can't replace each other */
+    rv = fs_ops.rename("/mvdst/h", "/mvdst/sub");
+    ck_assert_int_eq(rv, -EISDIR);
+    rv = fs_ops.rename("/mvdst/sub", "/mvdst/h");
+    ck_assert_int_eq(rv, -ENOTDIR);
+
+    /* A directory can replace an empty directory only */
+    ck_assert_int_eq(fs_ops.mkdir("/mvsrc/full", 0755), 0);
+    ck_assert_int_eq(fs_ops.create("/mvsrc/full/y", 0644 | S_IFREG, NULL), 0);
+    ck_assert_int_eq(fs_ops.mkdir("/mvsrc/empty", 0755), 0);
+    rv = fs_ops.rename("/mvdst/sub", "/mvsrc/full");
+    ck_assert_int_eq(rv, -ENOTEMPTY);
+    rv = fs_ops.rename("/mvdst/sub", "/mvsrc/empty");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/mvsrc/empty/x", &sb);
+    ck_assert_int_eq(rv, 0);
+
+    /* Missing source, or missing destination directory */
+    rv = fs_ops.rename("/mvsrc/nothere", "/mvdst/z");
+    ck_assert_int_eq(rv, -ENOENT);
+    rv = fs_ops.rename("/mvdst/h", "/nodir/z");
+    ck_assert_int_eq(rv, -ENOENT);
+
+    free(test_data);
+}
+END_TEST
+
+/* Test fallocate: preallocation, KEEP_SIZE and PUNCH_HOLE */
+START_TEST(test_fallocate)
+{
+    int rv;
+    struct statvfs st_before, st;
+    struct stat sb;
+    char *test_data = create_test_data(100);
+    char read_buffer[8 * 4096];
+
+    rv = fs_ops.create("/falloc", 0644 | S_IFREG, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.statfs("/", &st_before);
+    ck_assert_int_eq(rv, 0);
+
+    /* Unsupported modes and bad ranges */
+    rv = fs_ops.fallocate("/falloc", FALLOC_FL_PUNCH_HOLE, 0, 4096, NULL);
+    ck_assert_int_eq(rv, -EOPNOTSUPP);
+    rv = fs_ops.fallocate("/falloc", FALLOC_FL_ZERO_RANGE, 0, 4096, NULL);
+    ck_assert_int_eq(rv, -EOPNOTSUPP);
+    rv = fs_ops.fallocate("/falloc", 0, 0, 0, NULL);
+    ck_assert_int_eq(rv, -EINVAL);
+    rv = fs_ops.fallocate("/falloc", 0, 0, 11 * 4096, NULL);
+    ck_assert_int_eq(rv, -EFBIG);
+
+    /* Five blocks, which extend the file and read back as zeros */
+    rv = fs_ops.fallocate("/falloc", 0, 0, 5 * 4096, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/falloc", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sb.st_size, 5 * 4096);
+    ck_assert_int_eq(sb.st_blocks, 5 * 4096 / 512);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 5);
+
+    memset(read_buffer, 0xAA, sizeof(read_buffer));
+    rv = fs_ops.read("/falloc", read_buffer, sizeof(read_buffer), 0, NULL);
+    ck_assert_int_eq(rv, 5 * 4096);
+    for (int i = 0; i < 5 * 4096; i++)
+        ck_assert_int_eq(read_buffer[i], 0);
+
+    /* A partial write into a preallocated block leaves zeros around it */
+    rv = fs_ops.write("/falloc", test_data, 100, 4096 + 10, NULL);
+    ck_assert_int_eq(rv, 100);
+    rv = fs_ops.read("/falloc", read_buffer, 4096, 4096, NULL);
+    ck_assert_int_eq(rv, 4096);
+    for (int i = 0; i < 10; i++)
+        ck_assert_int_eq(read_buffer[i], 0);
+    ck_assert_int_eq(memcmp(read_buffer + 10, test_data, 100), 0);
+    for (int i = 110; i < 4096; i++)
+        ck_assert_int_eq(read_buffer[i], 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 5);
+
+    /* KEEP_SIZE allocates past EOF without changing the size */
+    rv = fs_ops.fallocate("/falloc", FALLOC_FL_KEEP_SIZE, 5 * 4096, 2 * 4096, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/falloc", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sb.st_size, 5 * 4096);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 7);
+
+    /* Punching block 1 frees it; a partial punch zeroes in place */
+    rv = fs_ops.fallocate("/falloc", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          4096, 4096, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 6);
+    rv = fs_ops.read("/falloc", read_buffer, 4096, 4096, NULL);
+    ck_assert_int_eq(rv, 4096);
+    for (int i = 0; i < 4096; i++)
+        ck_assert_int_eq(read_buffer[i], 0);
+
+    rv = fs_ops.write("/falloc", test_data, 100, 2 * 4096, NULL);
+    ck_assert_int_eq(rv, 100);
+    rv = fs_ops.fallocate("/falloc", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          2 * 4096 + 10, 20, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.read("/falloc", read_buffer, 100, 2 * 4096, NULL);
+    ck_assert_int_eq(rv, 100);
+    ck_assert_int_eq(memcmp(read_buffer, test_data, 10), 0);
+    for (int i = 10; i < 30; i++)
+        ck_assert_int_eq(read_buffer[i], 0);
+    ck_assert_int_eq(memcmp(read_buffer + 30, test_data + 30, 70), 0);
+
+    /* Everything, including the blocks past EOF, goes on unlink */
+    rv = fs_ops.unlink("/falloc");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree + 1);
+
+    free(test_data);
+}
+END_TEST
+
+/* Helper callback that just counts entries other than . and .. */
+static int count_readdir_callback(void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+    if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+        (*(int *)buf)++;
+    return 0;
+}
+
+/* Test variable-length directory entries: long names, and packing
+ * many short names into a directory block
+ */
+START_TEST(test_long_names)
+{
+    int rv, count = 0;
+    struct stat sb;
+    struct statvfs st_before, st;
+    char path[300], name[260];
+
+    ck_assert_int_eq(fs_ops.mkdir("/longdir", 0755), 0);
+
+    /* The longest legal name works, one more byte does not */
+    memset(name, 'n', 255);
+    name[255] = 0;
+    sprintf(path, "/longdir/%s", name);
+    rv = fs_ops.create(path, 0644 | S_IFREG, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr(path, &sb);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.write(path, "hello", 5, 0, NULL);
+    ck_assert_int_eq(rv, 5);
+
+    strcat(path, "x");
+    rv = fs_ops.create(path, 0644 | S_IFREG, NULL);
+    ck_assert_int_eq(rv, -ENAMETOOLONG);
+    rv = fs_ops.mkdir(path, 0755);
+    ck_assert_int_eq(rv, -ENAMETOOLONG);
+    rv = fs_ops.getattr(path, &sb);
+    ck_assert_int_eq(rv, -ENAMETOOLONG);
+
+    /* A name that differs only past the old 27-byte limit is distinct */
+    name[100] = 'm';
+    sprintf(path, "/longdir/%s", name);
+    rv = fs_ops.getattr(path, &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+    rv = fs_ops.rename("/longdir/x", path);
+    ck_assert_int_eq(rv, -ENOENT);
+
+    /* 200 short names (12-byte entries) fit in the directory's first block */
+    rv = fs_ops.statfs("/", &st_before);
+    ck_assert_int_eq(rv, 0);
+    for (int i = 0; i < 200; i++)
+    {
+        sprintf(path, "/longdir/s%d", i);
+        ck_assert_int_eq(fs_ops.create(path, 0644 | S_IFREG, NULL), 0);
+    }
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 200);
+
+    rv = fs_ops.readdir("/longdir", &count, count_readdir_callback, 0, NULL);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(count, 201);
+
+    /* Freed space is reused, and a removed name is gone */
+    ck_assert_int_eq(fs_ops.unlink("/longdir/s10"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/longdir/s11"), 0);
+    rv = fs_ops.getattr("/longdir/s10", &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+    rv = fs_ops.getattr("/longdir/s12", &sb);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.rename("/longdir/s12", "/longdir/renamed-to-a-longer-name");
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/longdir/renamed-to-a-longer-name", &sb);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.getattr("/longdir/s199", &sb);
+    ck_assert_int_eq(rv, 0);
+}
+END_TEST
+
+/* Test files written block by block in alternation, and their
+ * block reservations */
+START_TEST(test_interleaved_writes)
+{
+    struct statvfs st_before, st;
+    char *test_data = create_test_data(4 * 4096);
+    char buf[4 * 4096];
+    int rv;
+
+    rv = fs_ops.statfs("/", &st_before);
+    ck_assert_int_eq(rv, 0);
+
+    ck_assert_int_eq(fs_ops.create("/ileave1", 0644 | S_IFREG, NULL), 0);
+    ck_assert_int_eq(fs_ops.create("/ileave2", 0644 | S_IFREG, NULL), 0);
+
+    /* one block at a time, alternating between the files */
+    for (int i = 0; i < 4; i++)
+    {
+        rv = fs_ops.write("/ileave1", test_data + i * 4096, 4096, i * 4096, NULL);
+        ck_assert_int_eq(rv, 4096);
+        rv = fs_ops.write("/ileave2", test_data + (3 - i) * 4096, 4096, i * 4096, NULL);
+        ck_assert_int_eq(rv, 4096);
+    }
+
+    /* blocks still reserved for the files count as free */
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 2 - 8);
+
+    /* and after a crash - a mount without an unmount - they are free
+     * on disk too
+     */
+    fs_ops.init(NULL);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 2 - 8);
+
+    ck_assert_int_eq(fs_ops.release("/ileave1", NULL), 0);
+    ck_assert_int_eq(fs_ops.release("/ileave2", NULL), 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 2 - 8);
+
+    rv = fs_ops.read("/ileave1", buf, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, sizeof(buf));
+    ck_assert(memcmp(buf, test_data, sizeof(buf)) == 0);
+    rv = fs_ops.read("/ileave2", buf, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, sizeof(buf));
+    for (int i = 0; i < 4; i++)
+        ck_assert(memcmp(buf + i * 4096, test_data + (3 - i) * 4096, 4096) == 0);
+
+    /* a file removed while it still holds a reservation gives it all back */
+    ck_assert_int_eq(fs_ops.write("/ileave1", test_data, 100, 4 * 4096, NULL), 100);
+    ck_assert_int_eq(fs_ops.unlink("/ileave1"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/ileave2"), 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree);
+
+    free(test_data);
+}
+END_TEST
+
+/* Test free space accounting as blocks are freed in scattered pieces
+ * and taken again as one run */
+START_TEST(test_free_extents)
+{
+    struct statvfs st_before, st;
+    char *test_data = create_test_data(2 * 4096);
+    char path[32], buf[4096];
+    int rv;
+
+    rv = fs_ops.statfs("/", &st_before);
+    ck_assert_int_eq(rv, 0);
+
+    for (int i = 0; i < 8; i++)
+    {
+        sprintf(path, "/fext%d", i);
+        ck_assert_int_eq(fs_ops.create(path, 0644 | S_IFREG, NULL), 0);
+        ck_assert_int_eq(fs_ops.write(path, test_data, 2 * 4096, 0, NULL), 2 * 4096);
+        ck_assert_int_eq(fs_ops.release(path, NULL), 0);
+    }
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 8 * 3);
+
+    /* leave holes of three blocks each */
+    for (int i = 1; i < 8; i += 2)
+    {
+        sprintf(path, "/fext%d", i);
+        ck_assert_int_eq(fs_ops.unlink(path), 0);
+    }
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 4 * 3);
+
+    ck_assert_int_eq(fs_ops.create("/fextbig", 0644 | S_IFREG, NULL), 0);
+    rv = fs_ops.fallocate("/fextbig", 0, 0, 10 * 4096, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 4 * 3 - 11);
+    rv = fs_ops.read("/fextbig", buf, sizeof(buf), 9 * 4096, NULL);
+    ck_assert_int_eq(rv, sizeof(buf));
+    for (int j = 0; j < (int)sizeof(buf); j++)
+        ck_assert_int_eq(buf[j], 0);
+
+    for (int i = 0; i < 8; i += 2)
+    {
+        sprintf(path, "/fext%d", i);
+        rv = fs_ops.read(path, buf, sizeof(buf), 4096, NULL);
+        ck_assert_int_eq(rv, sizeof(buf));
+        ck_assert(memcmp(buf, test_data + 4096, sizeof(buf)) == 0);
+        ck_assert_int_eq(fs_ops.unlink(path), 0);
+    }
+    ck_assert_int_eq(fs_ops.unlink("/fextbig"), 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree);
+
+    free(test_data);
+}
+END_TEST
+
+/* Test overwrites in log mode: the data must read back the same,
+ * however often blocks move */
+START_TEST(test_log_writes)
+{
+    struct statvfs st_before, st;
+    char *test_data = create_test_data(10 * 4096);
+    char *expect = malloc(10 * 4096);
+    char expect2[4 * 4096];
+    char buf[10 * 4096];
+    char chunk[100];
+    int rv;
+
+    fs_log_writes = 1;
+    ck_assert_int_eq(fs_ops.create("/logfile", 0644 | S_IFREG, NULL), 0);
+    rv = fs_ops.write("/logfile", test_data, 10 * 4096, 0, NULL);
+    ck_assert_int_eq(rv, 10 * 4096);
+    ck_assert_int_eq(fs_ops.release("/logfile", NULL), 0);
+    memcpy(expect, test_data, 10 * 4096);
+
+    /* a second file, so the cleaner has other files' blocks to move */
+    ck_assert_int_eq(fs_ops.create("/logfile2", 0644 | S_IFREG, NULL), 0);
+    rv = fs_ops.write("/logfile2", test_data, 4 * 4096, 0, NULL);
+    ck_assert_int_eq(rv, 4 * 4096);
+    ck_assert_int_eq(fs_ops.release("/logfile2", NULL), 0);
+    memcpy(expect2, test_data, 4 * 4096);
+
+    /* fill most of the disk, so the log runs short of free runs and
+     * has to clean */
+    int nfill = 0;
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    for (; st.f_bfree > 40; nfill++)
+    {
+        char path[32];
+        sprintf(path, "/logfill%d", nfill);
+        ck_assert_int_eq(fs_ops.create(path, 0644 | S_IFREG, NULL), 0);
+        rv = fs_ops.write(path, test_data, 4 * 4096, 0, NULL);
+        ck_assert_int_eq(rv, 4 * 4096);
+        ck_assert_int_eq(fs_ops.release(path, NULL), 0);
+        ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    }
+
+    rv = fs_ops.statfs("/", &st_before);
+    ck_assert_int_eq(rv, 0);
+
+    srandom(5600);
+    for (int i = 0; i < 500; i++)
+    {
+        int len = 1 + random() % sizeof(chunk);
+        off_t off = random() % (10 * 4096 - len);
+        for (int j = 0; j < len; j++)
+            chunk[j] = random();
+        if (i % 4 == 0)
+        {
+            off %= 4 * 4096 - len;
+            memcpy(expect2 + off, chunk, len);
+            rv = fs_ops.write("/logfile2", chunk, len, off, NULL);
+            ck_assert_int_eq(rv, len);
+            continue;
+        }
+        memcpy(expect + off, chunk, len);
+        if (i % 10 == 0)
+        {
+            struct fuse_bufvec bv = FUSE_BUFVEC_INIT(len);
+            bv.buf[0].mem = chunk;
+            rv = fs_ops.write_buf("/logfile", &bv, off, NULL);
+        }
+        else
+            rv = fs_ops.write("/logfile", chunk, len, off, NULL);
+        ck_assert_int_eq(rv, len);
+    }
+
+    rv = fs_ops.read("/logfile", buf, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, sizeof(buf));
+    ck_assert(memcmp(buf, expect, sizeof(buf)) == 0);
+    rv = fs_ops.read("/logfile2", buf, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, sizeof(expect2));
+    ck_assert(memcmp(buf, expect2, sizeof(expect2)) == 0);
+
+    /* read_buf doesn't hand FUSE image ranges the log may move */
+    struct fuse_bufvec *rbv = NULL;
+    rv = fs_ops.read_buf("/logfile", &rbv, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(rbv->count, 1);
+    ck_assert(!(rbv->buf[0].flags & FUSE_BUF_IS_FD));
+    ck_assert_int_eq(rbv->buf[0].size, sizeof(buf));
+    ck_assert(memcmp(rbv->buf[0].mem, expect, sizeof(buf)) == 0);
+    free(rbv->buf[0].mem);
+    free(rbv);
+
+    /* the log's unused blocks count as free, as reservations do */
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree);
+
+    ck_assert_int_eq(fs_ops.unlink("/logfile"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/logfile2"), 0);
+    for (int i = 0; i < nfill; i++)
+    {
+        char path[32];
+        sprintf(path, "/logfill%d", i);
+        ck_assert_int_eq(fs_ops.unlink(path), 0);
+    }
+    fs_log_writes = 0;
+    free(test_data);
+    free(expect);
+}
+END_TEST
+
+/* Test that a write changing only the times leaves the inode to be
+ * written later, and when that happens. A remount without destroy
+ * stands in for a crash.
+ */
+START_TEST(test_lazytime)
+{
+    struct utimbuf ut = {.actime = 1000, .modtime = 1000};
+    struct stat sb;
+    char *test_data = create_test_data(8000);
+
+    ck_assert_int_eq(fs_ops.create("/lazyfile", 0644 | S_IFREG, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/lazyfile", test_data, 8000, 0, NULL), 8000);
+    ck_assert_int_eq(fs_ops.release("/lazyfile", NULL), 0);
+
+    /* pending times are seen, but lost in a crash */
+    ck_assert_int_eq(fs_ops.utime("/lazyfile", &ut), 0);
+    ck_assert_int_eq(fs_ops.write("/lazyfile", test_data, 100, 10, NULL), 100);
+    ck_assert_int_eq(fs_ops.getattr("/lazyfile", &sb), 0);
+    ck_assert_int_ne(sb.st_mtime, 1000);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/lazyfile", &sb), 0);
+    ck_assert_int_eq(sb.st_mtime, 1000);
+
+    /* fsync, release and unmount write them */
+    ck_assert_int_eq(fs_ops.write("/lazyfile", test_data, 100, 10, NULL), 100);
+    ck_assert_int_eq(fs_ops.fsync("/lazyfile", 0, NULL), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/lazyfile", &sb), 0);
+    ck_assert_int_ne(sb.st_mtime, 1000);
+
+    ck_assert_int_eq(fs_ops.utime("/lazyfile", &ut), 0);
+    ck_assert_int_eq(fs_ops.write("/lazyfile", test_data, 100, 10, NULL), 100);
+    ck_assert_int_eq(fs_ops.release("/lazyfile", NULL), 0);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/lazyfile", &sb), 0);
+    ck_assert_int_ne(sb.st_mtime, 1000);
+
+    ck_assert_int_eq(fs_ops.utime("/lazyfile", &ut), 0);
+    ck_assert_int_eq(fs_ops.write("/lazyfile", test_data, 100, 10, NULL), 100);
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/lazyfile", &sb), 0);
+    ck_assert_int_ne(sb.st_mtime, 1000);
+
+    /* a write that grows the file writes the inode straight away */
+    ck_assert_int_eq(fs_ops.utime("/lazyfile", &ut), 0);
+    ck_assert_int_eq(fs_ops.write("/lazyfile", test_data, 100, 8000, NULL), 100);
+    fs_ops.init(NULL);
+    ck_assert_int_eq(fs_ops.getattr("/lazyfile", &sb), 0);
+    ck_assert_int_ne(sb.st_mtime, 1000);
+    ck_assert_int_eq(sb.st_size, 8100);
+
+    ck_assert_int_eq(fs_ops.unlink("/lazyfile"), 0);
+    free(test_data);
+}
+END_TEST
+
+/* Test that a snapshot keeps the tree as it was while the live tree
+ * changes, can't itself be changed, survives a remount, and gives
+ * back what only it was using when it is removed.
+ */
+START_TEST(test_snapshots)
+{
+    struct statvfs st_before, st_taken, st;
+    struct stat sb;
+    char *test_data = create_test_data(3 * 4096 + 1000);
+    char buf[3 * 4096 + 1000];
+    char x[100];
+    struct
+    {
+        int count;
+        char seen[10][30];
+    } list;
+    int rv;
+
+    /* the first snapshot allocates the reference table */
+    ck_assert_int_eq(fs_ops.mkdir("/.snapshots/first", 0755), 0);
+    ck_assert_int_eq(fs_ops.rmdir("/.snapshots/first"), 0);
+    rv = fs_ops.statfs("/", &st_before);
+    ck_assert_int_eq(rv, 0);
+
+    ck_assert_int_eq(fs_ops.mkdir("/snapdir", 0755), 0);
+    ck_assert_int_eq(fs_ops.create("/snapdir/file", 0644 | S_IFREG, NULL), 0);
+    rv = fs_ops.write("/snapdir/file", test_data, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, sizeof(buf));
+    ck_assert_int_eq(fs_ops.release("/snapdir/file", NULL), 0);
+    ck_assert_int_eq(fs_ops.create("/snapgone", 0644 | S_IFREG, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/snapgone", test_data, 100, 0, NULL), 100);
+    rv = fs_ops.statfs("/", &st_taken);
+    ck_assert_int_eq(rv, 0);
+
+    /* taking one costs a copy of the root inode, nothing more */
+    ck_assert_int_eq(fs_ops.mkdir("/.snapshots/snap1", 0755), 0);
+    ck_assert_int_eq(fs_ops.mkdir("/.snapshots/snap1", 0755), -EEXIST);
+    ck_assert_int_eq(fs_ops.mkdir("/.snapshots", 0755), -EEXIST);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_taken.f_bfree - 1);
+
+    /* change the live tree in every way there is */
+    memset(x, 'x', sizeof(x));
+    ck_assert_int_eq(fs_ops.write("/snapdir/file", x, sizeof(x), 4000, NULL), sizeof(x));
+    struct fuse_bufvec bv = FUSE_BUFVEC_INIT(sizeof(x));
+    bv.buf[0].mem = x;
+    ck_assert_int_eq(fs_ops.write_buf("/snapdir/file", &bv, 0, NULL), sizeof(x));
+    ck_assert_int_eq(fs_ops.truncate("/snapdir/file", 9000), 0);
+    ck_assert_int_eq(fs_ops.chmod("/snapdir/file", 0600), 0);
+    ck_assert_int_eq(fs_ops.unlink("/snapgone"), 0);
+    ck_assert_int_eq(fs_ops.create("/snapnew", 0644 | S_IFREG, NULL), 0);
+    ck_assert_int_eq(fs_ops.mkdir("/snapdir/sub", 0755), 0);
+    ck_assert_int_eq(fs_ops.rename("/snapdir/file", "/snapdir/sub/file"), 0);
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        /* the snapshot still has the tree as it was */
+        ck_assert_int_eq(fs_ops.getattr("/.snapshots", &sb), 0);
+        ck_assert(S_ISDIR(sb.st_mode));
+        memset(&list, 0, sizeof(list));
+        ck_assert_int_eq(fs_ops.readdir("/.snapshots", &list, test_readdir_callback, 0, NULL), 0);
+        ck_assert_int_eq(list.count, 1);
+        ck_assert_str_eq(list.seen[0], "snap1");
+
+        ck_assert_int_eq(fs_ops.getattr("/.snapshots/snap1/snapdir/file", &sb), 0);
+        ck_assert_int_eq(sb.st_size, sizeof(buf));
+        ck_assert_int_eq(sb.st_mode & 0777, 0644);
+        rv = fs_ops.read("/.snapshots/snap1/snapdir/file", buf, sizeof(buf), 0, NULL);
+        ck_assert_int_eq(rv, sizeof(buf));
+        ck_assert(memcmp(buf, test_data, sizeof(buf)) == 0);
+        rv = fs_ops.read("/.snapshots/snap1/snapgone", buf, sizeof(buf), 0, NULL);
+        ck_assert_int_eq(rv, 100);
+        ck_assert(memcmp(buf, test_data, 100) == 0);
+        ck_assert_int_eq(fs_ops.getattr("/.snapshots/snap1/snapnew", &sb), -ENOENT);
+        ck_assert_int_eq(fs_ops.getattr("/.snapshots/snap1/snapdir/sub", &sb), -ENOENT);
+        ck_assert_int_eq(fs_ops.getattr("/.snapshots/nosuch", &sb), -ENOENT);
+
+        /* while the live tree has the changes */
+        rv = fs_ops.read("/snapdir/sub/file", buf, sizeof(buf), 0, NULL);
+        ck_assert_int_eq(rv, 9000);
+        ck_assert(memcmp(buf, x, sizeof(x)) == 0);
+        ck_assert(memcmp(buf + 100, test_data + 100, 3900) == 0);
+        ck_assert(memcmp(buf + 4000, x, sizeof(x)) == 0);
+        ck_assert(memcmp(buf + 4100, test_data + 4100, 4900) == 0);
+        ck_assert_int_eq(fs_ops.getattr("/snapgone", &sb), -ENOENT);
+
+        /* the snapshot can't be changed */
+        rv = fs_ops.write("/.snapshots/snap1/snapdir/file", x, sizeof(x), 0, NULL);
+        ck_assert_int_eq(rv, -EROFS);
+        ck_assert_int_eq(fs_ops.truncate("/.snapshots/snap1/snapdir/file", 0), -EROFS);
+        ck_assert_int_eq(fs_ops.unlink("/.snapshots/snap1/snapgone"), -EROFS);
+        ck_assert_int_eq(fs_ops.create("/.snapshots/snap1/x", 0644 | S_IFREG, NULL), -EROFS);
+        ck_assert_int_eq(fs_ops.mkdir("/.snapshots/snap1/snapdir/x", 0755), -EROFS);
+        ck_assert_int_eq(fs_ops.rename("/snapnew", "/.snapshots/snap1/snapnew"), -EROFS);
+
+        /* and it is still there after a remount */
+        fs_ops.destroy(NULL);
+        fs_ops.init(NULL);
+    }
+
+    /* what the snapshot shares stays allocated until it goes */
+    ck_assert_int_eq(fs_ops.unlink("/snapdir/sub/file"), 0);
+    ck_assert_int_eq(fs_ops.rmdir("/snapdir/sub"), 0);
+    ck_assert_int_eq(fs_ops.rmdir("/snapdir"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/snapnew"), 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_lt(st.f_bfree, st_before.f_bfree);
+    rv = fs_ops.read("/.snapshots/snap1/snapdir/file", buf, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, sizeof(buf));
+    ck_assert(memcmp(buf, test_data, sizeof(buf)) == 0);
+
+    ck_assert_int_eq(fs_ops.rmdir("/.snapshots/snap1"), 0);
+    ck_assert_int_eq(fs_ops.rmdir("/.snapshots/snap1"), -ENOENT);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree);
+
+    free(test_data);
+}
+END_TEST
+
+/* Test cloning a file with FS_IOC_CLONE: the clone shares the data
+ * until either side writes, and each side sees only its own writes */
+START_TEST(test_clone)
+{
+    struct statvfs st_start, st_before, st;
+    struct stat sb;
+    struct fs_clone_arg arg;
+    char *test_data = create_test_data(3 * 4096 + 1000);
+    char buf[3 * 4096 + 1000];
+    char x[100];
+    int rv;
+
+    rv = fs_ops.statfs("/", &st_start);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(fs_ops.create("/clonesrc", 0644 | S_IFREG, NULL), 0);
+    rv = fs_ops.write("/clonesrc", test_data, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, sizeof(buf));
+    ck_assert_int_eq(fs_ops.release("/clonesrc", NULL), 0);
+    ck_assert_int_eq(fs_ops.create("/clonedst", 0600 | S_IFREG, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/clonedst", x, sizeof(x), 0, NULL), sizeof(x));
+    rv = fs_ops.statfs("/", &st_before);
+    ck_assert_int_eq(rv, 0);
+
+    /* a handle opened and read before the clone sees the new size and
+     * data through the same handle afterwards */
+    struct fuse_file_info fi = {.flags = O_RDWR};
+    ck_assert_int_eq(fs_ops.open("/clonedst", &fi), 0);
+    ck_assert_int_eq(fs_ops.read("/clonedst", buf, sizeof(buf), 0, &fi), sizeof(x));
+
+    /* not while the kernel may be caching the target */
+    strcpy(arg.src, "/clonesrc");
+    fs_kernel_cache = 1;
+    ck_assert_int_eq(fs_ops.ioctl("/clonedst", FS_IOC_CLONE, NULL, &fi, 0, &arg), -EOPNOTSUPP);
+    ck_assert_int_eq(fs_ops.mkdir("/.snapshots/cached", 0755), -EOPNOTSUPP);
+    fs_kernel_cache = 0;
+
+    /* only the packed tail is copied */
+    ck_assert_int_eq(fs_ops.ioctl("/clonedst", FS_IOC_CLONE, NULL, &fi, 0, &arg), 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 1);
+    ck_assert_int_eq(fs_ops.getattr("/clonedst", &sb), 0);
+    ck_assert_int_eq(sb.st_size, sizeof(buf));
+    ck_assert_int_eq(sb.st_mode & 0777, 0600);
+    rv = fs_ops.read("/clonedst", buf, sizeof(buf), 0, &fi);
+    ck_assert_int_eq(rv, sizeof(buf));
+    ck_assert(memcmp(buf, test_data, sizeof(buf)) == 0);
+    ck_assert_int_eq(fs_ops.release("/clonedst", &fi), 0);
+    rv = fs_ops.read("/clonedst", buf, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, sizeof(buf));
+    ck_assert(memcmp(buf, test_data, sizeof(buf)) == 0);
+
+    /* writes to either side don't show in the other */
+    memset(x, 'x', sizeof(x));
+    ck_assert_int_eq(fs_ops.write("/clonedst", x, sizeof(x), 5000, NULL), sizeof(x));
+    struct fuse_bufvec bv = FUSE_BUFVEC_INIT(sizeof(x));
+    bv.buf[0].mem = x;
+    ck_assert_int_eq(fs_ops.write_buf("/clonesrc", &bv, 100, NULL), sizeof(x));
+    rv = fs_ops.read("/clonedst", buf, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, sizeof(buf));
+    ck_assert(memcmp(buf, test_data, 5000) == 0);
+    ck_assert(memcmp(buf + 5000, x, sizeof(x)) == 0);
+    ck_assert(memcmp(buf + 5100, test_data + 5100, sizeof(buf) - 5100) == 0);
+    rv = fs_ops.read("/clonesrc", buf, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, sizeof(buf));
+    ck_assert(memcmp(buf, test_data, 100) == 0);
+    ck_assert(memcmp(buf + 100, x, sizeof(x)) == 0);
+    ck_assert(memcmp(buf + 200, test_data + 200, sizeof(buf) - 200) == 0);
+
+    /* a write to a shared block that can't drop its reference, because
+     * the reference table can't be written, fails and changes nothing */
+    uint32_t ref_table = superblock.ref_table;
+    superblock.ref_table = superblock.disk_size;
+    ck_assert_int_eq(fs_ops.write("/clonedst", x, sizeof(x), 8192, NULL), -EIO);
+    superblock.ref_table = ref_table;
+    rv = fs_ops.read("/clonedst", buf, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, sizeof(buf));
+    ck_assert(memcmp(buf + 8192, test_data + 8192, 4096) == 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(fs_ops.write("/clonedst", test_data + 8192, sizeof(x), 8192, NULL), sizeof(x));
+    rv = fs_ops.statfs("/", &st_before);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st_before.f_bfree, st.f_bfree - 1);
+    rv = fs_ops.read("/clonesrc", buf, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, sizeof(buf));
+    ck_assert(memcmp(buf + 8192, test_data + 8192, 4096) == 0);
+
+    /* the clone outlives its source */
+    ck_assert_int_eq(fs_ops.truncate("/clonesrc", 2000), 0);
+    ck_assert_int_eq(fs_ops.unlink("/clonesrc"), 0);
+    rv = fs_ops.read("/clonedst", buf, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, sizeof(buf));
+    ck_assert(memcmp(buf + 8192, test_data + 8192, sizeof(buf) - 8192) == 0);
+
+    /* errors */
+    strcpy(arg.src, "/nosuchfile");
+    ck_assert_int_eq(fs_ops.ioctl("/clonedst", FS_IOC_CLONE, NULL, NULL, 0, &arg), -ENOENT);
+    strcpy(arg.src, "/");
+    ck_assert_int_eq(fs_ops.ioctl("/clonedst", FS_IOC_CLONE, NULL, NULL, 0, &arg), -EISDIR);
+    strcpy(arg.src, "/clonedst");
+    ck_assert_int_eq(fs_ops.ioctl("/clonedst", FS_IOC_CLONE, NULL, NULL, 0, &arg), -EINVAL);
+
+    ck_assert_int_eq(fs_ops.unlink("/clonedst"), 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_start.f_bfree);
+
+    free(test_data);
+}
+END_TEST
+
 /****** ERROR HANDLING TESTS ******/
 
 /* Test error handling for create */
@@ -460,9 +1641,16 @@ START_TEST(test_write_errors)
     rv = fs_ops.write("/offsetfile", data, 10, 0, NULL);
     ck_assert_int_eq(rv, 10);
 
-    /* Try to write with offset beyond file size - should return EINVAL */
+    /* Writing past end of file leaves a hole rather than failing */
     rv = fs_ops.write("/offsetfile", data, 10, 100, NULL);
-    ck_assert_int_eq(rv, -EINVAL);
+    ck_assert_int_eq(rv, 10);
+
+    char read_buffer[200];
+    rv = fs_ops.read("/offsetfile", read_buffer, sizeof(read_buffer), 0, NULL);
+    ck_assert_int_eq(rv, 110);
+    for (int i = 10; i < 100; i++)
+        ck_assert_int_eq(read_buffer[i], 0);
+    ck_assert_int_eq(memcmp(read_buffer + 100, data, 10), 0);
 }
 END_TEST
 
@@ -487,9 +1675,11 @@ START_TEST(test_truncate_errors)
     rv = fs_ops.create("/truncfile2", 0644 | S_IFREG, NULL);
     ck_assert_int_eq(rv, 0);
 
-    /* Try to truncate to non-zero length - should return EINVAL */
-    rv = fs_ops.truncate("/truncfile2", 100);
+    /* Negative lengths, and lengths past the largest file, fail */
+    rv = fs_ops.truncate("/truncfile2", -1);
     ck_assert_int_eq(rv, -EINVAL);
+    rv = fs_ops.truncate("/truncfile2", 11 * 4096);
+    ck_assert_int_eq(rv, -EFBIG);
 }
 END_TEST
 
@@ -643,6 +1833,300 @@ START_TEST(test_many_files)
 }
 END_TEST
 
+/* Test inserts into a directory that spans several blocks: duplicate
+ * names are caught wherever they are, and freed space is reused
+ */
+START_TEST(test_dir_reuse)
+{
+    int rv;
+    struct stat sb;
+    struct statvfs st_before, st;
+    char path[300];
+
+    /* 200-byte names: 19 entries per block, so 50 take 3 blocks */
+#define LONGNAME(buf, i) sprintf(buf, "/reusedir/%0200d", i)
+    rv = fs_ops.mkdir("/reusedir", 0755);
+    ck_assert_int_eq(rv, 0);
+    for (int i = 0; i < 50; i++)
+    {
+        LONGNAME(path, i);
+        ck_assert_int_eq(fs_ops.create(path, 0644 | S_IFREG, NULL), 0);
+    }
+    rv = fs_ops.getattr("/reusedir", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sb.st_size, 3 * 4096);
+
+    /* Names in the first and last blocks already exist. Remount
+     * first, so that the check also has to rebuild the slot map
+     */
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    LONGNAME(path, 0);
+    ck_assert_int_eq(fs_ops.create(path, 0644 | S_IFREG, NULL), -EEXIST);
+    ck_assert_int_eq(fs_ops.mkdir(path, 0755), -EEXIST);
+    LONGNAME(path, 49);
+    ck_assert_int_eq(fs_ops.create(path, 0644 | S_IFREG, NULL), -EEXIST);
+
+    /* Fill the last block, then free a slot in the first one: the
+     * next insert goes there instead of into a new block
+     */
+    for (int i = 50; i < 57; i++)
+    {
+        LONGNAME(path, i);
+        ck_assert_int_eq(fs_ops.create(path, 0644 | S_IFREG, NULL), 0);
+    }
+    LONGNAME(path, 5);
+    ck_assert_int_eq(fs_ops.unlink(path), 0);
+    rv = fs_ops.statfs("/", &st_before);
+    ck_assert_int_eq(rv, 0);
+    LONGNAME(path, 100);
+    ck_assert_int_eq(fs_ops.create(path, 0644 | S_IFREG, NULL), 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree - 1);
+    rv = fs_ops.getattr("/reusedir", &sb);
+    ck_assert_int_eq(sb.st_size, 3 * 4096);
+
+    /* ...and once the directory is full, a new block is added */
+    LONGNAME(path, 101);
+    ck_assert_int_eq(fs_ops.create(path, 0644 | S_IFREG, NULL), 0);
+    rv = fs_ops.getattr("/reusedir", &sb);
+    ck_assert_int_eq(sb.st_size, 4 * 4096);
+
+    /* Empty it and start over in a new directory */
+    for (int i = 0; i < 102; i++)
+    {
+        LONGNAME(path, i);
+        fs_ops.unlink(path);
+    }
+    ck_assert_int_eq(fs_ops.rmdir("/reusedir"), 0);
+    ck_assert_int_eq(fs_ops.mkdir("/reusedir", 0755), 0);
+    LONGNAME(path, 0);
+    ck_assert_int_eq(fs_ops.create(path, 0644 | S_IFREG, NULL), 0);
+    ck_assert_int_eq(fs_ops.create(path, 0644 | S_IFREG, NULL), -EEXIST);
+    ck_assert_int_eq(fs_ops.unlink(path), 0);
+    ck_assert_int_eq(fs_ops.rmdir("/reusedir"), 0);
+#undef LONGNAME
+}
+END_TEST
+
+/* Test paths deeper than the old 10-component limit, and paths with
+ * doubled or trailing slashes
+ */
+START_TEST(test_deep_paths)
+{
+    int rv;
+    struct stat sb;
+    char path[256] = "";
+
+    for (int i = 0; i < 16; i++)
+    {
+        strcat(path, "/deep");
+        rv = fs_ops.mkdir(path, 0755);
+        ck_assert_int_eq(rv, 0);
+    }
+    strcat(path, "/file");
+    rv = fs_ops.create(path, 0644 | S_IFREG, NULL);
+    ck_assert_int_eq(rv, 0);
+    rv = fs_ops.write(path, "bottom", 6, 0, NULL);
+    ck_assert_int_eq(rv, 6);
+    rv = fs_ops.getattr(path, &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(sb.st_size, 6);
+
+    /* ...and only there, not one level up */
+    path[strlen(path) - strlen("/deep/file")] = 0;
+    strcat(path, "/file");
+    rv = fs_ops.getattr(path, &sb);
+    ck_assert_int_eq(rv, -ENOENT);
+
+    /* Extra slashes are ignored */
+    rv = fs_ops.getattr("//deep///deep/", &sb);
+    ck_assert_int_eq(rv, 0);
+    ck_assert(S_ISDIR(sb.st_mode));
+
+    /* The root has no name to create, remove or rename */
+    ck_assert_int_eq(fs_ops.mkdir("/", 0755), -EINVAL);
+    ck_assert_int_eq(fs_ops.rmdir("/"), -EINVAL);
+    ck_assert_int_eq(fs_ops.rename("/", "/x"), -EINVAL);
+}
+END_TEST
+
+/* Test getattr from several threads while the file is being changed:
+ * readers never see an error or a half-written inode
+ */
+static volatile int mt_stop;
+
+static void *mt_reader(void *arg)
+{
+    long bad = 0;
+    struct stat sb;
+    while (!mt_stop)
+    {
+        if (fs_ops.getattr("/mtdir/sub/file", &sb) != 0)
+            bad++;
+        else if ((sb.st_mode & 0777) != 0644 && (sb.st_mode & 0777) != 0600)
+            bad++;
+        else if (sb.st_size != 0 && sb.st_size != 6000)
+            bad++;
+    }
+    return (void *)bad;
+}
+
+START_TEST(test_concurrent_getattr)
+{
+    pthread_t readers[4];
+    char *test_data = create_test_data(6000);
+
+    ck_assert_int_eq(fs_ops.mkdir("/mtdir", 0755), 0);
+    ck_assert_int_eq(fs_ops.mkdir("/mtdir/sub", 0755), 0);
+    ck_assert_int_eq(fs_ops.create("/mtdir/sub/file", 0644 | S_IFREG, NULL), 0);
+
+    mt_stop = 0;
+    for (int i = 0; i < 4; i++)
+        pthread_create(&readers[i], NULL, mt_reader, NULL);
+
+    for (int i = 0; i < 300; i++)
+    {
+        ck_assert_int_eq(fs_ops.chmod("/mtdir/sub/file", i % 2 ? 0600 : 0644), 0);
+        ck_assert_int_eq(fs_ops.write("/mtdir/sub/file", test_data, 6000, 0, NULL), 6000);
+        ck_assert_int_eq(fs_ops.truncate("/mtdir/sub/file", 0), 0);
+    }
+
+    mt_stop = 1;
+    for (int i = 0; i < 4; i++)
+    {
+        void *bad;
+        pthread_join(readers[i], &bad);
+        ck_assert_int_eq((long)bad, 0);
+    }
+
+    /* A lookup that read "file" from the directory before an unlink
+     * dropped it doesn't put it back in the dentry cache afterwards
+     */
+    struct stat sb;
+    ck_assert_int_eq(fs_ops.getattr("/mtdir/sub/file", &sb), 0); // cached
+    int sub = dcache_lookup(2, "mtdir", 5); // the root is inode 2
+    ck_assert_int_ge(sub, 0);
+    sub = dcache_lookup(sub, "sub", 3);
+    ck_assert_int_ge(sub, 0);
+    int file = dcache_lookup(sub, "file", 4);
+    ck_assert_int_ge(file, 0);
+    uint64_t gen = dcache_generation();
+    ck_assert_int_eq(fs_ops.unlink("/mtdir/sub/file"), 0);
+    dcache_add(sub, "file", 4, file, gen);
+    ck_assert_int_eq(dcache_lookup(sub, "file", 4), -1);
+    ck_assert_int_eq(fs_ops.getattr("/mtdir/sub/file", &sb), -ENOENT);
+
+    ck_assert_int_eq(fs_ops.rmdir("/mtdir/sub"), 0);
+    ck_assert_int_eq(fs_ops.rmdir("/mtdir"), 0);
+    free(test_data);
+}
+END_TEST
+
+/* Test creating and removing files in one directory from several
+ * threads: every create that succeeded leaves its name behind
+ */
+static void *mt_creator(void *arg)
+{
+    long id = (long)arg, bad = 0;
+    char path[64];
+    for (int i = 0; i < 25; i++)
+    {
+        sprintf(path, "/mtcreate/f%ld_%d", id, i);
+        if (fs_ops.create(path, 0644 | S_IFREG, NULL) != 0)
+            bad++;
+        if (i % 2 && fs_ops.unlink(path) != 0)
+            bad++;
+    }
+    return (void *)bad;
+}
+
+START_TEST(test_concurrent_create)
+{
+    pthread_t creators[4];
+    struct statvfs before, after;
+
+    ck_assert_int_eq(fs_ops.statfs("/", &before), 0);
+    ck_assert_int_eq(fs_ops.mkdir("/mtcreate", 0755), 0);
+    for (long i = 0; i < 4; i++)
+        pthread_create(&creators[i], NULL, mt_creator, (void *)i);
+    for (int i = 0; i < 4; i++)
+    {
+        void *bad;
+        pthread_join(creators[i], &bad);
+        ck_assert_int_eq((long)bad, 0);
+    }
+
+    int count = 0;
+    ck_assert_int_eq(fs_ops.readdir("/mtcreate", &count, count_readdir_callback, 0, NULL), 0);
+    ck_assert_int_eq(count, 4 * 13);
+
+    char path[64];
+    for (int id = 0; id < 4; id++)
+        for (int i = 0; i < 25; i += 2)
+        {
+            sprintf(path, "/mtcreate/f%d_%d", id, i);
+            ck_assert_int_eq(fs_ops.unlink(path), 0);
+        }
+    ck_assert_int_eq(fs_ops.rmdir("/mtcreate"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+    ck_assert_int_eq(after.f_bfree, before.f_bfree);
+}
+END_TEST
+
+/* Test remounting, after a clean unmount and without one */
+START_TEST(test_remount)
+{
+    struct statvfs st_before, st;
+    char *test_data = create_test_data(5000);
+    char buf[5000];
+    int rv;
+
+    rv = fs_ops.statfs("/", &st_before);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st_before.f_blocks, 400);
+
+    /* clean: the free count comes from the superblock */
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree);
+    ck_assert_int_eq(st.f_ffree, st_before.f_bfree);
+
+    ck_assert_int_eq(fs_ops.create("/remountfile", 0644 | S_IFREG, NULL), 0);
+    ck_assert_int_eq(fs_ops.write("/remountfile", test_data, 5000, 0, NULL), 5000);
+    ck_assert_int_eq(fs_ops.release("/remountfile", NULL), 0);
+    rv = fs_ops.statfs("/", &st_before);
+    ck_assert_int_eq(rv, 0);
+
+    /* not clean: the bitmap is read at mount */
+    fs_ops.init(NULL);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree);
+
+    fs_ops.destroy(NULL);
+    fs_ops.init(NULL);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_eq(st.f_bfree, st_before.f_bfree);
+
+    rv = fs_ops.read("/remountfile", buf, sizeof(buf), 0, NULL);
+    ck_assert_int_eq(rv, sizeof(buf));
+    ck_assert(memcmp(buf, test_data, sizeof(buf)) == 0);
+
+    /* the first change after a clean mount loads the bitmap */
+    ck_assert_int_eq(fs_ops.unlink("/remountfile"), 0);
+    rv = fs_ops.statfs("/", &st);
+    ck_assert_int_eq(rv, 0);
+    ck_assert_int_gt(st.f_bfree, st_before.f_bfree);
+
+    free(test_data);
+}
+END_TEST
+
 /* Main function */
 int main(int argc, char **argv)
 {
@@ -650,7 +2134,7 @@ int main(int argc, char **argv)
     fprintf(stderr, "[unittest-2] Initializing test2.img...\n");
     system("python gen-disk.py -q disk2.in test2.img");
 
-    block_init("test2.img");
+    disk_init("test2.img");
     fs_ops.init(NULL);
 
     Suite *s = suite_create("fs5600_part2");
@@ -665,6 +2149,20 @@ int main(int argc, char **argv)
     tcase_add_test(tc_write_ops, test_rmdir);
     tcase_add_test(tc_write_ops, test_truncate);
     tcase_add_test(tc_write_ops, test_utime);
+    tcase_add_test(tc_write_ops, test_inline_file);
+    tcase_add_test(tc_write_ops, test_tail_packing);
+    tcase_add_test(tc_write_ops, test_write_buf);
+    tcase_add_test(tc_write_ops, test_sparse_file);
+    tcase_add_test(tc_write_ops, test_truncate_length);
+    tcase_add_test(tc_write_ops, test_rename_move);
+    tcase_add_test(tc_write_ops, test_fallocate);
+    tcase_add_test(tc_write_ops, test_long_names);
+    tcase_add_test(tc_write_ops, test_interleaved_writes);
+    tcase_add_test(tc_write_ops, test_free_extents);
+    tcase_add_test(tc_write_ops, test_log_writes);
+    tcase_add_test(tc_write_ops, test_lazytime);
+    tcase_add_test(tc_write_ops, test_snapshots);
+    tcase_add_test(tc_write_ops, test_clone);
 
     /* Error Handling */
     tcase_add_test(tc_write_ops, test_create_errors);
@@ -678,6 +2176,11 @@ int main(int argc, char **argv)
     tcase_add_test(tc_write_ops, test_multilevel_dirs);
     tcase_add_test(tc_write_ops, test_large_file);
     tcase_add_test(tc_write_ops, test_many_files);
+    tcase_add_test(tc_write_ops, test_dir_reuse);
+    tcase_add_test(tc_write_ops, test_deep_paths);
+    tcase_add_test(tc_write_ops, test_concurrent_getattr);
+    tcase_add_test(tc_write_ops, test_concurrent_create);
+    tcase_add_test(tc_write_ops, test_remount);
 
     suite_add_tcase(s, tc_write_ops);
 